@@ -0,0 +1,20 @@
+/*
+ * avr/interrupt.h - host simulation stand-in for the avr-libc header.
+ * ISR() declares a plain C function with the vector's name. simAvr.cpp calls it when the 
+ * corresponding flag and enable bits are set and the global interrupt flag is on.
+ */
+
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define sei() (SREG |= _BV(SREG_I))
+#define cli() (SREG &= (uint8_t)~_BV(SREG_I))
+
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_NAKED
+#define ISR(vector, ...) extern "C" void vector(void)
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
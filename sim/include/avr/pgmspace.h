@@ -0,0 +1,21 @@
+/*
+ * avr/pgmspace.h - host simulation stand-in for the avr-libc header.
+ * The host has a single address space, so PROGMEM data stays where the compiler puts it and 
+ * the pgm_read and _P functions are plain reads and copies.
+ */
+
+#ifndef SIM_AVR_PGMSPACE_H_
+#define SIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+
+#define memcpy_P(dest, src, n) memcpy((dest), (src), (n))
+
+#endif /* SIM_AVR_PGMSPACE_H_ */
@@ -0,0 +1,18 @@
+/*
+ * util/crc16.h - host simulation stand-in for the avr-libc header.
+ * Only the CRC the firmware uses, written as the C equivalent given in the avr-libc manual.
+ */
+
+#ifndef SIM_UTIL_CRC16_H_
+#define SIM_UTIL_CRC16_H_
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+	data ^= (uint8_t)crc;
+	data ^= (uint8_t)(data << 4);
+	return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+#endif /* SIM_UTIL_CRC16_H_ */
@@ -0,0 +1,18 @@
+/*
+ * util/delay.h - host simulation stand-in for the avr-libc header.
+ * Busy waits become simulated time passing, with interrupts still serviced.
+ */
+
+#ifndef SIM_UTIL_DELAY_H_
+#define SIM_UTIL_DELAY_H_
+
+#include "simAvr.h"
+
+#ifndef F_CPU
+	#define F_CPU SIM_CPU_HZ
+#endif
+
+static inline void _delay_us(double us) { simIdle((uint32_t)(us * (F_CPU / 1000000UL))); }
+static inline void _delay_ms(double ms) { simIdle((uint32_t)(ms * (F_CPU / 1000UL))); }
+
+#endif /* SIM_UTIL_DELAY_H_ */
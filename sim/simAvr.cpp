@@ -0,0 +1,472 @@
+/***************************************************************************************//**
+ * @brief Host model of the Atmega8 registers, timers and interrupt controller.
+ * @details
+ *		See simAvr.h for the model's scope. Only the peripherals the firmware uses are 
+ *		modelled: the three ports, Timer1 (normal and CTC modes, output compare A/B, input
+ *		capture on PB0, overflow), Timer2 (normal and CTC modes), the USART (8N1 frames, 
+ *		double buffered transmitter, two byte receive buffer) and the slave side of the TWI
+ *		unit (the bus master is played by the caller through simTwiSlave()).
+ *//***************************************************************************************/
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& INCLUDES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& INTERRUPT VECTORS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	/* The firmware defines the vectors it uses, the rest stay null.							*/
+	extern "C" void TIMER2_COMP_vect(void)  __attribute__((weak));
+	extern "C" void TIMER2_OVF_vect(void)   __attribute__((weak));
+	extern "C" void TIMER1_CAPT_vect(void)  __attribute__((weak));
+	extern "C" void TIMER1_COMPA_vect(void) __attribute__((weak));
+	extern "C" void TIMER1_COMPB_vect(void) __attribute__((weak));
+	extern "C" void TIMER1_OVF_vect(void)   __attribute__((weak));
+	extern "C" void USART_RXC_vect(void)    __attribute__((weak));
+	extern "C" void USART_UDRE_vect(void)   __attribute__((weak));
+	extern "C" void USART_TXC_vect(void)    __attribute__((weak));
+	extern "C" void TWI_vect(void)          __attribute__((weak));
+
+	/************************************************************************************************/
+	/* STRUCT: simVector_S																			*/
+	/** One entry of the interrupt table, in Atmega8 priority order.								*/
+	/************************************************************************************************/
+	typedef struct simVector_S
+	{
+		uint8_t number;			///< Vector number as listed in the datasheet
+		const char *name;		///< Name, for error reporting
+		simRegId_T enableReg;	///< Register holding the enable bit
+		uint8_t enableBit;		///< Enable bit
+		simRegId_T flagReg;		///< Register holding the flag bit
+		uint8_t flagBit;		///< Flag bit
+		bool autoClear;			///< True if the hardware clears the flag when the vector is taken
+		void (*handler)(void);	///< The firmware's ISR
+	}simVector_T;
+
+	static const simVector_T simVectors[] =
+	{
+		{ 3, "TIMER2_COMP",  eSimReg_TIMSK, OCIE2,  eSimReg_TIFR,  OCF2,  true,  TIMER2_COMP_vect},
+		{ 4, "TIMER2_OVF",   eSimReg_TIMSK, TOIE2,  eSimReg_TIFR,  TOV2,  true,  TIMER2_OVF_vect},
+		{ 5, "TIMER1_CAPT",  eSimReg_TIMSK, TICIE1, eSimReg_TIFR,  ICF1,  true,  TIMER1_CAPT_vect},
+		{ 6, "TIMER1_COMPA", eSimReg_TIMSK, OCIE1A, eSimReg_TIFR,  OCF1A, true,  TIMER1_COMPA_vect},
+		{ 7, "TIMER1_COMPB", eSimReg_TIMSK, OCIE1B, eSimReg_TIFR,  OCF1B, true,  TIMER1_COMPB_vect},
+		{ 8, "TIMER1_OVF",   eSimReg_TIMSK, TOIE1,  eSimReg_TIFR,  TOV1,  true,  TIMER1_OVF_vect},
+		{11, "USART_RXC",    eSimReg_UCSRB, RXCIE,  eSimReg_UCSRA, RXC,   false, USART_RXC_vect},
+		{12, "USART_UDRE",   eSimReg_UCSRB, UDRIE,  eSimReg_UCSRA, UDRE,  false, USART_UDRE_vect},
+		{13, "USART_TXC",    eSimReg_UCSRB, TXCIE,  eSimReg_UCSRA, TXC,   true,  USART_TXC_vect},
+		{17, "TWI",          eSimReg_TWCR,  TWIE,   eSimReg_TWCR,  TWINT, false, TWI_vect},
+	};
+	
+	#define SIM_VECTOR_COUNT (sizeof(simVectors)/sizeof(simVectors[0]))
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& VARIABLES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	simReg8 PORTB(eSimReg_PORTB), PORTC(eSimReg_PORTC), PORTD(eSimReg_PORTD);
+	simReg8 DDRB(eSimReg_DDRB), DDRC(eSimReg_DDRC), DDRD(eSimReg_DDRD);
+	simReg8 PINB(eSimReg_PINB), PINC(eSimReg_PINC), PIND(eSimReg_PIND);
+	simReg8 SREG(eSimReg_SREG), TIMSK(eSimReg_TIMSK), TIFR(eSimReg_TIFR);
+	simReg8 TCCR1A(eSimReg_TCCR1A), TCCR1B(eSimReg_TCCR1B);
+	simReg8 TCCR2(eSimReg_TCCR2), TCNT2(eSimReg_TCNT2), OCR2(eSimReg_OCR2), ASSR(eSimReg_ASSR);
+	simReg8 UCSRA(eSimReg_UCSRA), UCSRB(eSimReg_UCSRB), UCSRC(eSimReg_UCSRC);
+	simReg8 UBRRL(eSimReg_UBRRL), UBRRH(eSimReg_UBRRH), UDR(eSimReg_UDR);
+	simReg8 TWBR(eSimReg_TWBR), TWSR(eSimReg_TWSR), TWAR(eSimReg_TWAR), TWDR(eSimReg_TWDR), TWCR(eSimReg_TWCR);
+	simReg16 TCNT1(eSimReg16_TCNT1), OCR1A(eSimReg16_OCR1A), OCR1B(eSimReg16_OCR1B), ICR1(eSimReg16_ICR1);
+	
+	simStats_T simStats;
+	
+	static uint8_t reg8[eSimReg_COUNT];		///< Register contents
+	static uint16_t reg16[eSimReg16_COUNT];	///< 16 bit register contents
+	static uint8_t pinIn[3];				///< Levels driven onto port B, C and D from outside
+	static uint64_t cycles;					///< CPU cycles since reset
+	static uint32_t t1Prescale;				///< CPU cycles left until the next Timer1 clock
+	static uint32_t t2Prescale;				///< CPU cycles left until the next Timer2 clock
+	static bool t1CompareBlocked;			///< A TCNT1 write blocks the compare match on the next timer clock
+	static uint8_t isrDepth;				///< Nesting level of simulated ISRs
+	static simPortHook_T portHook;			///< See simSetPortHook
+	static simIsrHook_T isrHook;			///< See simSetIsrHook
+	static simEventHook_T eventHook;		///< See simSetEventHook
+	static uint64_t eventCycle;				///< When eventHook wants to be called next
+	static simUartHook_T uartHook;			///< See simSetUartHook
+	static uint32_t uartTxCycles;			///< CPU cycles until the byte in the transmit shift register is out, 0 if idle
+	static uint8_t uartTxShift;				///< Byte in the transmit shift register
+	static uint8_t uartTxBuffer;			///< Byte written to UDR waiting for the shift register, while UDRE is clear
+	static uint8_t uartRx[2];				///< Receive buffer, oldest first
+	static uint8_t uartRxCount;				///< Bytes in uartRx
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& LOCAL FUNCTIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/*****************************************************************************
+	*  Function: prescaleCycles
+	*	Description:															 */
+   /**		Converts a clock select field into CPU cycles per timer clock.
+	* @param cs  The CSx2:0 bits.
+	* @param isTimer2 Timer2 has a different prescaler table to Timer1.
+	* @return CPU cycles per timer clock, 0 if the timer is stopped.
+	****************************************************************************/
+	static uint32_t prescaleCycles(uint8_t cs, bool isTimer2)
+	{
+		static const uint32_t t1[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+		static const uint32_t t2[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+		return isTimer2 ? t2[cs & 7] : t1[cs & 7];
+	}
+
+	/*****************************************************************************
+	*  Function: timer1Clock
+	*	Description:															 */
+   /**		Advances Timer1 by one timer clock.
+	****************************************************************************/
+	static void timer1Clock(void)
+	{
+		uint16_t &tcnt = reg16[eSimReg16_TCNT1];
+		bool ctc = (reg8[eSimReg_TCCR1B] & _BV(WGM12)) != 0;
+		
+		if (!t1CompareBlocked)
+		{
+			if (tcnt == reg16[eSimReg16_OCR1A]) reg8[eSimReg_TIFR] |= _BV(OCF1A);
+			if (tcnt == reg16[eSimReg16_OCR1B]) reg8[eSimReg_TIFR] |= _BV(OCF1B);
+		}
+		t1CompareBlocked = false;
+		
+		if (ctc && tcnt == reg16[eSimReg16_OCR1A]) tcnt = 0;
+		else if (++tcnt == 0) reg8[eSimReg_TIFR] |= _BV(TOV1);
+	}
+	
+	/*****************************************************************************
+	*  Function: timer2Clock
+	*	Description:															 */
+   /**		Advances Timer2 by one timer clock.
+	****************************************************************************/
+	static void timer2Clock(void)
+	{
+		uint8_t &tcnt = reg8[eSimReg_TCNT2];
+		bool ctc = (reg8[eSimReg_TCCR2] & _BV(WGM21)) != 0;
+		
+		if (tcnt == reg8[eSimReg_OCR2]) reg8[eSimReg_TIFR] |= _BV(OCF2);
+		if (ctc && tcnt == reg8[eSimReg_OCR2]) tcnt = 0;
+		else if (++tcnt == 0) reg8[eSimReg_TIFR] |= _BV(TOV2);
+	}
+
+	/*****************************************************************************
+	*  Function: uartFrameCycles
+	*	Description:															 */
+   /**		CPU cycles to send or receive one 8N1 frame at the programmed rate.
+	****************************************************************************/
+	static uint32_t uartFrameCycles(void)
+	{
+		uint32_t ubrr = ((reg8[eSimReg_UBRRH] & 0x0F) << 8) | reg8[eSimReg_UBRRL];
+		return 10 * (ubrr + 1) * ((reg8[eSimReg_UCSRA] & _BV(U2X)) ? 8 : 16);
+	}
+	
+	/*****************************************************************************
+	*  Function: uartClock
+	*	Description:															 */
+   /**		Advances the USART transmitter by one CPU cycle.
+	****************************************************************************/
+	static void uartClock(void)
+	{
+		if (uartTxCycles == 0 || --uartTxCycles) return;
+		if (uartHook) uartHook(uartTxShift);
+		if (reg8[eSimReg_UCSRA] & _BV(UDRE)) reg8[eSimReg_UCSRA] |= _BV(TXC);
+		else
+		{
+			uartTxShift = uartTxBuffer;
+			uartTxCycles = uartFrameCycles();
+			reg8[eSimReg_UCSRA] |= _BV(UDRE);
+		}
+	}
+
+	/*****************************************************************************
+	*  Function: serviceInterrupts
+	*	Description:															 */
+   /**		Takes the highest priority pending interrupt, if the global 
+	*		interrupt flag allows it. The ISR runs to completion (including any
+	*		ISRs nested inside it) before this returns.
+	****************************************************************************/
+	static void serviceInterrupts(void)
+	{
+		while (reg8[eSimReg_SREG] & _BV(SREG_I))
+		{
+			const simVector_T *vector = 0;
+			for (uint8_t n = 0; n < SIM_VECTOR_COUNT; n++)
+			{
+				const simVector_T *v = &simVectors[n];
+				if ((reg8[v->enableReg] & _BV(v->enableBit)) && (reg8[v->flagReg] & _BV(v->flagBit)))
+				{
+					vector = v;
+					break;
+				}
+			}
+			if (vector == 0) return;
+			if (vector->handler == 0)
+			{
+				fprintf(stderr, "sim: %s interrupt enabled without an ISR (would reset the part)\n", vector->name);
+				exit(2);
+			}
+			
+			if (vector->autoClear) reg8[vector->flagReg] &= ~_BV(vector->flagBit);
+			reg8[eSimReg_SREG] &= ~_BV(SREG_I);
+			uint64_t start = cycles;
+			isrDepth++;
+			simIdle(SIM_ISR_CYCLES / 2);	//Vector and prologue
+			if (isrHook) isrHook(vector->number, true);
+			vector->handler();
+			if (isrHook) isrHook(vector->number, false);
+			simIdle(SIM_ISR_CYCLES / 2);	//Epilogue
+			isrDepth--;
+			reg8[eSimReg_SREG] |= _BV(SREG_I);	//reti
+			
+			uint64_t spent = cycles - start;
+			simStats.isrCount[vector->number]++;
+			simStats.isrCycles[vector->number] += spent;
+			if (spent > simStats.isrMaxCycles[vector->number]) simStats.isrMaxCycles[vector->number] = spent;
+		}
+	}
+	
+	/*****************************************************************************
+	*  Function: advance
+	*	Description:															 */
+   /**		Lets cycles pass on the timers without servicing interrupts.
+	****************************************************************************/
+	static void advance(uint32_t n)
+	{
+		while (n--)
+		{
+			cycles++;
+			if (eventHook && cycles >= eventCycle) eventCycle = eventHook(cycles);
+			uint32_t t1 = prescaleCycles(reg8[eSimReg_TCCR1B], false);
+			if (t1 && --t1Prescale == 0) { t1Prescale = t1; timer1Clock(); }
+			uint32_t t2 = prescaleCycles(reg8[eSimReg_TCCR2], true);
+			if (t2 && --t2Prescale == 0) { t2Prescale = t2; timer2Clock(); }
+			uartClock();
+		}
+	}
+	
+	/*****************************************************************************
+	*  Function: pinLevels
+	*	Description:															 */
+   /**		Returns what a PINx read sees: outputs read back their PORTx bit,
+	*		inputs read the level driven from outside.
+	****************************************************************************/
+	static uint8_t pinLevels(uint8_t port)
+	{
+		uint8_t ddr = reg8[eSimReg_DDRB + port];
+		return (reg8[eSimReg_PORTB + port] & ddr) | (pinIn[port] & ~ddr);
+	}
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& REGISTER ACCESS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	simReg8::operator uint8_t() const
+	{
+		simIdle(SIM_IO_CYCLES);
+		switch (_id)
+		{
+			case eSimReg_PINB: return pinLevels(0);
+			case eSimReg_PINC: return pinLevels(1);
+			case eSimReg_PIND: return pinLevels(2);
+			case eSimReg_UDR:
+			{
+				uint8_t value = uartRx[0];
+				if (uartRxCount) uartRx[0] = uartRx[1];
+				if (uartRxCount && --uartRxCount == 0) reg8[eSimReg_UCSRA] &= ~_BV(RXC);
+				reg8[eSimReg_UCSRA] &= ~(_BV(FE) | _BV(DOR));
+				return value;
+			}
+			default: return reg8[_id];
+		}
+	}
+	
+	simReg8& simReg8::operator=(int v)
+	{
+		uint8_t value = (uint8_t)v;
+		switch (_id)
+		{
+			case eSimReg_TIFR:
+				reg8[_id] &= ~value;	//Flags are cleared by writing a one
+				break;
+			case eSimReg_UCSRA:
+				//U2X and MPCM are the only bits software sets, TXC is cleared by writing a one
+				reg8[_id] = (reg8[_id] & ~(_BV(U2X) | _BV(MPCM) | (value & _BV(TXC)))) | (value & (_BV(U2X) | _BV(MPCM)));
+				break;
+			case eSimReg_TWCR:
+				//TWINT is cleared by writing a one, which lets the bus go on
+				reg8[_id] = (value & ~_BV(TWINT)) | (reg8[_id] & ~value & _BV(TWINT));
+				break;
+			case eSimReg_UDR:
+				if (!(reg8[eSimReg_UCSRB] & _BV(TXEN))) break;
+				if (uartTxCycles == 0)
+				{
+					uartTxShift = (uint8_t)value;
+					uartTxCycles = uartFrameCycles();
+				}
+				else if (reg8[eSimReg_UCSRA] & _BV(UDRE))
+				{
+					uartTxBuffer = (uint8_t)value;
+					reg8[eSimReg_UCSRA] &= ~_BV(UDRE);
+				}
+				break;
+			case eSimReg_TCCR1B:
+				if ((value & 7) != (reg8[_id] & 7)) t1Prescale = prescaleCycles(value, false);
+				reg8[_id] = value;
+				break;
+			case eSimReg_TCCR2:
+				if ((value & 7) != (reg8[_id] & 7)) t2Prescale = prescaleCycles(value, true);
+				reg8[_id] = value;
+				break;
+			case eSimReg_PORTB:
+			case eSimReg_PORTC:
+			case eSimReg_PORTD:
+			case eSimReg_DDRB:
+			case eSimReg_DDRC:
+			case eSimReg_DDRD:
+				reg8[_id] = value;
+				if (portHook) portHook((simRegId_T)_id, value);
+				break;
+			default:
+				reg8[_id] = value;
+				break;
+		}
+		simIdle(SIM_IO_CYCLES);
+		return *this;
+	}
+	
+	simReg16::operator uint16_t() const
+	{
+		simIdle(SIM_IO16_CYCLES);
+		return reg16[_id];
+	}
+	
+	simReg16& simReg16::operator=(unsigned int value)
+	{
+		reg16[_id] = (uint16_t)value;
+		if (_id == eSimReg16_TCNT1) t1CompareBlocked = true;
+		simIdle(SIM_IO16_CYCLES);
+		return *this;
+	}
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& PUBLIC FUNCTIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	void simReset(void)
+	{
+		memset(reg8, 0, sizeof(reg8));
+		memset(reg16, 0, sizeof(reg16));
+		memset(pinIn, 0, sizeof(pinIn));
+		memset(&simStats, 0, sizeof(simStats));
+		reg8[eSimReg_UCSRA] = _BV(UDRE);
+		reg8[eSimReg_TWSR] = 0xF8;	//No state information
+		cycles = 0;
+		t1Prescale = t2Prescale = 1;
+		t1CompareBlocked = false;
+		isrDepth = 0;
+		uartTxCycles = 0;
+		uartRxCount = 0;
+	}
+	
+	void simIdle(uint32_t n)
+	{
+		//Interrupts can preempt at any cycle, so a long idle must not delay them to its end.
+		serviceInterrupts();
+		while (n--)
+		{
+			advance(1);
+			serviceInterrupts();
+		}
+	}
+	
+	uint64_t simCycles(void)
+	{
+		return cycles;
+	}
+	
+	void simSetPin(simRegId_T pinReg, uint8_t bit, bool level)
+	{
+		uint8_t port = pinReg - eSimReg_PINB;
+		bool was = (pinIn[port] >> bit) & 1;
+		if (level) pinIn[port] |= _BV(bit);
+		else pinIn[port] &= ~_BV(bit);
+		
+		//Timer1 input capture on ICP1 (PB0)
+		if (pinReg == eSimReg_PINB && bit == 0 && was != level)
+		{
+			bool risingEdge = (reg8[eSimReg_TCCR1B] & _BV(ICES1)) != 0;
+			if (level == risingEdge)
+			{
+				reg16[eSimReg16_ICR1] = reg16[eSimReg16_TCNT1];
+				reg8[eSimReg_TIFR] |= _BV(ICF1);
+			}
+		}
+	}
+	
+	void simUartReceive(uint8_t data)
+	{
+		if (!(reg8[eSimReg_UCSRB] & _BV(RXEN))) return;
+		if (uartRxCount == 2)
+		{
+			reg8[eSimReg_UCSRA] |= _BV(DOR);	//The byte in the shift register is lost
+			return;
+		}
+		uartRx[uartRxCount++] = data;
+		reg8[eSimReg_UCSRA] |= _BV(RXC);
+	}
+	
+	uint32_t simUartFrameCycles(void)
+	{
+		return uartFrameCycles();
+	}
+	
+	void simSetUartHook(simUartHook_T hook)
+	{
+		uartHook = hook;
+	}
+	
+	bool simTwiSlave(uint8_t status, uint8_t data)
+	{
+		if (reg8[eSimReg_TWCR] & _BV(TWINT)) return false;
+		reg8[eSimReg_TWSR] = (reg8[eSimReg_TWSR] & 0x03) | status;
+		reg8[eSimReg_TWDR] = data;
+		reg8[eSimReg_TWCR] |= _BV(TWINT);
+		return true;
+	}
+	
+	void simSetPortHook(simPortHook_T hook)
+	{
+		portHook = hook;
+	}
+	
+	void simSetIsrHook(simIsrHook_T hook)
+	{
+		isrHook = hook;
+	}
+	
+	void simSetEventHook(simEventHook_T hook, uint64_t firstCycle)
+	{
+		eventHook = hook;
+		eventCycle = firstCycle;
+	}
+	
+	uint8_t simRaw8(simRegId_T reg)
+	{
+		return reg8[reg];
+	}
@@ -0,0 +1,179 @@
+/***************************************************************************************//**
+ * @brief Host model of the Atmega8 registers used by the tripolar firmware.
+ * @details
+ *		Every register the firmware touches is a simReg8/simReg16 object instead of a 
+ *		memory mapped location. Each access costs SIM_IO_CYCLES CPU cycles, advances Timer1 
+ *		and Timer2 by that many cycles, and gives pending interrupts a chance to run, which is
+ *		close enough to the real part for checking waveforms, dead time and ISR timing.
+ *		Time only moves on register accesses, _delay_us() and simIdle(), so pure computation
+ *		is free unless the caller charges it with simIdle().
+ *//***************************************************************************************/
+
+#ifndef SIMAVR_H_
+#define SIMAVR_H_
+
+#include <stdint.h>
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& MACROS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	#define SIM_CPU_HZ			16000000UL	///< Simulated CPU clock
+	#define SIM_IO_CYCLES		1			///< CPU cycles charged for an 8 bit register access
+	#define SIM_IO16_CYCLES		2			///< CPU cycles charged for a 16 bit register access
+	#define SIM_ISR_CYCLES		30
+		/**< Cycles charged for vectoring into an ISR plus a typical avr-gcc prologue and epilogue
+		 * (4 to vector, ~13 to push, ~13 to pop and reti).										*/
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& CLASS DEFINITIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/	
+
+/********************************************************************************************************/
+/* CLASS: simReg8																						*/
+/** An 8 bit i/o register. Reads and writes are routed through simAccess8 so that each register can
+ *  have its own side effects (flag clearing, pin changes, ...).										*/
+/********************************************************************************************************/
+class simReg8
+{
+	public:
+		explicit constexpr simReg8(uint8_t id) : _id(id) {}
+		operator uint8_t() const;
+		simReg8& operator=(int value);
+		simReg8& operator=(const simReg8 &other) { return *this = (int)(uint8_t)other; }
+		simReg8& operator|=(int value) { return *this = (uint8_t)(*this | value); }
+		simReg8& operator&=(int value) { return *this = (uint8_t)(*this & value); }
+		simReg8& operator^=(int value) { return *this = (uint8_t)(*this ^ value); }
+	private:
+		uint8_t _id; ///< One of simRegId_T
+};
+
+/********************************************************************************************************/
+/* CLASS: simReg16																						*/
+/** A 16 bit timer register (TCNT1, OCR1A, ICR1...).													*/
+/********************************************************************************************************/
+class simReg16
+{
+	public:
+		explicit constexpr simReg16(uint8_t id) : _id(id) {}
+		operator uint16_t() const;
+		simReg16& operator=(unsigned int value);
+		simReg16& operator=(const simReg16 &other) { return *this = (unsigned int)(uint16_t)other; }
+		simReg16& operator+=(unsigned int value) { return *this = (uint16_t)(*this + value); }
+	private:
+		uint8_t _id; ///< One of simReg16Id_T
+};
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& STRUCTURES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/************************************************************************************************/
+	/* ENUM: simRegId_E																				*/
+	/** Identifies each modelled register.															*/
+	/************************************************************************************************/
+	typedef enum simRegId_E
+	{
+		eSimReg_PORTB, eSimReg_PORTC, eSimReg_PORTD,
+		eSimReg_DDRB,  eSimReg_DDRC,  eSimReg_DDRD,
+		eSimReg_PINB,  eSimReg_PINC,  eSimReg_PIND,
+		eSimReg_SREG,  eSimReg_TIMSK, eSimReg_TIFR,
+		eSimReg_TCCR1A, eSimReg_TCCR1B, eSimReg_TCCR2, eSimReg_TCNT2, eSimReg_OCR2, eSimReg_ASSR,
+		eSimReg_UCSRA, eSimReg_UCSRB, eSimReg_UCSRC, eSimReg_UBRRL, eSimReg_UBRRH, eSimReg_UDR,
+		eSimReg_TWBR, eSimReg_TWSR, eSimReg_TWAR, eSimReg_TWDR, eSimReg_TWCR,
+		eSimReg_COUNT
+	}simRegId_T;
+	
+	/************************************************************************************************/
+	/* ENUM: simReg16Id_E																			*/
+	/** Identifies each modelled 16 bit register.													*/
+	/************************************************************************************************/
+	typedef enum simReg16Id_E
+	{
+		eSimReg16_TCNT1, eSimReg16_OCR1A, eSimReg16_OCR1B, eSimReg16_ICR1,
+		eSimReg16_COUNT
+	}simReg16Id_T;
+
+	/************************************************************************************************/
+	/* STRUCT: simStats_S																			*/
+	/** Counters kept by the model, reported at the end of a run.									*/
+	/************************************************************************************************/
+	typedef struct simStats_S
+	{
+		uint64_t isrCount[32];		///< Number of times each vector was taken
+		uint64_t isrCycles[32];		///< Cycles spent inside each vector, including nested ISRs
+		uint64_t isrMaxCycles[32];	///< Longest single run of each vector
+	}simStats_T;
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& GLOBAL VARIABLE DECLARATIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	extern simReg8 PORTB, PORTC, PORTD, DDRB, DDRC, DDRD, PINB, PINC, PIND;
+	extern simReg8 SREG, TIMSK, TIFR, TCCR1A, TCCR1B, TCCR2, TCNT2, OCR2, ASSR;
+	extern simReg8 UCSRA, UCSRB, UCSRC, UBRRL, UBRRH, UDR;
+	extern simReg8 TWBR, TWSR, TWAR, TWDR, TWCR;
+	extern simReg16 TCNT1, OCR1A, OCR1B, ICR1;
+	
+	extern simStats_T simStats;
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& FUNCTION PROTOTYPES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	void simReset(void);
+	/**< Puts every register back to its power on value and the clock back to zero.				*/
+	
+	void simIdle(uint32_t cycles);
+	/**< Lets the given number of CPU cycles pass, servicing timers and interrupts as they occur.
+	 * Used for _delay_us(), busy loops and to charge main loop computation.						*/
+	
+	uint64_t simCycles(void);
+	/**< Returns the number of CPU cycles since simReset().										*/
+	
+	void simSetPin(simRegId_T pinReg, uint8_t bit, bool level);
+	/**< Drives an input pin from the outside world (servo pulses, serial data...). Edges on PB0
+	 * are seen by the Timer1 input capture unit.													*/
+	
+	typedef void (*simPortHook_T)(simRegId_T reg, uint8_t value);
+	void simSetPortHook(simPortHook_T hook);
+	/**< Installs a function which is called whenever a PORTx or DDRx register is written. The 
+	 * trace writer uses this to record FET gate signals.											*/
+	
+	typedef void (*simIsrHook_T)(uint8_t vector, bool isEntry);
+	void simSetIsrHook(simIsrHook_T hook);
+	/**< Installs a function which is called when an ISR is entered and when it returns.		*/
+	
+	typedef uint64_t (*simEventHook_T)(uint64_t cycles);
+	void simSetEventHook(simEventHook_T hook, uint64_t firstCycle);
+	/**< Installs a function which is called once the clock reaches firstCycle. It returns the 
+	 * cycle at which it wants to be called next. Used to generate stimulus such as servo pulses 
+	 * at exact times, even while the firmware sits in a busy loop.								*/
+	
+	void simUartReceive(uint8_t data);
+	/**< Hands the USART a byte whose stop bit has just arrived on rxd. Sets DOR and drops it if 
+	 * the two byte receive buffer is full. Ignored unless RXEN is set.							*/
+	
+	uint32_t simUartFrameCycles(void);
+	/**< CPU cycles one 8N1 USART frame takes at the rate the firmware has programmed.			*/
+	
+	typedef void (*simUartHook_T)(uint8_t data);
+	void simSetUartHook(simUartHook_T hook);
+	/**< Installs a function which is called with each byte as its stop bit leaves txd.			*/
+	
+	bool simTwiSlave(uint8_t status, uint8_t data);
+	/**< Plays one bus event to the TWI slave: puts status in TWSR and data in TWDR and sets TWINT.
+	 * For bytes the slave sent, pass TWDR back as data. Returns false, and does nothing, while 
+	 * TWINT is still set from the last event, i.e. while the slave is stretching SCL.				*/
+	
+	uint8_t simRaw8(simRegId_T reg);
+	/**< Reads a register without side effects or time passing.									*/
+
+#endif /* SIMAVR_H_ */
@@ -0,0 +1,721 @@
+/***************************************************************************************//**
+ * @brief Host simulation of the tripolar firmware.
+ * @details
+ *		Runs the real setup()/loop() from tripolar.cpp against the register model in 
+ *		simAvr.cpp, feeds servo pulses into ICP1 and records the six FET gate signals. 
+ *		The gate signals are written as a VCD trace (view with GTKWave) and checked for 
+ *		shoot-through and for dead time shorter than kFetSwitchTime_uS.
+ *
+ *		Usage: tripolar_sim [-t ms] [-s servo_us] [-p servo_period_us] [-e servo_end_ms] [-r servo_resume_ms] [-m protocol] [-u value] [-i value] [-l loop_cycles] [-v file.vcd]
+ *
+ *		-e stops the servo pulses after servo_end_ms, to check the signal loss timeout.
+ *		-r starts them again at servo_resume_ms, to check the motor follows the servo once it returns.
+ *
+ *		-m picks what is sent on rcp_in: pwm (the default), oneshot125, oneshot42, multishot, ppm,
+ *		dshot150 or dshot300, each carrying the value of a servo_us servo pulse. ppm sends it on
+ *		PPM_CHANNEL of an 8 channel frame, the other channels at 1500 uS.
+ *
+ *		-u sends value every SERIAL_COMMAND_MS on rxd, as a serialLink speed command (a position
+ *		command with POSITION_MODE). Use -p 0 to stop the servo pulses. Telemetry from txd is
+ *		decoded and the last frame printed whenever SERIAL_LINK is defined.
+ *
+ *		-i does the same over I2C every TWI_COMMAND_MS: the speed (or position) is written to 
+ *		twiSlave in latched mode, latched with a general call and the telemetry registers read
+ *		back. Needs TWI_SLAVE.
+ *
+ *		The exit code is non zero if any half bridge had both FETs on at once or violated
+ *		the dead time, so the simulator can gate a build.
+ *//***************************************************************************************/
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& INCLUDES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fets.h"
+#include "bldcPwm.h"
+#include "bldcGimbal.h"
+#include "measureServo.h"
+#include "serialLink.h"
+#include "twiSlave.h"
+#include "millis.h"
+#include <util/crc16.h>
+#include <util/twi.h>
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& MACROS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	#define SIM_CYCLES_PER_US	(SIM_CPU_HZ / 1000000UL)
+	#define VCD_PS_PER_CYCLE	(1000000000000ULL / SIM_CPU_HZ)	///< VCD timescale is 1ps
+	#define DEAD_TIME_CYCLES	(kFetSwitchTime_uS * SIM_CYCLES_PER_US)
+	#define PWM_VECTOR			6	///< TIMER1_COMPA vector number
+	#define PWM_GAP_MAX_CYCLES	(PWM_CYCLE_CNT + PWM_CYCLE_CNT / 4)
+		///< Longest the pwm ISR may go without running: one PWM cycle, plus latency for its edges
+	#define SERVO_EDGES_MAX		32	///< Edges in a DShot frame, the most of any protocol
+	#define SIM_PPM_CHANNELS	8	///< Channels in a -m ppm frame
+	#define SIM_PPM_MARK_US		300	///< Width of a -m ppm channel mark
+	#define SERIAL_COMMAND_MS	10	///< Time between -u commands
+	#define SERIAL_BYTES_MAX	32	///< Longest frame sent or received, with its COBS code bytes and delimiter
+	#define TWI_COMMAND_MS		10	///< Time between -i transfers
+	#define TWI_BYTE_CYCLES		360	///< Address or data byte and its acknowledge at 400kHz
+	#define TWI_POLL_CYCLES		16	///< How often the master looks at SCL while the slave stretches it
+	#define TWI_STEPS_MAX		40	///< Steps in the -i script
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& STRUCTURES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/************************************************************************************************/
+	/* STRUCT: halfBridge_S																			*/
+	/** Gate state and dead time bookkeeping for one motor phase.									*/
+	/************************************************************************************************/
+	typedef struct halfBridge_S
+	{
+		char name;				///< 'A', 'B' or 'C'
+		uint8_t highPD, highPB;	///< P-FET gate bit in the PORTD / PORTB image
+		uint8_t lowPD, lowPB;	///< N-FET gate bit in the PORTD / PORTB image
+		bool highOn, lowOn;		///< Current gate states
+		uint64_t highOffAt;		///< Cycle the high side last turned off
+		uint64_t lowOffAt;		///< Cycle the low side last turned off
+		uint64_t minDead;		///< Shortest dead time seen, in cycles
+		uint32_t deadViolations;	///< Times a FET turned on less than DEAD_TIME_CYCLES after its partner turned off
+		uint32_t shootThrough;	///< Times both FETs were on together
+		uint32_t highEdges;		///< High side turn on count
+	}halfBridge_T;
+
+	/************************************************************************************************/
+	/* ENUM: twiStep_E																				*/
+	/** What the I2C master does in one step of its script.											*/
+	/************************************************************************************************/
+	typedef enum twiStep_E
+	{
+		eTwiStep_WRITE,		///< (Repeated) start and address data, for writing. Address 0 is the general call.
+		eTwiStep_READ,		///< (Repeated) start and address data, for reading.
+		eTwiStep_DATA,		///< Write data.
+		eTwiStep_GET,		///< Read a byte and acknowledge it.
+		eTwiStep_GET_LAST,	///< Read a byte and do not acknowledge it, the end of a read.
+		eTwiStep_STOP,		///< Stop condition.
+		eTwiStep_END,		///< End of the script, which starts again every TWI_COMMAND_MS.
+	}twiStep_T;
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& VARIABLES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	static halfBridge_T bridge[3] =
+	{
+		{'A', ApFET_PD, ApFET_PB, AnFET_PD, AnFET_PB, false, false, 0, 0, ~0ULL, 0, 0, 0},
+		{'B', BpFET_PD, BpFET_PB, BnFET_PD, BnFET_PB, false, false, 0, 0, ~0ULL, 0, 0, 0},
+		{'C', CpFET_PD, CpFET_PB, CnFET_PD, CnFET_PB, false, false, 0, 0, ~0ULL, 0, 0, 0},
+	};
+	
+	static FILE *vcd;					///< Trace output, null if not tracing
+	static uint64_t servoPeriod;		///< Servo frame period in cycles
+	static uint64_t servoEdges[SERVO_EDGES_MAX];	///< Cycles from the start of a frame to each edge, rising first
+	static uint8_t servoEdgeCount;		///< Edges in a frame, 2 for a pulse
+	static uint8_t servoEdge;			///< Next edge of the frame to generate
+	static uint64_t servoFrameStart;	///< Cycle the frame being generated started
+	
+	static uint64_t servoNext;			///< Cycle servoEvent() wants to be called next
+	static uint64_t servoEnd = ~0ULL;	///< Cycle the servo pulses stop (-e)
+	static uint64_t servoResume = ~0ULL;	///< Cycle the servo pulses start again (-r)
+	
+	static uint8_t rxdFrame[SERIAL_BYTES_MAX];	///< Command frame sent on rxd, encoded
+	static uint8_t rxdLength;			///< Bytes in rxdFrame, 0 if not sending commands
+	static uint8_t rxdByte;				///< Next byte of rxdFrame to send
+	static uint64_t rxdNext;			///< Cycle rxdEvent() wants to be called next
+	static uint32_t rxdFrames;			///< Commands sent
+	
+#ifdef SERIAL_LINK
+	static uint8_t txdFrame[SERIAL_BYTES_MAX];	///< Telemetry frame being received from txd, encoded
+	static uint8_t txdLength;			///< Bytes in txdFrame
+	static uint8_t telemetry[SERIAL_BYTES_MAX];	///< Last good telemetry frame, decoded
+	static uint32_t telemetryFrames;	///< Good telemetry frames
+	static uint32_t telemetryBad;		///< Telemetry frames which failed to decode
+#endif
+	
+	static uint8_t twiScript[TWI_STEPS_MAX][2];	///< -i script, twiStep_T and data
+	static uint8_t twiStep;				///< Next step of twiScript
+	static uint64_t twiNext;			///< Cycle twiEvent() wants to be called next
+	static uint64_t twiStart;			///< Cycle the script was last started
+	static bool twiReceiving;			///< The slave is addressed for writing, it gets a stop or repeated start
+	static bool twiGcall;				///< Addressed with the general call
+	static uint8_t twiRead[SERIAL_BYTES_MAX];	///< Bytes read in this run of the script
+	static uint8_t twiReadCount;		///< Bytes in twiRead
+	static uint8_t twiTelemetry[SERIAL_BYTES_MAX];	///< Bytes read in the last complete run
+	static uint32_t twiTransfers;		///< Transfers completed, start to stop
+	static uint32_t twiNacks;			///< Addresses nobody acknowledged
+	static uint64_t twiStretched;		///< Cycles the slave held SCL low
+	
+	static uint64_t pwmIsrLast;			///< Cycle the pwm ISR was last entered, 0 before the first time
+	static uint64_t pwmIsrGapMax;		///< Longest time between two entries of the pwm ISR
+	
+	extern bldcGimbal gimbal;			///< From tripolar.cpp
+	extern measureServo servo;			///< From tripolar.cpp
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& FIRMWARE ENTRY POINTS (tripolar.cpp)
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	void setup(void);
+	void loop(void);
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& FUNCTIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/*****************************************************************************
+	*  Function: vcdChange
+	*	Description:															 */
+   /**		Writes one signal change to the trace.
+	****************************************************************************/
+	static void vcdChange(char id, bool level)
+	{
+		if (!vcd) return;
+		fprintf(vcd, "#%llu\n%d%c\n", (unsigned long long)(simCycles() * VCD_PS_PER_CYCLE), level ? 1 : 0, id);
+	}
+	
+	/*****************************************************************************
+	*  Function: gateHook
+	*	Description:															 */
+   /**		Called on every PORTx/DDRx write. Works out the six gate levels and 
+	*		checks each half bridge for shoot-through and dead time.
+	****************************************************************************/
+	static void gateHook(simRegId_T reg, uint8_t value)
+	{
+		(void)reg; (void)value;
+		uint8_t pd = simRaw8(eSimReg_PORTD), pb = simRaw8(eSimReg_PORTB);
+		uint8_t ddrD = simRaw8(eSimReg_DDRD), ddrB = simRaw8(eSimReg_DDRB);
+		uint64_t now = simCycles();
+		
+		for (uint8_t n = 0; n < 3; n++)
+		{
+			halfBridge_T *b = &bridge[n];
+			//A gate which is not yet an output is pulled off.
+			bool highOn = ((ddrD & b->highPD) | (ddrB & b->highPB)) && ((pd & b->highPD) | (pb & b->highPB)) == 0;
+			bool lowOn  = ((ddrD & b->lowPD)  | (ddrB & b->lowPB))  && ((pd & b->lowPD)  | (pb & b->lowPB))  != 0;
+			
+			if (highOn && !b->highOn)
+			{
+				uint64_t dead = now - b->lowOffAt;
+				if (dead < b->minDead) b->minDead = dead;
+				if (dead < DEAD_TIME_CYCLES) b->deadViolations++;
+				b->highEdges++;
+			}
+			if (lowOn && !b->lowOn)
+			{
+				uint64_t dead = now - b->highOffAt;
+				if (dead < b->minDead) b->minDead = dead;
+				if (dead < DEAD_TIME_CYCLES) b->deadViolations++;
+			}
+			if (!highOn && b->highOn) b->highOffAt = now;
+			if (!lowOn && b->lowOn) b->lowOffAt = now;
+			if (highOn && lowOn) b->shootThrough++;
+			
+			if (highOn != b->highOn) vcdChange('a' + 2*n, highOn);
+			if (lowOn != b->lowOn) vcdChange('b' + 2*n, lowOn);
+			b->highOn = highOn;
+			b->lowOn = lowOn;
+		}
+	}
+	
+	/*****************************************************************************
+	*  Function: isrHook
+	*	Description:															 */
+   /**		Traces the time spent in the pwm ISR, and keeps the longest time
+	*		between two of its entries. Every cycle has an end of cycle entry, 
+	*		so a longer gap means the outputs were left alone for a cycle or 
+	*		more, e.g. because the compare interrupt was lost.
+	****************************************************************************/
+	static void isrHook(uint8_t vector, bool isEntry)
+	{
+		if (vector != PWM_VECTOR) return;
+		vcdChange('i', isEntry);
+		if (!isEntry) return;
+		uint64_t now = simCycles();
+		if (pwmIsrLast && now - pwmIsrLast > pwmIsrGapMax) pwmIsrGapMax = now - pwmIsrLast;
+		pwmIsrLast = now;
+	}
+	
+	/*****************************************************************************
+	*  Function: servoFrame
+	*	Description:															 */
+   /**		Works out the edges of one rcp_in frame.
+	* @param protocol pwm, oneshot125, oneshot42, multishot, ppm, dshot150 or dshot300.
+	* @param servoUs The servo pulse width the frame stands for.
+	* @return False if the protocol is not known.
+	****************************************************************************/
+	static bool servoFrame(const char *protocol, double servoUs)
+	{
+		double widthUs;
+		if (strcmp(protocol, "pwm") == 0) widthUs = servoUs;
+		else if (strcmp(protocol, "oneshot125") == 0) widthUs = servoUs / 8;
+		else if (strcmp(protocol, "oneshot42") == 0) widthUs = servoUs * 42 / 1000;
+		else if (strcmp(protocol, "multishot") == 0) widthUs = 5 + (servoUs - 1000) / 50;
+		else if (strcmp(protocol, "ppm") == 0)
+		{
+			double riseUs = 0;
+			for (uint8_t mark = 0; mark <= SIM_PPM_CHANNELS; mark++)	//A mark before each channel and one after the last
+			{
+				servoEdges[2*mark] = (uint64_t)(riseUs * SIM_CYCLES_PER_US);
+				servoEdges[2*mark + 1] = (uint64_t)((riseUs + SIM_PPM_MARK_US) * SIM_CYCLES_PER_US);
+				riseUs += mark + 1 == PPM_CHANNEL ? servoUs : 1500;
+			}
+			servoEdgeCount = 2 * (SIM_PPM_CHANNELS + 1);
+			return true;
+		}
+		else if (strncmp(protocol, "dshot", 5) == 0)
+		{
+			double bitCycles = (double)SIM_CPU_HZ / (atoi(protocol + 5) * 1000);
+			if (bitCycles < 1) return false;
+			int throttle = 48 + (int)((servoUs - 1000) * 2 + 0.5);
+			if (throttle < 48) throttle = 48;
+			if (throttle > 2047) throttle = 2047;
+			uint16_t value = throttle << 1;	//No telemetry request
+			uint16_t frame = (value << 4) | ((value ^ (value >> 4) ^ (value >> 8)) & 0x0F);
+			for (uint8_t bit = 0; bit < 16; bit++)
+			{
+				bool one = frame & (0x8000 >> bit);
+				servoEdges[2*bit] = (uint64_t)(bit * bitCycles + 0.5);
+				servoEdges[2*bit + 1] = (uint64_t)((bit + (one ? 0.75 : 0.375)) * bitCycles + 0.5);
+			}
+			servoEdgeCount = 32;
+			return true;
+		}
+		else return false;
+		servoEdges[0] = 0;
+		servoEdges[1] = (uint64_t)(widthUs * SIM_CYCLES_PER_US);
+		servoEdgeCount = 2;
+		return true;
+	}
+	
+	/*****************************************************************************
+	*  Function: servoEvent
+	*	Description:															 */
+   /**		Generates the frames worked out by servoFrame() on ICP1 (PB0).
+	****************************************************************************/
+	static uint64_t servoEvent(uint64_t now)
+	{
+		if (servoEdge == 0)
+		{
+			if (now >= servoEnd && now < servoResume) return servoResume;
+			servoFrameStart = now;
+		}
+		bool high = (servoEdge & 1) == 0;
+		simSetPin(eSimReg_PINB, 0, high);
+		vcdChange('s', high);
+		if (++servoEdge < servoEdgeCount) return servoFrameStart + servoEdges[servoEdge];
+		servoEdge = 0;
+		return servoFrameStart + servoPeriod;
+	}
+	
+	/*****************************************************************************
+	*  Function: frameEncode
+	*	Description:															 */
+   /**		Adds the CRC to a serialLink frame and COBS encodes it into rxdFrame.
+	****************************************************************************/
+	static void frameEncode(uint8_t *frame, uint8_t length)
+	{
+		uint16_t crc = 0xFFFF;
+		for (uint8_t n = 0; n < length; n++) crc = _crc_ccitt_update(crc, frame[n]);
+		frame[length++] = (uint8_t)crc;
+		frame[length++] = (uint8_t)(crc >> 8);
+		
+		uint8_t code = 0, out = 1;
+		for (uint8_t n = 0; n < length; n++)
+		{
+			if (frame[n] == 0)
+			{
+				rxdFrame[code] = out - code;
+				code = out++;
+			}
+			else rxdFrame[out++] = frame[n];
+		}
+		rxdFrame[code] = out - code;
+		rxdFrame[out++] = 0;
+		rxdLength = out;
+	}
+	
+	/*****************************************************************************
+	*  Function: rxdEvent
+	*	Description:															 */
+   /**		Sends rxdFrame on rxd every SERIAL_COMMAND_MS, one byte per frame 
+	*		time.
+	****************************************************************************/
+	static uint64_t rxdEvent(uint64_t now)
+	{
+		simUartReceive(rxdFrame[rxdByte]);
+		if (++rxdByte < rxdLength) return now + simUartFrameCycles();
+		rxdByte = 0;
+		rxdFrames++;
+		return now + SERIAL_COMMAND_MS * (SIM_CPU_HZ / 1000) - (rxdLength - 1) * simUartFrameCycles();
+	}
+	
+	/*****************************************************************************
+	*  Function: twiScriptAdd
+	*	Description:															 */
+   /**		Adds a step to the -i script.
+	****************************************************************************/
+	static void twiScriptAdd(twiStep_T step, uint8_t data)
+	{
+		static uint8_t count;
+		twiScript[count][0] = step;
+		twiScript[count][1] = data;
+		count++;
+	}
+	
+	/*****************************************************************************
+	*  Function: twiEvent
+	*	Description:															 */
+   /**		Plays the I2C master, one step of twiScript per byte time. Waits 
+	*		while the slave stretches SCL.
+	****************************************************************************/
+	static uint64_t twiEvent(uint64_t now)
+	{
+		if (simRaw8(eSimReg_TWCR) & _BV(TWINT))
+		{
+			twiStretched += TWI_POLL_CYCLES;
+			return now + TWI_POLL_CYCLES;
+		}
+		
+		uint8_t twcr = simRaw8(eSimReg_TWCR);
+		bool ack = (twcr & _BV(TWEN)) && (twcr & _BV(TWEA));
+		uint8_t step = twiScript[twiStep][0], data = twiScript[twiStep][1];
+		if (twiStep == 0) twiStart = now;
+		
+		switch (step)
+		{
+			case eTwiStep_WRITE:
+			case eTwiStep_READ:
+			{
+				if (twiReceiving)	//Repeated start, the slave sees it as a stop
+				{
+					twiReceiving = false;
+					simTwiSlave(TW_SR_STOP, 0);
+					return now + TWI_POLL_CYCLES;
+				}
+				uint8_t twar = simRaw8(eSimReg_TWAR);
+				bool isRead = step == eTwiStep_READ;
+				twiGcall = data == 0;
+				if (!ack || (data != twar >> 1 && !(twiGcall && !isRead && (twar & _BV(TWGCE)))))
+				{
+					twiNacks++;
+					while (twiScript[twiStep + 1][0] != eTwiStep_STOP) twiStep++;
+					break;
+				}
+				twiReceiving = !isRead;
+				simTwiSlave(isRead ? TW_ST_SLA_ACK : (twiGcall ? TW_SR_GCALL_ACK : TW_SR_SLA_ACK), (data << 1) | isRead);
+				break;
+			}
+			case eTwiStep_DATA:
+				simTwiSlave(twiGcall ? (ack ? TW_SR_GCALL_DATA_ACK : TW_SR_GCALL_DATA_NACK) : (ack ? TW_SR_DATA_ACK : TW_SR_DATA_NACK), data);
+				break;
+			case eTwiStep_GET:
+			case eTwiStep_GET_LAST:
+			{
+				uint8_t byte = simRaw8(eSimReg_TWDR);
+				if (twiReadCount < SERIAL_BYTES_MAX) twiRead[twiReadCount++] = byte;
+				uint8_t status = step == eTwiStep_GET_LAST ? TW_ST_DATA_NACK : (ack ? TW_ST_DATA_ACK : TW_ST_LAST_DATA);
+				simTwiSlave(status, byte);
+				break;
+			}
+			case eTwiStep_STOP:
+				if (twiReceiving) simTwiSlave(TW_SR_STOP, 0);
+				twiReceiving = false;
+				twiTransfers++;
+				break;
+			default:	//eTwiStep_END
+				memcpy(twiTelemetry, twiRead, sizeof(twiTelemetry));
+				twiReadCount = 0;
+				twiStep = 0;
+				return twiStart + TWI_COMMAND_MS * (SIM_CPU_HZ / 1000);
+		}
+		twiStep++;
+		return now + TWI_BYTE_CYCLES;
+	}
+	
+	/*****************************************************************************
+	*  Function: stimulusEvent
+	*	Description:															 */
+   /**		Event hook which runs servoEvent() and rxdEvent() when they are due.
+	****************************************************************************/
+	static uint64_t stimulusEvent(uint64_t now)
+	{
+		if (now >= servoNext) servoNext = servoEvent(now);
+		if (now >= rxdNext) rxdNext = rxdEvent(now);
+		if (now >= twiNext) twiNext = twiEvent(now);
+		uint64_t next = servoNext < rxdNext ? servoNext : rxdNext;
+		return next < twiNext ? next : twiNext;
+	}
+	
+#ifdef SERIAL_LINK
+	/*****************************************************************************
+	*  Function: txdHook
+	*	Description:															 */
+   /**		Collects the telemetry frames coming out of txd and checks them.
+	****************************************************************************/
+	static void txdHook(uint8_t data)
+	{
+		if (data != 0)
+		{
+			if (txdLength < SERIAL_BYTES_MAX) txdFrame[txdLength] = data;
+			txdLength++;
+			return;
+		}
+		
+		uint8_t frame[SERIAL_BYTES_MAX];
+		uint8_t in = 0, out = 0;
+		bool isGood = txdLength <= SERIAL_BYTES_MAX;
+		while (isGood && in < txdLength)
+		{
+			uint8_t code = txdFrame[in++];
+			if (in + code - 1 > txdLength) isGood = false;
+			for (uint8_t n = 1; isGood && n < code; n++) frame[out++] = txdFrame[in++];
+			if (isGood && code != 0xFF && in < txdLength) frame[out++] = 0;
+		}
+		txdLength = 0;
+		
+		uint16_t crc = 0xFFFF;
+		for (uint8_t n = 0; isGood && n + 2 < out; n++) crc = _crc_ccitt_update(crc, frame[n]);
+		isGood = isGood && out > 2 && frame[out - 2] == (uint8_t)crc && frame[out - 1] == (uint8_t)(crc >> 8);
+		if (isGood) isGood = frame[0] == serialLink::eSerialMessage_TELEMETRY && out == SERIAL_TELEMETRY_LENGTH + 2;
+		if (!isGood)
+		{
+			telemetryBad++;
+			return;
+		}
+		memcpy(telemetry, frame, out);
+		telemetryFrames++;
+	}
+#endif
+
+	/*****************************************************************************
+	*  Function: vcdHeader
+	*	Description:															 */
+   /**		Declares the traced signals.
+	****************************************************************************/
+	static void vcdHeader(void)
+	{
+		fprintf(vcd, "$timescale 1ps $end\n$scope module tripolar $end\n");
+		for (uint8_t n = 0; n < 3; n++)
+		{
+			fprintf(vcd, "$var wire 1 %c %cH $end\n", 'a' + 2*n, bridge[n].name);
+			fprintf(vcd, "$var wire 1 %c %cL $end\n", 'b' + 2*n, bridge[n].name);
+		}
+		fprintf(vcd, "$var wire 1 i pwm_isr $end\n$var wire 1 s rcp_in $end\n");
+		fprintf(vcd, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n0a\n0b\n0c\n0d\n0e\n0f\n0i\n0s\n$end\n");
+	}
+
+	/*****************************************************************************
+	*  Function: main
+	*	Description:															 */
+   /**		Runs the simulation and prints a summary.
+	****************************************************************************/
+	int main(int argc, char **argv)
+	{
+		double runMs = 200;
+		double servoUs = 1600;
+		double servoPeriodUs = 20000;
+		uint32_t loopCycles = 200;
+		const char *vcdName = 0;
+		const char *protocol = "pwm";
+		const char *serialValue = 0;
+		const char *twiValue = 0;
+		
+		for (int n = 1; n < argc; n++)
+		{
+			if (n + 1 < argc && strcmp(argv[n], "-t") == 0) runMs = atof(argv[++n]);
+			else if (n + 1 < argc && strcmp(argv[n], "-s") == 0) servoUs = atof(argv[++n]);
+			else if (n + 1 < argc && strcmp(argv[n], "-p") == 0) servoPeriodUs = atof(argv[++n]);
+			else if (n + 1 < argc && strcmp(argv[n], "-e") == 0) servoEnd = (uint64_t)(atof(argv[++n]) * (SIM_CPU_HZ / 1000));
+			else if (n + 1 < argc && strcmp(argv[n], "-r") == 0) servoResume = (uint64_t)(atof(argv[++n]) * (SIM_CPU_HZ / 1000));
+			else if (n + 1 < argc && strcmp(argv[n], "-m") == 0) protocol = argv[++n];
+			else if (n + 1 < argc && strcmp(argv[n], "-u") == 0) serialValue = argv[++n];
+			else if (n + 1 < argc && strcmp(argv[n], "-i") == 0) twiValue = argv[++n];
+			else if (n + 1 < argc && strcmp(argv[n], "-l") == 0) loopCycles = atoi(argv[++n]);
+			else if (n + 1 < argc && strcmp(argv[n], "-v") == 0) vcdName = argv[++n];
+			else
+			{
+				fprintf(stderr, "usage: %s [-t ms] [-s servo_us] [-p servo_period_us] [-e servo_end_ms] [-r servo_resume_ms] [-m protocol] [-u value] [-i value] [-l loop_cycles] [-v file.vcd]\n", argv[0]);
+				return 1;
+			}
+		}
+		
+		if (vcdName)
+		{
+			vcd = fopen(vcdName, "w");
+			if (!vcd) { perror(vcdName); return 1; }
+			vcdHeader();
+		}
+		
+		simReset();
+		simSetPortHook(gateHook);
+		simSetIsrHook(isrHook);
+		servoPeriod = (uint64_t)(servoPeriodUs * SIM_CYCLES_PER_US);
+		if (!servoFrame(protocol, servoUs))
+		{
+			fprintf(stderr, "unknown protocol %s\n", protocol);
+			return 1;
+		}
+		servoNext = rxdNext = twiNext = ~0ULL;
+		if (servoEdges[servoEdgeCount - 1] > 0 && servoEdges[servoEdgeCount - 1] < servoPeriod) servoNext = SIM_CPU_HZ / 100;
+#ifdef SERIAL_LINK
+		if (serialValue)
+		{
+			uint8_t frame[SERIAL_BYTES_MAX];
+			long value = atol(serialValue);
+	#ifdef POSITION_MODE
+			frame[0] = serialLink::eSerialMessage_POSITION;
+			for (uint8_t n = 0; n < 4; n++) frame[1 + n] = (uint8_t)(value >> (8 * n));
+			frameEncode(frame, 5);
+	#else
+			frame[0] = serialLink::eSerialMessage_SPEED;
+			frame[1] = (uint8_t)value;
+			frame[2] = (uint8_t)(value >> 8);
+			frameEncode(frame, 3);
+	#endif
+			rxdNext = SIM_CPU_HZ / 100;
+		}
+		simSetUartHook(txdHook);
+#else
+		if (serialValue)
+		{
+			fprintf(stderr, "-u needs SERIAL_LINK\n");
+			return 1;
+		}
+#endif
+#ifdef TWI_SLAVE
+		if (twiValue)
+		{
+			long value = atol(twiValue);
+			twiScriptAdd(eTwiStep_WRITE, TWI_ADDRESS);
+			twiScriptAdd(eTwiStep_DATA, twiSlave::eTwiReg_MODE);
+			twiScriptAdd(eTwiStep_DATA, twiSlave::eTwiMode_LATCHED);
+	#ifdef POSITION_MODE
+			twiScriptAdd(eTwiStep_DATA, 0);		//Speed, not used
+			twiScriptAdd(eTwiStep_DATA, 0);
+			for (uint8_t n = 0; n < 4; n++) twiScriptAdd(eTwiStep_DATA, (uint8_t)(value >> (8 * n)));
+	#else
+			twiScriptAdd(eTwiStep_DATA, (uint8_t)value);
+			twiScriptAdd(eTwiStep_DATA, (uint8_t)(value >> 8));
+	#endif
+			twiScriptAdd(eTwiStep_STOP, 0);
+			twiScriptAdd(eTwiStep_WRITE, 0);
+			twiScriptAdd(eTwiStep_DATA, twiSlave::eTwiReg_LATCH);
+			twiScriptAdd(eTwiStep_DATA, 1);
+			twiScriptAdd(eTwiStep_STOP, 0);
+			twiScriptAdd(eTwiStep_WRITE, TWI_ADDRESS);
+			twiScriptAdd(eTwiStep_DATA, twiSlave::eTwiReg_TELEMETRY);
+			twiScriptAdd(eTwiStep_READ, TWI_ADDRESS);
+			for (uint8_t n = 1; n < twiSlave::eTwiReg_END_OF_ENUM - twiSlave::eTwiReg_TELEMETRY; n++) twiScriptAdd(eTwiStep_GET, 0);
+			twiScriptAdd(eTwiStep_GET_LAST, 0);
+			twiScriptAdd(eTwiStep_STOP, 0);
+			twiScriptAdd(eTwiStep_END, 0);
+			twiNext = SIM_CPU_HZ / 100;
+		}
+#else
+		if (twiValue)
+		{
+			fprintf(stderr, "-i needs TWI_SLAVE\n");
+			return 1;
+		}
+#endif
+		uint64_t first = servoNext < rxdNext ? servoNext : rxdNext;
+		if (twiNext < first) first = twiNext;
+		if (first != ~0ULL) simSetEventHook(stimulusEvent, first);
+		
+		uint64_t endCycle = (uint64_t)(runMs * SIM_CPU_HZ / 1000);
+		setup();
+		uint64_t startCycle = simCycles();
+		uint32_t lastMicros = micros();
+		uint32_t timeBackwards = 0;
+		while (simCycles() < endCycle)
+		{
+			loop();
+			simIdle(loopCycles);	//Charge the computation in loop() which does not touch a register
+			uint32_t now = micros();
+			if ((int32_t)(now - lastMicros) < 0) timeBackwards++;
+			lastMicros = now;
+		}
+		uint64_t endMicros = (simCycles() - startCycle) / SIM_CYCLES_PER_US;
+		uint32_t timeMicros = micros(), timeMillis = millis();
+		if (vcd) fclose(vcd);
+		
+		//---------------------------------------------------------------------------------
+		// REPORT
+		//---------------------------------------------------------------------------------
+		bool failed = false;
+		double seconds = (double)simCycles() / SIM_CPU_HZ;
+		printf("simulated %.3f ms, servo %.0f us every %.0f us\n", seconds * 1000, servoUs, servoPeriodUs);
+		printf("rcp_in: %s sent, protocol %u decoded, motor at %d rpm\n", protocol, servo.protocol(), (int16_t)gimbal.speed_rpm());
+#ifdef SERIAL_LINK
+		printf("serial: %u commands sent, %u telemetry frames, %u bad\n", rxdFrames, telemetryFrames, telemetryBad);
+		if (telemetryFrames)
+		{
+			const uint8_t *t = telemetry + 1;
+			printf("  telemetry: position %d, %d rpm, power %u, %u link errors, %u commands, isr %u runs %u late, late max %u isr max %u step %u counts\n",
+				(int32_t)(t[0] | t[1] << 8 | t[2] << 16 | (uint32_t)t[3] << 24), (int16_t)(t[4] | t[5] << 8), t[6], t[7], t[8] | t[9] << 8,
+				t[10] | t[11] << 8, t[12] | t[13] << 8, t[14] | t[15] << 8, t[16] | t[17] << 8, t[18] | t[19] << 8);
+		}
+		printf("usart isrs: %llu rx runs, %llu cycles max, %llu udre runs, %llu cycles max\n",
+			(unsigned long long)simStats.isrCount[11], (unsigned long long)simStats.isrMaxCycles[11],
+			(unsigned long long)simStats.isrCount[12], (unsigned long long)simStats.isrMaxCycles[12]);
+#endif
+#ifdef TWI_SLAVE
+		if (twiValue)
+		{
+			const uint8_t *t = twiTelemetry;
+			printf("twi: %u transfers, %u not acknowledged, SCL stretched %.1f us\n", twiTransfers, twiNacks, (double)twiStretched / SIM_CYCLES_PER_US);
+			printf("  registers: position %d, %d rpm, power %u, staged %02x, isr %u runs %u late\n",
+				(int32_t)(t[0] | t[1] << 8 | t[2] << 16 | (uint32_t)t[3] << 24), (int16_t)(t[4] | t[5] << 8), t[6], t[7],
+				t[8] | t[9] << 8, t[10] | t[11] << 8);
+		}
+		printf("twi isr: %llu runs, %llu cycles max\n", (unsigned long long)simStats.isrCount[17], (unsigned long long)simStats.isrMaxCycles[17]);
+#endif
+		printf("timebase: micros() %u us, millis() %u ms, %llu us simulated, %u steps back, %llu overflow isr runs\n",
+			timeMicros, timeMillis, (unsigned long long)endMicros, timeBackwards, (unsigned long long)simStats.isrCount[4]);
+		if (timeBackwards || timeMicros - (uint32_t)endMicros > 100 || timeMillis - timeMicros / 1000 > 1) failed = true;	//setup() runs on after millis_init()
+		printf("pwm isr: %llu runs, %.1f cycles avg, %llu cycles max, %.1f%% cpu, longest gap %.1f us\n",
+			(unsigned long long)simStats.isrCount[PWM_VECTOR],
+			simStats.isrCount[PWM_VECTOR] ? (double)simStats.isrCycles[PWM_VECTOR] / simStats.isrCount[PWM_VECTOR] : 0.0,
+			(unsigned long long)simStats.isrMaxCycles[PWM_VECTOR],
+			100.0 * simStats.isrCycles[PWM_VECTOR] / simCycles(),
+			(double)pwmIsrGapMax / SIM_CYCLES_PER_US);
+		if (pwmIsrGapMax > PWM_GAP_MAX_CYCLES) failed = true;
+		for (uint8_t n = 0; n < 3; n++)
+		{
+			halfBridge_T *b = &bridge[n];
+			printf("phase %c: %u pwm cycles, min dead time %.3f us, %u dead time violations, %u shoot-through\n",
+				b->name, b->highEdges, b->minDead == ~0ULL ? 0.0 : (double)b->minDead / SIM_CYCLES_PER_US,
+				b->deadViolations, b->shootThrough);
+			if (b->deadViolations || b->shootThrough) failed = true;
+		}
+#ifdef PWM_PROFILE
+		bldcPwm::pwmProfile_T profile;
+		bldcPwm::profileSnapshot(&profile);
+		printf("profile: %u isr runs, %u late edges, %u early edges, updateISR last %u max %u counts, %u bad frames\n",
+			profile.isrCount, profile.lateEdges, profile.earlyEdges, profile.updateLast, profile.updateMax, profile.badFrames);
+		if (profile.badFrames) failed = true;
+		for (uint8_t command = 0; command < sizeof(profile.latenessMax)/sizeof(profile.latenessMax[0]); command++)
+		{
+			printf("  command %u: late max %4u [", command, profile.latenessMax[command]);
+			for (uint8_t n = 0; n < PWM_PROFILE_BUCKETS; n++) printf(" %5u", profile.lateness[command][n]);
+			printf(" ]  isr max %4u [", profile.durationMax[command]);
+			for (uint8_t n = 0; n < PWM_PROFILE_BUCKETS; n++) printf(" %5u", profile.duration[command][n]);
+			printf(" ]\n");
+		}
+#endif
+		return failed ? 3 : 0;
+	}
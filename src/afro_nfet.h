@@ -120,6 +120,25 @@ inline void greenOff(){PORTC |= _BV(green_led);}
 #define	CnFET_port	PORTD
 #define	ApFET_port	PORTD
 
+//;*********************
+//; FET PORT IMAGES    *
+//;*********************
+/* Gate bit of each FET within the PORTD and PORTB images stored in the PWM tables (see fets.h).
+ * A FET which is wired to the other port contributes 0.  P-FETs are on when their bit is low, 
+ * N-FETs are on when their bit is high. */
+#define	ApFET_PD	_BV(ApFET)
+#define	ApFET_PB	0
+#define	AnFET_PD	_BV(AnFET)
+#define	AnFET_PB	0
+#define	BpFET_PD	0
+#define	BpFET_PB	_BV(BpFET)
+#define	BnFET_PD	_BV(BnFET)
+#define	BnFET_PB	0
+#define	CpFET_PD	0
+#define	CpFET_PB	_BV(CpFET)
+#define	CnFET_PD	_BV(CnFET)
+#define	CnFET_PB	0
+
 inline void ApFETOn()  { ApFET_port &= ~_BV(ApFET);}
 inline void ApFETOff() { ApFET_port |=  _BV(ApFET);}
 inline void AnFETOn()  { AnFET_port |=  _BV(AnFET);}
@@ -20,6 +20,8 @@
 	#include "millis.h"
 	#include "bldcGimbal.h"
 	#include <stdlib.h>
+	#include <avr/interrupt.h>
+	#include <avr/pgmspace.h>
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& MACROS
@@ -27,100 +29,286 @@
 */
 	#define PHASE_SHIFT_DEGREES 120  //The sine wave phase shift between each coil in degrees
 
-	#define PHASE_SHIFT  (PHASE_SHIFT_DEGREES * 255)/360
-		/* The phase shift converted to the number of pwmSin array elements to displace.
-		 *  = PHASE_SHIFT_DEGREES * 255 / 360													*/
+	#define PHASE_SHIFT  ((uint16_t)((PHASE_SHIFT_DEGREES * 65536UL)/360))
+		/* The phase shift converted to electrical angle counts (65536 per electrical cycle).
+		 *  = PHASE_SHIFT_DEGREES * 65536 / 360													*/
 		 
-    #define SINE_ARRAY_SIZE 256
+	#define SINE_CENTER 0x8000
+		/* Half way between 0 and full scale of sineAt(), the zero of each phase voltage.			*/
+#ifdef PWM_SEQUENTIAL
+	static_assert(3UL * SINE_CENTER == SINE_TOTAL * 256UL, "SINE_TOTAL must be three phases about SINE_CENTER");
+#endif
+
+	#define SVPWM_GAIN 37837
+		/* 2/sqrt(3) in 1.15 fixed point (1.1547 * 32768). Min-max injection brings the peak of each 
+		 * phase down to sqrt(3)/2 of the sine, this takes it back up to the full swing.			*/
+
+	#if SINE_QUARTER_SIZE == 64
+		#define SINE_STEP_SHIFT 8
+	#elif SINE_QUARTER_SIZE == 32
+		#define SINE_STEP_SHIFT 9
+	#elif SINE_QUARTER_SIZE == 16
+		#define SINE_STEP_SHIFT 10
+	#else
+		#error "SINE_QUARTER_SIZE must be 16, 32 or 64"
+	#endif
+		/* Each table step is 65536/4/SINE_QUARTER_SIZE = 2^SINE_STEP_SHIFT electrical angle counts. 
+		 * sineAt() interpolates with the top 8 bits of the position within the step.					*/
+		 
+#ifndef PWM_SEQUENTIAL
+	#define SINE_AMPLITUDE 126
+#else
+	#define SINE_AMPLITUDE 127
+#endif
+		/* Peak of the generated sine above its centre of 128. The parallel table stops at 254, like
+		 * the spreadsheet table it replaces, the sequential one goes to SINE_FULL_SCALE.			*/
+		 
+	#define DUTY_CACHE_STEP 16
+		/* _dutyCache entries fillDutyCache() works out per table update, about 50 uS each time. The 
+		 * whole cache takes 5 updates, driveRotor() scales each phase itself until it is done.		*/
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& CONSTANTS
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 */
 	
-#ifndef PWM_SEQUENTIAL
+	/*****************************************************************************
+	*  Function: sineOf
+	*	Description:															 */
+   /**		sin(x) for 0 <= x <= pi/2, as a Taylor series to the x^17 term, which 
+	*		is far below a table count. constexpr, so the compiler works it out
+	*		while building pwmSinQuarter and none of it ends up in flash.
+	* @param x Angle in radians.
+	* @return sin(x).
+	****************************************************************************/
+	constexpr double sineSeries(double x2, double term, uint8_t n)
+	{
+		return n > 15 ? term : term + sineSeries(x2, -term * x2 / ((n + 1) * (n + 2)), n + 2);
+	}
+	constexpr double sineOf(double x)
+	{
+		return sineSeries(x * x, x, 1);
+	}
+	
+	/*****************************************************************************
+	*  Function: sineEntry
+	*	Description:															 */
+   /**		Table entry n of pwmSinQuarter: 128 + SINE_AMPLITUDE * sin(n * 90 / 
+	*		SINE_QUARTER_SIZE degrees), rounded.
+	****************************************************************************/
+	constexpr uint8_t sineEntry(uint8_t n)
+	{
+		return (uint8_t)(128 + SINE_AMPLITUDE * sineOf(n * (3.14159265358979 / 2) / SINE_QUARTER_SIZE) + 0.5);
+	}
+	static_assert(128 + SINE_AMPLITUDE <= SINE_FULL_SCALE, "SINE_AMPLITUDE goes past SINE_FULL_SCALE");
+	
+	/* The index list 0, 1, ... SINE_QUARTER_SIZE that sineQuarter() expands into one sineEntry() per entry. */
+	template<uint8_t... N> struct sineIndex_S {};
+	template<uint8_t COUNT, uint8_t... N> struct sineIndexList_S : sineIndexList_S<COUNT - 1, COUNT - 1, N...> {};
+	template<uint8_t... N> struct sineIndexList_S<0, N...> { typedef sineIndex_S<N...> list; };
+	
+	struct sineQuarter_S
+	{
+		uint8_t entry[SINE_QUARTER_SIZE + 1];
+	};
+	
+	template<uint8_t... N> constexpr sineQuarter_S sineQuarter(sineIndex_S<N...>)
+	{
+		return sineQuarter_S{ { sineEntry(N)... } };
+	}
+	
 	/*****************************************************************************************************
-	 * ARRAY: pwmSin
+	 * ARRAY: pwmSinQuarter
 	 * DESCRIPTION:
-	 * This is an implementation of a state space sine wave function. This was calculated using 
-	 * the spreadsheet misc/calcs/BLDC_SPWM_Lookup_tables.ods based on the original spreadsheet found
-	 * at http://www.berryjam.eu/wp-content/uploads/2015/04/BLDC_SPWM_Lookup_tables.ods
-	 * This the PWM output corresponds to an element of this array phase shifted 85 degrees. Each
-	 * element is 360/255 degrees = 1.4117 degrees. 
+	 * The first quarter (0 to 90 degrees) of the sine wave the coils are driven with, SINE_QUARTER_SIZE 
+	 * steps, both ends included. sineAt() unfolds it into the full cycle. It is generated when compiling,
+	 * from SINE_QUARTER_SIZE and SINE_AMPLITUDE, and replaces the tables worked out with the spreadsheets
+	 * in misc/calcs. The parallel one had the same 2 to 254 range, and is within 2 counts of this one.
 	*****************************************************************************************************/			
-	const uint8_t pwmSin[SINE_ARRAY_SIZE]=
-	{		
-				128, 	131, 	134, 	137, 	140, 	143, 	146, 	149, 	152, 	156, 	//	0	 to 	9
-				159, 	162, 	165, 	168, 	171, 	174, 	176, 	179, 	182, 	185, 	//	10	 to 	19
-				188, 	191, 	193, 	196, 	199, 	201, 	204, 	206, 	209, 	211, 	//	20	 to 	29
-				213, 	216, 	218, 	220, 	222, 	224, 	226, 	228, 	230, 	232, 	//	30	 to 	39
-				234, 	236, 	237, 	239, 	240, 	242, 	243, 	245, 	246, 	247, 	//	40	 to 	49
-				248, 	249, 	250, 	251, 	252, 	252, 	253, 	254, 	254, 	254, 	//	50	 to 	59
-				254, 	254, 	254, 	254, 	254, 	254, 	254, 	254, 	254, 	254, 	//	60	 to 	69
-				254, 	254, 	253, 	252, 	252, 	251, 	250, 	249, 	248, 	247, 	//	70	 to 	79
-				246, 	245, 	243, 	242, 	240, 	239, 	237, 	236, 	234, 	232, 	//	80	 to 	89
-				230, 	228, 	226, 	224, 	222, 	220, 	218, 	216, 	213, 	211, 	//	90	 to 	99
-				209, 	206, 	204, 	201, 	199, 	196, 	193, 	191, 	188, 	185, 	//	100	 to 	109
-				182, 	179, 	176, 	174, 	171, 	168, 	165, 	162, 	159, 	156, 	//	110	 to 	119
-				152, 	149, 	146, 	143, 	140, 	137, 	134, 	131, 	128, 	124, 	//	120	 to 	129
-				121, 	118, 	115, 	112, 	109, 	106, 	103, 	99, 	96, 	93, 	//	130	 to 	139
-				90, 	87, 	84, 	81, 	79, 	76, 	73, 	70, 	67, 	64, 	//	140	 to 	149
-				62, 	59, 	56, 	54, 	51, 	49, 	46, 	44, 	42, 	39, 	//	150	 to 	159
-				37, 	35, 	33, 	31, 	29, 	27, 	25, 	23, 	21, 	19, 	//	160	 to 	169
-				18, 	16, 	15, 	13, 	12, 	10, 	9, 		8,		7,		6, 		//	170	 to 	179
-				5,		4,		3,		3,		2,		1,		1,		1, 		1,		1, 		//	180	 to 	189
-				1, 		1,	 	1,		1,	 	1,	 	1,	 	1,		1,	 	1,		1, 		//	190	 to 	199
-				2, 		3,		3,		4,	 	5,		6,		7,		8,		9,		10, 	//	200	 to 	209
-				12, 	13, 	15, 	16, 	18, 	19, 	21, 	23, 	25, 	27, 	//	210	 to 	219
-				29, 	31, 	33, 	35, 	37, 	39, 	42, 	44, 	46, 	49, 	//	220	 to 	229
-				51, 	54, 	56, 	59, 	62, 	64, 	67, 	70, 	73, 	76, 	//	230	 to 	239
-				79, 	81, 	84, 	87, 	90, 	93, 	96, 	99, 	103, 	106, 	//	240	 to 	249
-				109, 	112, 	115, 	118, 	121, 	124										//	250	 to 	255
-	};
-		
-#else		
-		/*****************************************************************************************************
-		 * ARRAY: pwmSin
-		 * DESCRIPTION:
-		 * This is an implementation of a standard sine wave table
-		 * This was calculated using
-		 * the spreadsheet misc/calcs/BLDC_SPWM_Lookup_tables.xlsx based on the original spreadsheet found
-		 * at http://www.berryjam.eu/wp-content/uploads/2015/04/BLDC_SPWM_Lookup_tables.ods
-		*****************************************************************************************************/			
-		const uint8_t pwmSin[SINE_ARRAY_SIZE]=
-		{			
-			128,	131,	134,	137,	140,	143,	146,	149,	152,	155,	// From 0 To 9
-			158,	162,	165,	167,	170,	173,	176,	179,	182,	185,	// From 10 To 19
-			188,	190,	193,	196,	198,	201,	203,	206,	208,	211,	// From 20 To 29
-			213,	215,	218,	220,	222,	224,	226,	228,	230,	232,	// From 30 To 39
-			234,	235,	237,	238,	240,	241,	243,	244,	245,	246,	// From 40 To 49
-			248,	249,	250,	250,	251,	252,	253,	253,	254,	254,	// From 50 To 59
-			254,	255,	255,	255,	255,	255,	255,	255,	254,	254,	// From 60 To 69
-			254,	253,	253,	252,	251,	250,	250,	249,	248,	246,	// From 70 To 79
-			245,	244,	243,	241,	240,	238,	237,	235,	234,	232,	// From 80 To 89
-			230,	228,	226,	224,	222,	220,	218,	215,	213,	211,	// From 90 To 99
-			208,	206,	203,	201,	198,	196,	193,	190,	188,	185,	// From 100 To 109
-			182,	179,	176,	173,	170,	167,	165,	162,	158,	155,	// From 110 To 119
-			152,	149,	146,	143,	140,	137,	134,	131,	128,	124,	// From 120 To 129
-			121,	118,	115,	112,	109,	106,	103,	100,	97,		93,		// From 130 To 139
-			90,		88,		85,		82,		79,		76,		73,		70,		67,		65,		// From 140 To 149
-			62,		59,		57,		54,		52,		49,		47,		44,		42,		40,		// From 150 To 159
-			37,		35,		33,		31,		29,		27,		25,		23,		21,		20,		// From 160 To 169
-			18,		17,		15,		14,		12,		11,		10,		9,		7,		6,		// From 170 To 179
-			5,		5,		4,		3,		2,		2,		1,		1,		1,		0,		// From 180 To 189
-			0,		0,		0,		0,		0,		0,		1,		1,		1,		2,		// From 190 To 199
-			2,		3,		4,		5,		5,		6,		7,		9,		10,		11,		// From 200 To 209
-			12,		14,		15,		17,		18,		20,		21,		23,		25,		27,		// From 210 To 219
-			29,		31,		33,		35,		37,		40,		42,		44,		47,		49,		// From 220 To 229
-			52,		54,		57,		59,		62,		65,		67,		70,		73,		76,		// From 230 To 239
-			79,		82,		85,		88,		90,		93,		97,		100,	103,	106,	// From 240 To 249
-			109,	112,	115,	118,	121,	124 									// From 250 To 255
-		};
-		
-		
-																
-			   
+	const sineQuarter_S pwmSinQuarter PROGMEM = sineQuarter(sineIndexList_S<SINE_QUARTER_SIZE + 1>::list());
+
+#ifdef PWM_PROGRAM
+	static bldcGimbal *programGimbal;
+		/**< The motor the rotor program drives, see bldcGimbal::programStep().					*/
+#endif
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& FUNCTIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/*****************************************************************************
+	*  Function: sineAt
+	*	Description:															 */
+   /**		Works out the waveform at an electrical angle from pwmSinQuarter.
+	*		The 1st quarter reads the table forwards, the 2nd backwards, and the 
+	*		second half is the first half mirrored about the centre value of 128,
+	*		so it passes smoothly through the zero crossings. Between table entries the
+	*		value is interpolated along a straight line, unless SINE_INTERPOLATE 
+	*		is commented out. Linear interpolation over 1.4 degree steps is within
+	*		0.01 of a table count of a true sine.
+	* @param angle Electrical angle, 65536 counts per electrical cycle.
+	* @return The waveform value in 8.8 fixed point, 0 to SINE_FULL_SCALE*256.
+	****************************************************************************/
+	static inline uint16_t sineAt(uint16_t angle)
+	{
+		uint16_t position = angle & 0x3FFF;							//Position within the quarter
+		if (angle & 0x4000) position = 0x4000 - position;			//2nd and 4th quarters run backwards
+		uint8_t index = position >> SINE_STEP_SHIFT;
+		uint8_t entry = pgm_read_byte(&pwmSinQuarter.entry[index]);
+		uint16_t value = (uint16_t)entry << 8;
+#ifdef SINE_INTERPOLATE
+		uint8_t fraction = position >> (SINE_STEP_SHIFT - 8);		//Top 8 bits of the position within the step
+		if (fraction) value += ((int16_t)pgm_read_byte(&pwmSinQuarter.entry[index + 1]) - entry) * fraction;
+#endif
+		if (angle & 0x8000) value = (uint16_t)(65536UL - value);	//Second half is the first mirrored about 128
+		return value;
+	}
+
+	/*****************************************************************************
+	*  Function: powerLine
+	*	Description:															 */
+   /**		One of the POWER PROFILE LINES, offset + 100 * speed / intercept, 
+	*		with the division done as a multiply by the line's 8.24 slope. 
+	*		At and above the intercept the line is at least full power, which 
+	*		set_PowerScale() clamps to anyway.
+	* @param speed Speed in RPM, not negative.
+	* @param offset The line's power at 0 RPM.
+	* @param intercept The line's speed at full power, in RPM.
+	* @param slope POWER_CENTER_SLOPE or POWER_SPEED_SLOPE for the same line.
+	* @return The power for the speed, POWER_FULL_SCALE or more when at full power.
+	****************************************************************************/
+	static inline uint8_t powerLine(uint16_t speed, uint8_t offset, uint16_t intercept, uint32_t slope)
+	{
+		if (speed >= intercept) return POWER_FULL_SCALE;
+		return offset + (uint8_t)(((uint32_t)speed * slope) >> 24);
+	}
+
+#ifndef POSITION_MODE
+	/*****************************************************************************
+	*  Function: tenth
+	*	Description:															 */
+   /**		Divides by 10, rounding towards 0 like the / operator, as a multiply
+	*		by TENTH_Q16. The main loop calls it for every servo frame.
+	* @param value Number to divide, -16388 to 16388.
+	* @return value / 10.
+	****************************************************************************/
+	static inline int16_t tenth(int16_t value)
+	{
+		uint16_t magnitude = value < 0 ? -value : value;
+		magnitude = ((uint32_t)magnitude * TENTH_Q16) >> 16;
+		return value < 0 ? -(int16_t)magnitude : (int16_t)magnitude;
+	}
 #endif
+
+#ifdef PWM_PROFILE
+	/*****************************************************************************
+	*  Function: profileTime
+	*	Description:															 */
+   /**		Reads Timer1 for the PWM_PROFILE timings. TCNT1 is read with 
+	*		interrupts off, as the two bytes use the shared TEMP register.
+	* @return Timer1 count, 1/16 uS.
+	****************************************************************************/
+	static inline uint16_t profileTime(void)
+	{
+		uint8_t sreg = SREG;
+		cli();
+		uint16_t now = TCNT1;
+		SREG = sreg;
+		return now;
+	}
+#endif
+
+#ifdef MOTION_PLANNER
+	/*****************************************************************************
+	*  Function: rampChange
+	*	Description:															 */
+   /**		Works out how far _phaseIncrement moves while an acceleration of 
+	*		steps jerk steps is brought back to 0, one step per update, this
+	*		update included: steps + (steps-1) + ... + 1 jerk steps. The jerk's 
+	*		whole and fractional parts are multiplied separately to stay in 32 bits.
+	* @param steps Acceleration in jerk steps, 0 to PLANNER_ACCEL_STEPS.
+	* @return The change of _phaseIncrement, in counts.
+	****************************************************************************/
+	static inline int32_t rampChange(int16_t steps)
+	{
+		int32_t triangle = ((int32_t)steps * (steps + 1)) >> 1;
+		return triangle * (int32_t)(PLANNER_JERK_CNT >> PLANNER_FRACTION_BITS) 
+				+ ((triangle * (int32_t)(PLANNER_JERK_CNT & ((1 << PLANNER_FRACTION_BITS) - 1))) >> PLANNER_FRACTION_BITS);
+	}
+#endif
+
+#ifdef POSITION_MODE
+	/*****************************************************************************
+	*  Function: squareRoot
+	*	Description:															 */
+   /**		Integer square root, rounded down. Works out one bit of the result per
+	*		pass, shifts and adds only.
+	* @param value Number to take the root of.
+	* @return floor(sqrt(value)).
+	****************************************************************************/
+	static uint16_t squareRoot(uint32_t value)
+	{
+		uint32_t root = 0;
+		uint32_t bit = 1UL << 30;
+		while (bit > value) bit >>= 2;
+		while (bit)
+		{
+			if (value >= root + bit)
+			{
+				value -= root + bit;
+				root = (root >> 1) + bit;
+			}
+			else root >>= 1;
+			bit >>= 2;
+		}
+		return root;
+	}
+#endif
+
+#ifndef PWM_SEQUENTIAL
+	/*****************************************************************************
+	*  Function: modulate
+	*	Description:															 */
+   /**		Turns the three sineAt() values of a plain sine into the values for an
+	*		injected bldcGimbal::gimbalModulation_T. The highest and lowest phase
+	*		are found, half their sum (the min-max injection, a triangular third 
+	*		harmonic) is taken off all three, and the result is scaled by 
+	*		SVPWM_GAIN. For eModulation_CLAMPED the lowest phase is then moved to 0 
+	*		instead of centring the three on center. Differences between
+	*		phases stay below 2 * 32256, so 16 bit unsigned arithmetic is exact.
+	*		The line to line amplitude comes out 1.1547 times the plain sine's.
+	*		The sum is linear, so it works the same on sineAt() values and on
+	*		duty cycles from _dutyCache.
+	* @param value The three phase values, replaced in place.
+	* @param mode eModulation_SVPWM or eModulation_CLAMPED.
+	* @param center The value of a phase at 0 volts, SINE_CENTER for sineAt() values.
+	* @param full The highest value a phase may take, SINE_FULL_SCALE*256 for sineAt() values.
+	****************************************************************************/
+	static inline void modulate(uint16_t value[3], uint8_t mode, uint16_t center, uint16_t full)
+	{
+		int16_t phase[3];
+		int16_t high, low;
+		for (uint8_t n = 0; n < 3; n++) phase[n] = value[n] - center;
+		high = low = phase[0];
+		for (uint8_t n = 1; n < 3; n++)
+		{
+			if (phase[n] > high) high = phase[n];
+			if (phase[n] < low) low = phase[n];
+		}
+		int16_t common = (high + low) >> 1;		//The three sum to 0, so high >= 0 >= low and this cannot overflow
+		low = ((int32_t)(low - common) * SVPWM_GAIN) >> 15;
+		for (uint8_t n = 0; n < 3; n++)
+		{
+			int16_t scaled = ((int32_t)(phase[n] - common) * SVPWM_GAIN) >> 15;
+			if (mode == bldcGimbal::eModulation_CLAMPED) value[n] = (uint16_t)scaled - (uint16_t)low;	//Lowest phase to 0
+			else value[n] = (uint16_t)scaled + center;
+			if (value[n] > full) value[n] = full;	//Rounding in the table can overshoot a little
+		}
+	}
+#endif
+
 	
 	
 					
@@ -139,12 +327,32 @@
 	****************************************************************************/		
 	bldcGimbal::bldcGimbal(void)
 	{					
-		 _baseIncrement = 0;			
-		 _incrementDelay_100us = 1000;  			
-		 _accumulator = 0; 									 		
-		 _incrementTimer = 0;									
-		 _currentStep = 0;	
+		 _phase = 0;
+		 _cycles = 0;
+		 _phaseIncrement = 0;
+#ifdef MOTION_PLANNER
+		 _targetIncrement = 0;
+		 _accelSteps = 0;
+		 _rampPower = false;
+#endif
+#ifdef POSITION_MODE
+		 _targetPosition = 0;
+		 _speed_rpm = 0;
+#endif
+		 _currentAngle = 0;	
 		 _powerScale = 4;				
+		 _modulation = MODULATION_DEFAULT;
+		 _lastServo = 0;
+#ifdef AVERAGING_ENABLED
+		 _averageSpeed = 0;
+#endif
+#ifdef PWM_PROFILE
+		 _servoCnt = 0;
+#endif
+#ifdef DUTY_CACHE
+		 _cachePower = 0xFF;	//Not a valid _powerScale, so the first driveRotor() starts the cache
+		 _cacheFill = 0;
+#endif
 	}
 			
 	/****************************************************************************
@@ -156,6 +364,11 @@
 	void bldcGimbal::begin(void)
 	{
 		_motorPwm.begin();
+#ifdef PWM_PROGRAM
+		_programPower = 0xFF;	//Not a valid _powerScale, so the program queues its first frame
+		programGimbal = this;
+		_motorPwm.set_program(programStep);
+#endif
 	}
 			
 	/****************************************************************************
@@ -165,24 +378,21 @@
 	*		See class header file for a full API description of this method
 	****************************************************************************/		
 	void bldcGimbal::tickle(void)
-	{												
+	{
+#ifndef PWM_PROGRAM											
 			_motorPwm.tickle();
-			uint16_t timerVal = _100micros();
-			
-			if (_incrementDelay_100us == 0) _accumulator = 0;
-			else
+			if (!_motorPwm.busy()) advanceRotor();	//Keep the pwm frame queue topped up, it plays one frame per update
+#endif
+#ifdef POSITION_MODE
+			trackPosition();
+#endif
+#ifdef MOTION_PLANNER
+			if (_rampPower && rampDone())
 			{
-				if (timerVal - _incrementTimer >= _incrementDelay_100us){
-					_incrementTimer = timerVal;
-					_accumulator++;
-				}				
+				_rampPower = false;
+				calcPowerScale(_speed_rpm);			//Slowed down, now the power can follow
 			}
-			
-						
-			if (!_motorPwm.busy()){
-				incrementRotor(_baseIncrement + _accumulator);
-				_accumulator = 0;
-			}					
+#endif
 	}
 	
 	/****************************************************************************
@@ -193,54 +403,198 @@
 	****************************************************************************/				 
 	bool bldcGimbal::set_speed_rpm(int16_t value)
 	{	
-		
+		if (value > MAX_SPEED_RPM || value < -MAX_SPEED_RPM) return false;	//The increment would overflow and run the motor backwards
+		_speed_rpm = value;
+		int32_t increment = (int32_t)value * (int32_t)PWM_PHASE_PER_RPM;
+		uint8_t sreg = SREG;
+		cli();
+#ifdef MOTION_PLANNER
+		int32_t current = _phaseIncrement;
+		_targetIncrement = increment;	//planMotion() ramps _phaseIncrement to it
+#else
+		_phaseIncrement = increment;	//The rotor program reads it from an interrupt
+#endif
+		SREG = sreg;
+#ifdef MOTION_PLANNER
+		//Keep the power for the speed we are still running at until a ramp down is over, see tickle()
+		_rampPower = labs(increment) < labs(current);
+		if (_rampPower) return true;
+#endif
 		calcPowerScale(value);  //Calculate what the power scale should be and set it.							
-		if(value ==0)
+		return true;
+	}
+	
+
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: advanceRotor
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/			
+	void bldcGimbal::advanceRotor(void)
+	{
+#ifdef MOTION_PLANNER
+		planMotion();
+#endif
+		uint32_t last = _phase;
+		_phase += _phaseIncrement;
+		if (_phaseIncrement > 0 && _phase < last) _cycles++;		//Count the electrical cycles for position()
+		else if (_phaseIncrement < 0 && _phase > last) _cycles--;
+		_currentAngle = _phase >> 16;	//Top 16 bits are the electrical angle
+		driveRotor();
+	};
+	
+	
+#ifdef MOTION_PLANNER
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: planMotion
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/			
+	void bldcGimbal::planMotion(void)
+	{
+		int32_t error = _targetIncrement - _phaseIncrement;
+		if (error == 0 && _accelSteps == 0) return;
+		
+		/* Work towards a positive error, mirroring everything for a negative one. Take the highest 
+		 * of one step more, the same, or one step less acceleration which can still be brought back
+		 * to 0 without passing the target. At most 3 tries, rampChange() is only multiplies.		*/
+		bool reverse = error < 0;
+		int16_t steps = reverse ? -_accelSteps : _accelSteps;
+		if (reverse) error = -error;
+		int16_t next = steps + 1;
+		if (next > (int16_t)PLANNER_ACCEL_STEPS || rampChange(next) > error)
+		{
+			next = steps;
+			if (rampChange(next) > error) next = steps - 1;
+		}
+		if (next == 0 && steps >= 0)
 		{
-			_incrementDelay_100us = 0;
-			_baseIncrement = 0;
-			return true;
+			_phaseIncrement = _targetIncrement;		//Less than one jerk step away
+			_accelSteps = 0;
+			return;
 		}
+		int32_t change = ((int32_t)next * (int32_t)PLANNER_JERK_CNT) >> PLANNER_FRACTION_BITS;
+		_phaseIncrement += reverse ? -change : change;
+		_accelSteps = reverse ? -next : next;
+	}
+	
+	
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: rampDone
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/			
+	bool bldcGimbal::rampDone(void)
+	{
+		uint8_t sreg = SREG;
+		cli();
+		bool done = _phaseIncrement == _targetIncrement;
+		SREG = sreg;
+		return done;
+	}
+#endif
+	
+	
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: position
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/			
+	int32_t bldcGimbal::position(void)
+	{
+		uint8_t sreg = SREG;
+		cli();
+		int32_t value = ((int32_t)_cycles << 16) | (uint16_t)(_phase >> 16);
+		SREG = sreg;
+		return value;
+	}
+	
+	
+#ifdef POSITION_MODE
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: trackPosition
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/			
+	void bldcGimbal::trackPosition(void)
+	{
+		int32_t error = _targetPosition - position();
+		uint32_t distance = labs(error);
+		uint16_t speed16;		//1/16ths of an RPM
+		if (distance >= POSITION_BRAKE_CNT) speed16 = 16 * POSITION_MAX_RPM;
+		else if (distance < POSITION_DEADBAND_CNT) speed16 = 0;
+		else speed16 = squareRoot(distance * POSITION_GAIN);
 		
-		if (value < 0) _reverse = true;
-		else _reverse = false;
-		_speed_rpm = value;
-		uint16_t speed = abs(value);
-		int32_t numerator = PWM_INCREMENT_SCALER_NUMERATOR;
-		numerator *= speed;
-		numerator *= 1000;
-		int32_t denomenator = 	PWM_INCREMENT_SCALER_DENOMENATOR;
-		int32_t calcValue = numerator / denomenator;
-		_baseIncrement = calcValue / 1000;
-		int32_t remainder = calcValue - ((uint32_t)_baseIncrement *1000);
-		_incrementDelay_100us = 10000 / remainder;		
-		//_accumulator = 0;		
-		return true;
+		//speed16 * PWM_PHASE_PER_RPM / 16, in two halves to stay in 32 bits
+		int32_t increment = (int32_t)speed16 * (int32_t)(PWM_PHASE_PER_RPM >> 4) 
+							+ (((int32_t)speed16 * (int32_t)(PWM_PHASE_PER_RPM & 15)) >> 4);
+		if (error < 0) increment = -increment;
+		uint8_t sreg = SREG;
+		cli();
+		_targetIncrement = increment;
+		SREG = sreg;
+		
+		uint16_t speed = speed16 >> 4;
+		if (speed != _speed_rpm)	//Power follows the speed, but never below POSITION_HOLD_POWER
+		{
+			_speed_rpm = speed;
+			calcPowerScale(speed);
+			if (_powerScale < POSITION_HOLD_POWER) set_PowerScale(POSITION_HOLD_POWER);
+		}
 	}
+#endif
+	
 	
-
 	/****************************************************************************
 	*  Class: bldcGimbal
-	*  Method: bldcGimbal
+	*  Method: driveRotor
 	*	Description:
 	*		See class header file for a full API description of this method
 	****************************************************************************/			
-	void bldcGimbal::incrementRotor(uint8_t value)
+	void bldcGimbal::driveRotor(void)
 	{
-				
 		uint16_t pwmA,pwmB,pwmC;
-		uint8_t indexA,indexB,indexC;		
-		
-		if (_reverse) _currentStep -= value;
-		else _currentStep += value;
+		uint16_t angleA,angleB,angleC;		
+#ifdef PWM_PROFILE
+		uint16_t profileStart = profileTime();
+#endif
 	
-		indexA = _currentStep;
-		indexB = _currentStep + PHASE_SHIFT;
-		indexC = indexB + PHASE_SHIFT;
+		angleA = _currentAngle;
+		angleB = _currentAngle + PHASE_SHIFT;
+		angleC = angleB + PHASE_SHIFT;
 		
-		pwmA = sineToDutyCycle(pwmSin[indexA]);
-		pwmB = sineToDutyCycle(pwmSin[indexB]);
-		pwmC = sineToDutyCycle(pwmSin[indexC]);
+		uint16_t value[3];
+#ifdef DUTY_CACHE
+		if (fillDutyCache())
+		{
+			value[0] = dutyAt(angleA);
+			value[1] = dutyAt(angleB);
+			value[2] = dutyAt(angleC);
+			if (_modulation != eModulation_SINE) 
+				modulate(value, _modulation, _dutyCenter, (uint16_t)_cachePower * POWER_TO_DUTY);
+		}
+		else
+#endif
+		{
+			value[0] = sineAt(angleA);
+			value[1] = sineAt(angleB);
+			value[2] = sineAt(angleC);
+#ifndef PWM_SEQUENTIAL
+			if (_modulation != eModulation_SINE) modulate(value, _modulation, SINE_CENTER, SINE_FULL_SCALE*256U);
+#endif
+			for (uint8_t n = 0; n < 3; n++) value[n] = sineToDutyCycle(value[n]);
+		}
+		pwmA = value[0];
+		pwmB = value[1];
+		pwmC = value[2];
+#ifdef PWM_PROFILE
+		_stepCnt = profileTime() - profileStart;
+#endif
 					
 		_motorPwm.set_pwm(bldcPwm::ePwmChannel_A,pwmA);
 		_motorPwm.set_pwm(bldcPwm::ePwmChannel_B,pwmB);
@@ -252,23 +606,112 @@
 	};	
 	
 	
+#ifdef DUTY_CACHE
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: fillDutyCache
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	bool bldcGimbal::fillDutyCache(void)
+	{
+		if (_cachePower != _powerScale)
+		{
+			_cachePower = _powerScale;
+			_cacheFill = 0;
+		}
+		if (_cacheFill > SINE_QUARTER_SIZE) return true;
+		
+		uint8_t last = _cacheFill + DUTY_CACHE_STEP;
+		if (last > SINE_QUARTER_SIZE + 1) last = SINE_QUARTER_SIZE + 1;
+		for (uint8_t n = _cacheFill; n < last; n++)
+			_dutyCache[n] = sineToDutyCycle((uint16_t)pgm_read_byte(&pwmSinQuarter.entry[n]) << 8);
+		_cacheFill = last;
+		if (last <= SINE_QUARTER_SIZE) return false;
+		
+		_dutyCenter = sineToDutyCycle(SINE_CENTER);
+		_dutyMirror = _dutyCenter * 2;
+		return true;
+	}
+	
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: dutyAt
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	uint16_t bldcGimbal::dutyAt(uint16_t angle)
+	{
+		uint16_t position = angle & 0x3FFF;							//Same walk through the table as sineAt()
+		if (angle & 0x4000) position = 0x4000 - position;
+		uint8_t index = position >> SINE_STEP_SHIFT;
+		uint16_t duty = _dutyCache[index];
+#ifdef SINE_INTERPOLATE
+		uint8_t fraction = position >> (SINE_STEP_SHIFT - 8);
+		if (fraction) duty += ((uint32_t)(uint16_t)(_dutyCache[index + 1] - duty) * fraction) >> 8;	//The 1st quarter only rises
+#endif
+		if (angle & 0x8000) duty = _dutyMirror - duty;
+		return duty;
+	}
+	
+#endif
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: set_modulation
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/			
+	bool bldcGimbal::set_modulation(gimbalModulation_T value)
+	{
+		if (value >= eModulation_COUNT) return false;
+		_modulation = value;
+#ifdef PWM_PROGRAM
+		_programPower = 0xFF;	//Requeue a frame even if the rotor is standing still
+#endif
+		return true;
+	}
+	
+	
+#ifdef PWM_PROGRAM
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: programStep
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/			
+	void bldcGimbal::programStep(void)
+	{
+		bldcGimbal *gimbal = programGimbal;
+		while (!gimbal->_motorPwm.busy())
+		{
+			if (gimbal->_phaseIncrement == 0 && gimbal->_programPower == gimbal->_powerScale
+#ifdef MOTION_PLANNER
+				&& gimbal->_targetIncrement == 0
+#endif
+				) break;	//The ISR keeps replaying the last frame
+			gimbal->_programPower = gimbal->_powerScale;
+			gimbal->advanceRotor();
+		}
+	}
+#endif
+	
+	
 	/****************************************************************************
 	*  Class: bldcGimbal
 	*  Method: calcPowerScale
 	*	Description:
 	*		See class header file for a full API description of this method
 	****************************************************************************/		
-	void bldcGimbal::calcPowerScale(uint16_t speed)
+	void bldcGimbal::calcPowerScale(int16_t speed)
 	{							
-			uint16_t powerScale1 = POWER_CENTER_OFFSET + (((100/4)*abs(speed )) /(POWER_CENTER_INTERCEPT/4));  
-			uint16_t powerScale2 = POWER_SPEED_OFFSET  + (((100/4)*abs(speed )) /(POWER_SPEED_INTERCEPT /4));								
+			uint16_t magnitude = abs(speed);
+			uint8_t powerScale1 = powerLine(magnitude, POWER_CENTER_OFFSET, POWER_CENTER_INTERCEPT, POWER_CENTER_SLOPE);  
+			uint8_t powerScale2 = powerLine(magnitude, POWER_SPEED_OFFSET,  POWER_SPEED_INTERCEPT,  POWER_SPEED_SLOPE);								
 					/* The actual equation is :
 					*	 powerScale = OFFSET + 100 * currentSpeed / INTERCEPT
 					*	 					
-					* We need to prevent having a number larger than 65535 during the calculation 
-					* We will assume that the maximum currentSpeed will be 2000 RPM, we will get a 
-					* maximum of 100*2000 = 200,000 during calculation. To keep this within range
-					* we need to pre-divide it by 4 resulting in a max value of 50,000 during calculation.
+					* powerLine() works it out with a multiply by the slope in 8.24 fixed point, which is
+					* exact for any speed below the intercept, see POWER_CENTER_SLOPE.
 					*--------------------------------------------------------------------------------------------*/
 			set_PowerScale(powerScale1>powerScale2?powerScale2:powerScale1);		
 	}
@@ -278,55 +721,87 @@
 	
 	/****************************************************************************
 	*  Class: bldcGimbal
-	*  Method: set_servo_us
+	*  Method: set_servo_cnt
 	*	Description:
 	*		See class header file for a full API description of this method
 	****************************************************************************/	
-	bool bldcGimbal::set_servo_us(int16_t currentServo)
+	bool bldcGimbal::set_servo_cnt(uint16_t currentServo)
 	{
+#ifdef PWM_PROFILE
+		uint16_t profileStart = profileTime();
+#endif
+#ifndef POSITION_MODE
 	    int16_t currentSpeed = 0;		 //Speed calculated based on the servo value.
-		static int16_t lastServo = 0;	 //The servo value last time this method was called.
-		static int16_t lastServo2 = 0;	 //The servo value 2 calls ago.	
-		
-		#ifdef AVERAGING_ENABLED
-			static int16_t averageSpeed = 0; //Running Average of speed, used for averaging calculation. 
-		#endif
+#endif
 								
-		//Disregard if this is a rouge point (this is the jitter filter)
-		if(!(abs(currentServo-lastServo)>FILTER_THRESHOLD_US && (abs(lastServo - lastServo2) <= FILTER_OFF_SLOPE_US )))		
-		{						
-			//Disregard if the value was unchanged
-			if (currentServo != lastServo)
-			{
-				//Disregard if the value is out of range
-				if (currentServo < SERVO_MAX_US && currentServo > SERVO_MIN_US)
-				{	
-					
-					//------------------------------------------------------------------------------------------------
-					//	SCALE FROM SERVO TO RPM
-					//------------------------------------------------------------------------------------------------
-					{					
-						currentSpeed = currentServo - SERVO_CENTER_US;
-					
-						//Choose Correct Sign For Deadzone									
-						int8_t deadZone = (currentSpeed<0? -1 * DEADZONE_US : DEADZONE_US);									
-					
-						//Scale current Speed and adjust for deadzone.
-						currentSpeed = (abs(currentSpeed)<=DEADZONE_US?0:(SPEED_SCALE*((currentSpeed-deadZone)))/10);
-					
-						//Implement Averaging (if enabled)
-						#ifdef AVERAGING_ENABLED
-							currentSpeed = averageSpeed = ((averageSpeed*AVERAGING_RATE) + (currentSpeed*(10-AVERAGING_RATE)))/10;
-						#endif
-					}					
-					set_speed_rpm(currentSpeed);					
-				} //If Value Out Of Range
-			} //If value unchanged
-		}  //If Rouge Point 
-		lastServo = currentServo;
-		lastServo2 = lastServo;
+		//Disregard if the value was unchanged
+		if (currentServo != _lastServo)
+		{
+			//Disregard if the value is out of range
+			if (currentServo < SERVO_MAX_US * SERVO_CNT_PER_US && currentServo > SERVO_MIN_US * SERVO_CNT_PER_US)
+			{	
+#ifdef POSITION_MODE
+				//Scale from servo to rotor position, POSITION_CNT_PER_US has 8 binary places and a count is 1/16 uS
+				static_assert((int64_t)(SERVO_MAX_US - SERVO_CENTER_US) * SERVO_CNT_PER_US * POSITION_CNT_PER_US <= 0x7FFFFFFFLL,
+							  "POSITION_RANGE_DEGREES is too high for the servo scaling");
+				set_position(((int32_t)(currentServo - SERVO_CENTER_US * SERVO_CNT_PER_US) * (int32_t)POSITION_CNT_PER_US) >> 12);
+#else
+				
+				//------------------------------------------------------------------------------------------------
+				//	SCALE FROM SERVO TO RPM
+				//------------------------------------------------------------------------------------------------
+				{					
+					static_assert((int64_t)(SERVO_MAX_US - SERVO_CENTER_US) * SPEED_SCALE / 10 * PWM_PHASE_PER_RPM <= 0x7FFFFFFFLL,
+								  "The fastest servo speed overflows _phaseIncrement, lower SPEED_SCALE");
+					currentSpeed = currentServo - SERVO_CENTER_US * SERVO_CNT_PER_US;
+				
+					//Choose Correct Sign For Deadzone									
+					int16_t deadZone = (currentSpeed<0? -1 * DEADZONE_US * SERVO_CNT_PER_US : DEADZONE_US * SERVO_CNT_PER_US);									
+				
+					//Scale current Speed and adjust for deadzone. Down to uS first (a shift), which leaves the
+					//same range for tenth() as a whole uS did, and the same result as one division by 160
+					static_assert((SERVO_MAX_US - SERVO_CENTER_US) * SPEED_SCALE <= 16388, "SPEED_SCALE is too high for tenth()");
+					currentSpeed = (abs(currentSpeed)<=DEADZONE_US * SERVO_CNT_PER_US?0:
+									tenth((int32_t)SPEED_SCALE*(currentSpeed-deadZone) / SERVO_CNT_PER_US));
+				
+					//Implement Averaging (if enabled)
+					#ifdef AVERAGING_ENABLED
+						currentSpeed = _averageSpeed = tenth((_averageSpeed*AVERAGING_RATE) + (currentSpeed*(10-AVERAGING_RATE)));
+					#endif
+				}					
+				set_speed_rpm(currentSpeed);					
+#endif
+			} //If Value Out Of Range
+		} //If value unchanged
+		_lastServo = currentServo;
+#ifdef PWM_PROFILE
+		uint16_t profileTaken = profileTime() - profileStart;
+		if (profileTaken > _servoCnt) _servoCnt = profileTaken;
+#endif
 		return true;
 	} //Method
+	
+	
+	
+	
+	/****************************************************************************
+	*  Class: bldcGimbal
+	*  Method: servo_lost
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/	
+	void bldcGimbal::servo_lost(void)
+	{
+		_lastServo = 0;
+#ifdef POSITION_MODE
+		set_position(position());	//Hold where it is, rather than carry on to the last target
+#else
+	#ifdef AVERAGING_ENABLED
+		_averageSpeed = 0;
+	#endif
+		set_speed_rpm(0);	//Stop, rather than run on at the last speed
+#endif
+	}
 		
 		
 	
\ No newline at end of file
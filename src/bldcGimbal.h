@@ -24,6 +24,43 @@
 				/**< The number of sine cycles each coil needs to go through for motor to 
 				 * make on rotation		*/		
 				
+	#define SINE_INTERPOLATE
+				/**< When DEFINED, the waveform is interpolated between the entries of the quarter wave table, 
+				 * so the rotor can be held at any of the 65536 electrical angle counts. Comment it out to 
+				 * step in whole table entries (256 per electrical cycle), which is the resolution of the 
+				 * old direct table lookup, e.g. to compare stepCnt() under PWM_PROFILE.					*/
+				
+	#define MODULATION_DEFAULT eModulation_SINE
+				/**< The modulation mode the motor starts up with, see gimbalModulation_E. It can be changed 
+				 * at run time with set_modulation(). The injected modes give about 15% more torque at the 
+				 * same power scale, so lower the POWER PROFILE LINES to keep the same current.		*/
+				
+	#define DUTY_CACHE
+				/**< When DEFINED, driveRotor() looks the duty cycles up in a copy of the quarter wave table 
+				 * already scaled to the current power scale, instead of scaling each phase from sineAt(). 
+				 * Costs (SINE_QUARTER_SIZE + 1) * 2 bytes of RAM. Not used with PWM_SEQUENTIAL.		*/
+				
+	/*
+	---------------------------------------------------------------------------------------------------
+	MOTION PLANNER
+		An open loop motor only follows a speed change if the rotor can keep up with it. The planner
+		ramps the speed towards the one last asked for by set_speed_rpm(), once per table update, 
+		with limited acceleration and limited rate of change of acceleration (jerk). The speed 
+		follows an S-curve, or a trapezoid when PLANNER_JERK_RPM_PER_S2 is commented out.
+	---------------------------------------------------------------------------------------------------
+	*/
+			#define MOTION_PLANNER
+				/**< When DEFINED, speed changes are ramped by the planner. Comment it out to apply each
+				 * new speed immediately.																*/
+				 
+			#define PLANNER_ACCEL_RPM_PER_S 5000
+				/**< Maximum acceleration in RPM per second. 0 to 300 RPM in about 0.1 seconds.		*/
+				
+			#define PLANNER_JERK_RPM_PER_S2 100000
+				/**< Maximum jerk in RPM per second per second. Full acceleration is reached in 
+				 * PLANNER_ACCEL_RPM_PER_S / PLANNER_JERK_RPM_PER_S2 = 50mS. Comment it out for
+				 * trapezoidal ramps, where the acceleration steps straight to its limit.				*/
+	
 	
 	/*
 	---------------------------------------------------------------------------------------------------
@@ -94,9 +131,10 @@
 			 SERVO AVERAGING  
 			---------------------------------------------------------------------------------------------------
 			*/	 				
-					#define AVERAGING_ENABLED
+					//#define AVERAGING_ENABLED
 						/* When defined, the average value of the servo pulses, taken over time, will be used
-						 * to determine the motor speed. Comment out this definition to disable averaging. */
+						 * to determine the motor speed. Comment out this definition to disable averaging. 
+						 * Not needed with MOTION_PLANNER, which smooths the steps without the lag. */
 				
 					#define AVERAGING_RATE 7
 						/* The averaging intensity indicated by a number between 0 and 10. 0 Corresponds to no 
@@ -113,54 +151,142 @@
 						 * A value of 10 gives a 1 to 1 relationship. 20 give 2 to 1, 5 gives a half. */							
 			/*
 			---------------------------------------------------------------------------------------------------
-			 SERVO JITTER FILTERING 
-				The jitter filter looks for rouge spikes which last for only one measurement and disregards them.				
+			 POSITION MODE
+				Instead of a speed, the servo pulse width selects an absolute rotor angle, and the motor 
+				moves there along a MOTION_PLANNER ramp. Angle 0 is wherever the rotor was at power up, this 
+				is open loop, there is no sensor.
 			---------------------------------------------------------------------------------------------------
 			*/	 	
-					#define FILTER_THRESHOLD_US  25		
-						/* This is the size of a spike in micro seconds. If the current value is more than 
-						   FILTER_THRESHOLD_US from the previous measurement it is considered a spike.	*/
-				    #define FILTER_OFF_SLOPE_US 50 
-						/* If the previous 2 servo measurements were this far apart, then we are assuming that the
-						   servo value is being changed at a fast rate and so we disable the filter. */
+					//#define POSITION_MODE
+						/* When defined, set_servo_cnt() sets the rotor angle rather than the speed. Needs
+						 * MOTION_PLANNER.  */
+						 
+					#define POSITION_RANGE_DEGREES 360
+						/* Mechanical angle between SERVO_MIN_US and SERVO_MAX_US, centred on SERVO_CENTER_US. */
+						
+					#define POSITION_MAX_RPM 300
+						/* Top speed of a move. */
+						
+					#define POSITION_HOLD_POWER 50
+						/* Least power (out of POWER_FULL_SCALE) used in position mode, so the motor holds its
+						 * angle when it is standing still. The POWER PROFILE LINES give 0 at 0 RPM. */
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& MACROS
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 */
 		/**********************************************************************************************************
-		 * PWM_INCREMENT_SCALER
+		 * PWM_PHASE_PER_RPM
 		 *
 		 * DESCRIPTION:
-		 *  The speed in RPM gets multiplied by this number to determine the number of positions to increment
-		 * each PWM cycle 
+		 *  The rotor position is a 32 bit phase accumulator (_phase), where 2^32 is one electrical cycle and the
+		 * top 16 bits are the electrical angle. Every table update (PWM_UPDATE_KHZ) it is advanced by _phaseIncrement, 
+		 * which is the speed in RPM multiplied by this number. 
 		 * CALCULATION:
 		 *		
-		 *
-		 *		
-		 *		ROT  |  1 MIN       |  1 SEC					    |COIL_RATIO COILS | 255 COUNTS
+		 *		ROT  |  1 MIN       |  1 SEC					    |COIL_RATIO COILS | 2^32 COUNTS
 		 *		_____|______________|_______________________________|_________________|______________|
 		 *		     |              |                               |                 |              |
-		 *		MIN  |  60 SECONDS  |   1000*PWM_FREQ_KHZ PWM_CYCLES|1 ROT            | 1 COIL
+		 *		MIN  |  60 SECONDS  | 1000*PWM_UPDATE_KHZ UPDATES   |1 ROT            | 1 COIL
 		 *		
-		 *		
-		 *		rotorIncrement =	speed_rpm *   255 * COIL_RATIO			  COUNTS 
+		 *		phaseIncrement =	speed_rpm * COIL_RATIO * 2^32			  COUNTS 
 		 *							_______________________________			___________		
-		 *							    60*1000*PWM_FREQ_KHZ				 PWM_CYCLE
-		 *						= speed_rpm  * (255*7)/60000 = 1785/60000 = 357/12000 
+		 *							    60*1000*PWM_UPDATE_KHZ				 UPDATE
+		 *						= speed_rpm * 7 * 4294967296 / 60000 = speed_rpm * 501080
 		 *
-		 *  MAXIMUM VALUE DURING CALCULATION: (assume max speed of 2000 RPM)
-		 *      2000*357 / 12000 =  714000 / 12000 (714,000 fits into a 32bit integer)
-		 *			If we dont precalculate the value with COIL_RATIO then:
-		 *	    2000*255*7 / 60*1000*1 = 3570000/60000 which also fits into a 32 but integer
-		 *		
-		 *  MINIMUM SPEED:
-		 *      1 = speed_RPM * 357 /12000; speed_rpm = 12000/357 = 33 RPM = .55 rotations per second.
+		 *  The division is done by the preprocessor, so stepping the rotor is a 32 bit add.
+		 *  MAXIMUM SPEED: 2^31 / 501080 = 4285 RPM before the signed increment overflows.
+		 *  RESOLUTION: 1 count is 1/501080 RPM, and the rounding error of the scaler is below 1 in 10^6.
+		 *  Steps are evenly spaced: every frame plays for exactly one update period.
+		 ***********************************************************************************************************/
+		#define PWM_PHASE_PER_RPM ((uint32_t)((COIL_RATIO * 4294967296ULL + 30000ULL * PWM_UPDATE_KHZ) / (60000ULL * PWM_UPDATE_KHZ)))
+				/**Phase accumulator counts per table update for each RPM of speed */
+				
+		#define MAX_SPEED_RPM ((int16_t)(2147483647ULL / PWM_PHASE_PER_RPM > 32767 ? 32767 : 2147483647ULL / PWM_PHASE_PER_RPM))
+				/**Fastest speed set_speed_rpm() takes, either way, before _phaseIncrement would overflow (4285 RPM) */
+				
+		#define SERVO_CNT_PER_US 16
+				/**Units of set_servo_cnt(), Timer1 counts per uS as measureServo::value_cnt() gives them */
+				
+#ifdef MOTION_PLANNER
+		/**********************************************************************************************************
+		 * PLANNER_JERK_CNT, PLANNER_ACCEL_STEPS
+		 *
+		 * DESCRIPTION:
+		 *  The planner limits in _phaseIncrement units, applied once per table update. The jerk is the change of 
+		 * acceleration per update, and the acceleration is the change of _phaseIncrement per update. The jerk 
+		 * carries PLANNER_FRACTION_BITS binary places, or it would round to nothing at higher PWM_UPDATE_KHZ 
+		 * settings. The acceleration is always a whole number of jerk steps, up to PLANNER_ACCEL_STEPS of them.
+		 * CALCULATION:
+		 *		jerk  = PLANNER_JERK_RPM_PER_S2 * PWM_PHASE_PER_RPM / (1000*PWM_UPDATE_KHZ)^2 * 2^8
+		 *			  = 100000 * 501080 / 1000000 * 256 = 12827648
+		 *		steps = PLANNER_ACCEL_RPM_PER_S / (PLANNER_JERK_RPM_PER_S2 / (1000*PWM_UPDATE_KHZ)) 
+		 *			  = 5000 / (100000 / 1000) = 50
+		 *  PWM_PHASE_PER_RPM is written out in full so the preprocessor can check the ranges. Without 
+		 *  PLANNER_JERK_RPM_PER_S2 the jerk is the acceleration itself, one step.
+		 *  The speed change while the acceleration is brought back to 0 is a triangular number of jerk
+		 *  steps, so planMotion() needs no division.
 		 ***********************************************************************************************************/
-		#define PWM_INCREMENT_SCALER_NUMERATOR     (255*COIL_RATIO) 
-		#define PWM_INCREMENT_SCALER_DENOMENATOR  (60U * 1000U * PWM_FREQ_KHZ)
-				/**The speed in RPM gets multiplied by this number to determine the number of positions to increment 
-				 * each PWM cycle */
+		#define PLANNER_FRACTION_BITS 8
+		#ifdef POSITION_MODE
+			#undef PLANNER_JERK_RPM_PER_S2		//Position moves are trapezoidal, see POSITION_GAIN
+		#endif
+		#ifdef PLANNER_JERK_RPM_PER_S2
+			#define PLANNER_JERK_CNT ((PLANNER_JERK_RPM_PER_S2 * COIL_RATIO * 4294967296ULL * 256ULL) / (60000ULL * PWM_UPDATE_KHZ * 1000000ULL * PWM_UPDATE_KHZ * PWM_UPDATE_KHZ))
+			#define PLANNER_ACCEL_STEPS ((PLANNER_ACCEL_RPM_PER_S * 1000ULL * PWM_UPDATE_KHZ) / PLANNER_JERK_RPM_PER_S2)
+		#else
+			#define PLANNER_JERK_CNT ((PLANNER_ACCEL_RPM_PER_S * COIL_RATIO * 4294967296ULL * 256ULL) / (60000ULL * PWM_UPDATE_KHZ * 1000ULL * PWM_UPDATE_KHZ))
+			#define PLANNER_ACCEL_STEPS 1ULL
+		#endif
+		#if PLANNER_JERK_CNT < 1
+			#error "PLANNER_JERK_RPM_PER_S2 is too low to resolve at this PWM_UPDATE_KHZ"
+		#endif
+		#if PLANNER_ACCEL_STEPS < 1
+			#error "PLANNER_JERK_RPM_PER_S2 reaches full acceleration in under one update, comment it out instead"
+		#endif
+		#if PLANNER_ACCEL_STEPS > 4095ULL || PLANNER_JERK_CNT * PLANNER_ACCEL_STEPS > 0x7FFFFFFFULL || \
+			(PLANNER_ACCEL_STEPS * (PLANNER_ACCEL_STEPS + 1) / 2) * ((PLANNER_JERK_CNT >> PLANNER_FRACTION_BITS) + 1) > 0x7FFFFFFFULL
+			#error "PLANNER_ACCEL_RPM_PER_S is too high for the planner's 32 bit arithmetic"
+		#endif
+#endif
+
+#ifdef POSITION_MODE
+		#ifndef MOTION_PLANNER
+			#error "POSITION_MODE needs MOTION_PLANNER"
+		#endif
+		/**********************************************************************************************************
+		 * POSITION_CNT_PER_US, POSITION_GAIN, POSITION_BRAKE_CNT
+		 *
+		 * DESCRIPTION:
+		 *  Rotor positions are counted in electrical angle counts, 65536 per electrical cycle and 
+		 * 65536 * COIL_RATIO = 458752 per rotation. 
+		 *  POSITION_CNT_PER_US is the position change for each uS of servo pulse width, 8 binary places:
+		 *		458752 * POSITION_RANGE_DEGREES / 360 / (SERVO_MAX_US - SERVO_MIN_US) * 2^8 
+		 *			= 458752 / 1000 * 256 = 117441
+		 *  A move slows down in time to stop on the target at half of PLANNER_ACCEL_RPM_PER_S, the other half
+		 * is margin for the planner working in whole updates. The speed target follows the braking curve 
+		 * down, which only works if the planner can change the acceleration at once, so position mode 
+		 * ignores PLANNER_JERK_RPM_PER_S2 and moves are trapezoidal. Stopping from v RPM at a RPM/S takes 
+		 * v^2 / (120 * a) rotations, so the highest speed with d counts to go, in 1/16ths of an RPM, is
+		 *		speed16 = sqrt(d * 256 * 60 * PLANNER_ACCEL_RPM_PER_S / 458752) = sqrt(d * POSITION_GAIN)
+		 *		POSITION_GAIN = 15360 * 5000 / 458752 = 167
+		 *  Further away than POSITION_BRAKE_CNT the move runs at POSITION_MAX_RPM, which also keeps 
+		 * d * POSITION_GAIN inside 32 bits.
+		 *		POSITION_BRAKE_CNT = (16 * POSITION_MAX_RPM)^2 / POSITION_GAIN = 137964
+		 *  Within POSITION_DEADBAND_CNT (0.0126 degrees) of the target the speed target is 0, or the last 
+		 * update's worth of speed would hunt back and forth across it.
+		 ***********************************************************************************************************/
+		#define POSITION_CNT_PER_US ((POSITION_RANGE_DEGREES * COIL_RATIO * 65536ULL * 256ULL + 180ULL * (SERVO_MAX_US - SERVO_MIN_US)) / (360ULL * (SERVO_MAX_US - SERVO_MIN_US)))
+		#define POSITION_GAIN ((15360ULL * PLANNER_ACCEL_RPM_PER_S) / (65536ULL * COIL_RATIO))
+		#define POSITION_BRAKE_CNT ((16ULL * POSITION_MAX_RPM * 16ULL * POSITION_MAX_RPM) / POSITION_GAIN)
+		#define POSITION_DEADBAND_CNT 16
+		#if POSITION_GAIN < 1
+			#error "PLANNER_ACCEL_RPM_PER_S is too low for POSITION_MODE"
+		#endif
+		#if POSITION_MAX_RPM > 4000
+			#error "POSITION_MAX_RPM is too high"
+		#endif
+#endif
 				
 									
 
@@ -174,6 +300,29 @@
 		# define SINE_FULL_SCALE 255
 		/* Full scale value of the sine function (implemented in the Cpp File) */
 		
+		#define SINE_QUARTER_SIZE 64
+		/* Table steps in a quarter of the electrical cycle. The table is generated when compiling, so 
+		 * this can be changed to 32 or 16 to save flash, at the cost of a less accurate interpolation.	*/
+		 
+		#ifdef PWM_SEQUENTIAL
+			#undef DUTY_CACHE
+		#endif
+		
+		#define POWER_TO_DUTY (kDutyCycleFullScale / POWER_FULL_SCALE)
+		/* Duty cycle counts per step of _powerScale, see sineToDutyCycle(). 16000 / 100 = 160 */
+		
+		#define POWER_CENTER_SLOPE ((100UL * (1UL << 24) + POWER_CENTER_INTERCEPT - 1) / POWER_CENTER_INTERCEPT)
+		#define POWER_SPEED_SLOPE  ((100UL * (1UL << 24) + POWER_SPEED_INTERCEPT  - 1) / POWER_SPEED_INTERCEPT)
+		/* Power per RPM of the POWER PROFILE LINES in 8.24 fixed point, rounded up, so calcPowerScale() 
+		 * multiplies instead of dividing. Below the intercept, speed * SLOPE stays in 32 bits and 
+		 * (speed * SLOPE) >> 24 is exactly 100 * speed / INTERCEPT, rounded down.						*/
+		#if POWER_CENTER_INTERCEPT > 4096 || POWER_SPEED_INTERCEPT > 4096
+			#error "The power profile intercepts must be 4096 RPM or less"
+		#endif
+		
+		#define TENTH_Q16 6554
+		/* 65536 / 10 rounded up. (n * TENTH_Q16) >> 16 is n / 10 for n up to 16388. */
+		
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& CLASS DEFINITION
@@ -193,7 +342,32 @@ class bldcGimbal
 	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 	*/	public:
 
-		
+		/************************************************************************************************/
+		/*  ENUM: gimbalModulation_E																	*/
+		/** How the three duty cycles are made from the three sine values. Only the voltage between
+		 *  the coils turns the motor, so anything added to all three phases at once (the common mode)
+		 *  is free. The injected modes use that to fit a bigger sine between the rails.
+		 *  Parallel pwm engine only, PWM_SEQUENTIAL always drives the plain sine.						*/
+		/************************************************************************************************/
+			typedef enum gimbalModulation_E
+			{
+				eModulation_SINE = 0,
+					/**< Plain sine on each phase, centred on half duty. The line to line voltage only
+					 *  reaches sqrt(3)/2 = 86.6% of the supply.											*/
+				eModulation_SVPWM,
+					/**< Min-max (third harmonic) injection, the same duty cycles as centred space vector
+					 *  pwm. Half the sum of the highest and lowest phase is taken off all three, and they
+					 *  are scaled up by 2/sqrt(3), so the line to line amplitude is 15.5% higher for the
+					 *  same _powerScale while no phase goes further from half duty than before.			*/
+				eModulation_CLAMPED,
+					/**< Discontinuous space vector pwm: as eModulation_SVPWM but the lowest phase is held
+					 *  at 0 duty, so for each 120 degrees of its cycle a phase is parked on its low side
+					 *  FET. Its OFF edge merges into START, so its high side FET does not switch at all
+					 *  and every frame has one edge less for the ISR. The line to line voltages are the
+					 *  same as eModulation_SVPWM, the other two phases swing between 0 and full duty.	*/
+				eModulation_COUNT
+			}gimbalModulation_T;
+
 	/*
 	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 	&&& PUBLIC METHODS
@@ -214,20 +388,36 @@ class bldcGimbal
 	
 			 void tickle(void);
 			/**< This function needs to be called on a regular basis to enable the this class to do
-			 * housekeeping. Primarily, this is used to increment the motor at the proper times			 */
+			 * housekeeping. Primarily, this is used to increment the motor at the proper times. When
+			 * PWM_PROGRAM is defined the rotor program runs on its own, and this only drops the power 
+			 * once a MOTION_PLANNER ramp down has finished.												 */
 			 /*------------------------------------------------------------------------------------------*/
 			 
 			 
-			 bool set_servo_us(int16_t value);
-			 /**< This method takes a value read from a servo (in microseconds) and performs the scaling 
-			  * and preprocessing to allow this value to control the motor speed. This accepts a range 
-			  * from 1000uS to 2000uS where zero is 1500uS, anything greated than 1500uS is positive motor
-			  * rotation, and anything less than 1500uS is negative motor rotation.
+			 bool set_servo_cnt(uint16_t value);
+			 /**< This method takes a value read from a servo (in Timer1 counts, 1/16 uS, as 
+			  * measureServo::value_cnt() gives it) and performs the scaling and preprocessing to allow 
+			  * this value to control the motor speed. This accepts a range from 1000uS to 2000uS where 
+			  * zero is 1500uS, anything greated than 1500uS is positive motor rotation, and anything less
+			  * than 1500uS is negative motor rotation. With POSITION_MODE defined the pulse width sets 
+			  * the rotor angle instead, see POSITION_RANGE_DEGREES, to a 16th of a uS. 
 			  * @param value
-			  *		The servo pulse width measured in microseconds.										
+			  *		The servo pulse width measured in Timer1 counts, SERVO_CNT_PER_US per microsecond.	
 			  *	@return 
 			  *		True if success, false if failure.							   		     			  */
 			 /*-------------------------------------------------------------------------------------------*/
+			 
+			 void servo_lost(void);
+			 /**< Call when the servo signal has stopped. Stops the motor, or with POSITION_MODE holds it
+			  * where it is, and forgets the last pulse width, so set_servo_cnt() acts on the first frame
+			  * once the signal returns even if it is the same width as before.						  */
+			 /*-------------------------------------------------------------------------------------------*/
+			 
+			 int32_t position(void);
+			 /**< Where the rotor is now, in electrical angle counts (65536 per electrical cycle) from 
+			  * where it was at power up. Counts the electrical cycles turned, so it keeps going past one 
+			  * rotation. Positive is the direction positive speeds turn.								  */
+			 /*-------------------------------------------------------------------------------------------*/
 
 			/*
 			&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
@@ -241,6 +431,14 @@ class bldcGimbal
 						 /**< Accessor Method. See corresponding private property for more info.				*/
 					inline uint8_t powerScale(void) {return _powerScale;}
 						 /**< Accessor Method. See corresponding private property for more info.				*/
+					inline gimbalModulation_T modulation(void) {return (gimbalModulation_T)_modulation;}
+						 /**< Accessor Method. See corresponding private property for more info.				*/
+#ifdef PWM_PROFILE
+					inline uint16_t stepCnt(void) {return _stepCnt;}
+						 /**< Accessor Method. See corresponding private property for more info.				*/
+					inline uint16_t servoCnt(void) {return _servoCnt;}
+						 /**< Accessor Method. See corresponding private property for more info.				*/
+#endif
 			/*
 			&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 			&&& MUTATORS
@@ -255,9 +453,16 @@ class bldcGimbal
 						/**< Mutator Method. See corresponding private property for more info.					*/
 					{
 						_powerScale = value;
-						if(_powerScale >100) _powerScale = 100;
+						if(_powerScale > POWER_FULL_SCALE) _powerScale = POWER_FULL_SCALE;
 						return true;
 					}
+#ifdef POSITION_MODE
+					inline bool set_position(int32_t value) {_targetPosition = value; return true;}
+						/**< Mutator Method. See corresponding private property for more info.					*/
+#endif
+					bool set_modulation(gimbalModulation_T value);
+						/**< Mutator Method. See corresponding private property for more info. Returns false,
+						 *   and leaves the mode alone, if value is not a valid mode.							*/
 						 
 
 	/*
@@ -270,34 +475,87 @@ class bldcGimbal
 			/**< object which allows pwm control of the H bridges */
 			
 		uint16_t _speed_rpm;
-			/**< The set speed of the motor in rotations per minute */
+			/**< The set speed of the motor in rotations per minute. set_speed_rpm() refuses anything
+			 * faster than MAX_SPEED_RPM, returning false, so the servo, serialLink and twiSlave share
+			 * one limit.																				*/
 			
-		int8_t _baseIncrement;
-			/**< This is the amount the motor needs to be incremented every PWM cycle */
+		uint32_t _phase;
+			/**< Rotor position, as a phase accumulator where 2^32 is one electrical cycle. Its top 16 bits 
+			 * are _currentAngle. Advanced by _phaseIncrement for every frame queued.						*/
 			
-		uint16_t _incrementDelay_100us;  
-			/**< The accumulator is incremented by one each time this amount of time passes. 
-			 *	1 count is 100 microseconds */
+		volatile int32_t _phaseIncrement;
+			/**< Added to _phase once per table update, see PWM_PHASE_PER_RPM. Negative runs the motor in
+			 * reverse. Set by set_speed_rpm(), or ramped towards _targetIncrement by planMotion().		*/
+#ifdef MOTION_PLANNER
+		volatile int32_t _targetIncrement;
+			/**< The _phaseIncrement for the speed last passed to set_speed_rpm().						*/
 			
+		int16_t _accelSteps;
+			/**< Change of _phaseIncrement per table update, in PLANNER_JERK_CNT steps. Signed.			*/
 			
-		uint8_t _accumulator; 
-			/**< Accumulates increment requests in between PWM cycles. A RPM speed is broken down into 2 parts
-			 * 1) A fixed increment amount which gets incremented every PWM cycle (baseIncrement) and a 
-			 * incrementDelay which specifies a time interval to add additional increments to the next cycle.
-			 * the accumulator stores the increment requests.											  */
-						 		
-		uint32_t _incrementTimer;			
-			/**< stores the last timer value (_100us) when the accumulator was incremented. Used along
-			 * with incrementDelay to determine when to increment the accumulator.						*/
+		bool _rampPower;
+			/**< True while _powerScale is held up for the speed the motor was running at when the 
+			 * last set_speed_rpm() slowed it down. tickle() sets the power for the new speed once
+			 * the ramp is finished.																		*/
+#endif
 			
-		 uint8_t _currentStep;
-			/**< Holds the motor current PWM setting for the first coil. This is controls the relative
-			 * position within each of the motor's coils. Note that most motors have multiple coil pairs
-			 * so a full rotation will require more than one full cycle (2-255) of this property.		*/					
+		 int16_t _cycles;
+			/**< Electrical cycles _phase has wrapped round since power up, signed. With the top 16 bits
+			 * of _phase it makes position().															*/
+			 
+		 uint16_t _currentAngle;
+			/**< Electrical angle of the first coil, 65536 counts per electrical cycle. This is controls the
+			 * relative position within each of the motor's coils. Note that most motors have multiple coil
+			 * pairs so a full rotation takes COIL_RATIO cycles of this property, 458752 positions.		*/					
 		 uint8_t _powerScale;			
 			/**< A number between 0 and 10 which controls the power output going to the motor. 10 is
 			 * full power, 0 is no power																*/
-		 bool _reverse; //When true the motor goes in reverse, otherwise it goes forward.				*/		
+		 uint8_t _modulation;
+			/**< The gimbalModulation_T used by driveRotor(). Kept in a byte so the rotor program can
+			 * read it from its interrupt in one go.														*/
+		 uint16_t _lastServo;
+			/**< The pulse width last passed to set_servo_cnt(), which ignores a repeat of it. Cleared by
+			 * servo_lost().																			*/
+#ifdef AVERAGING_ENABLED
+		 int16_t _averageSpeed;
+			/**< Running average of the servo speed, see AVERAGING_RATE. Cleared by servo_lost().		*/
+#endif
+#ifdef POSITION_MODE
+		 int32_t _targetPosition;
+			/**< The position() the motor is sent to, set by set_servo_cnt() or set_position().			*/
+#endif
+#ifdef PWM_PROFILE
+		 uint16_t _stepCnt;
+			/**< Timer1 counts (1/16 uS) the last driveRotor() took to work out the three duty cycles 
+			 * from _currentAngle. Compare with and without SINE_INTERPOLATE or DUTY_CACHE.				*/
+			 
+		 uint16_t _servoCnt;
+			/**< Most Timer1 counts (1/16 uS) one set_servo_cnt() has taken since power up, the worst case
+			 * main loop time spent scaling a servo frame to a speed and power.							*/
+#endif
+#ifdef DUTY_CACHE
+		 uint16_t _dutyCache[SINE_QUARTER_SIZE + 1];
+			/**< The quarter wave table entries as duty cycles at _cachePower, see fillDutyCache().		*/
+			
+		 uint16_t _dutyMirror;
+			/**< Duty cycle of a sine value of 65536 (twice the centre) at _cachePower. The second half
+			 * of the cycle is this less the duty cycle of the first half.								*/
+			 
+		 uint16_t _dutyCenter;
+			/**< Duty cycle of SINE_CENTER at _cachePower, the centre the modulation works about.			*/
+			
+		 uint8_t _cachePower;
+			/**< The _powerScale _dutyCache is being filled for.											*/
+			
+		 uint8_t _cacheFill;
+			/**< Number of _dutyCache entries filled in so far for _cachePower.							*/
+#endif
+#ifdef PWM_PROGRAM
+		 uint8_t _programPower;
+			/**< _powerScale the newest queued frame was made with. When it is current, 
+			 * _phaseIncrement is 0 and so is any planner ramp, the program queues nothing and the ISR
+			 * replays the last frame.																	*/
+#endif
 	
 	
 	/*
@@ -309,16 +567,61 @@ class bldcGimbal
 	
 	
 	
-		void incrementRotor(uint8_t value);
-		/**< Increments the motor by the specied number of positions 
-		*	@param value
-		*		The number of positions to increment the motor by.									*/
+		void advanceRotor(void);
+		/**< Advances _phase by one _phaseIncrement and queues the pwm frame for the new position.	*/
 		/*------------------------------------------------------------------------------------------*/
+		
+#ifdef MOTION_PLANNER
+		void planMotion(void);
+		/**< Moves _phaseIncrement one table update further along the ramp to _targetIncrement. 
+		 * The acceleration is raised by one jerk step if it could still be brought back to 0
+		 * before _phaseIncrement overshoots, otherwise it is held, or lowered. When less than one
+		 * jerk step is left, _phaseIncrement is set to the target.									*/
+		/*------------------------------------------------------------------------------------------*/
+		
+		bool rampDone(void);
+		/**< True when _phaseIncrement has reached _targetIncrement. Safe to call from the main loop
+		 * while the rotor program is changing them.												*/
+		/*------------------------------------------------------------------------------------------*/
+		
+#endif
+#ifdef POSITION_MODE
+		void trackPosition(void);
+		/**< Called from tickle(). Works out how fast the motor may go towards _targetPosition and 
+		 * still stop on it, see POSITION_GAIN, and hands that to the planner as its target speed.		*/
+		/*------------------------------------------------------------------------------------------*/
+		
+#endif
+		void driveRotor(void);
+		/**< Queues a pwm frame which holds the rotor at _currentAngle, at the current _powerScale.	*/
+		/*------------------------------------------------------------------------------------------*/
+		
+#ifdef DUTY_CACHE
+		bool fillDutyCache(void);
+		/**< Called by driveRotor(). Starts _dutyCache again when _powerScale has changed, then fills in
+		 * up to DUTY_CACHE_STEP more entries. Returns true once every entry is filled for the current
+		 * _powerScale. Spreading the work keeps a power change from holding up one table update.	*/
+		/*------------------------------------------------------------------------------------------*/
+		
+		uint16_t dutyAt(uint16_t angle);
+		/**< Works out the duty cycle of the sine at an electrical angle from _dutyCache, like 
+		 * sineToDutyCycle(sineAt(angle)) but without the multiply by the power scale. Only valid
+		 * once fillDutyCache() has returned true.													*/
+		/*------------------------------------------------------------------------------------------*/
+		
+#endif
+#ifdef PWM_PROGRAM
+		static void programStep(void);
+		/**< The rotor program, registered with bldcPwm::set_program() by begin(). Called from the 
+		 * timer1 compare B interrupt once every update period, it tops the frame queue up with
+		 * advanceRotor(). The main loop only changes _phaseIncrement and _powerScale.				*/
+		/*------------------------------------------------------------------------------------------*/
+#endif
 					
-		inline uint16_t sineToDutyCycle(uint8_t value)
-		/**< Scales an 8 but sine value into a valid duty cycle value.
+		inline uint16_t sineToDutyCycle(uint16_t value)
+		/**< Scales a sine value from sineAt() into a valid duty cycle value.
 		 * @param value
-		 *     8 bit sine value.
+		 *     Sine value in 8.8 fixed point, 0 to SINE_FULL_SCALE*256.
 		 * @return
 		 *     A value PWM duty cycle value.														*/
 		/*------------------------------------------------------------------------------------------*/		 
@@ -326,46 +629,45 @@ class bldcGimbal
 			#ifndef PWM_SEQUENTIAL
 			
 			/*  The Equation is:
-				(_powerScale * value * kDutyCycleFullScale) / (kFullPowerScale * kSineFullScale) = 
-				(_powerScale * value * 1000) / (100 * 255) = 
-				(_powerScale * value * 10) / 255 = 
-				(_powerScale * value * 2 * 5) / 255 = 
-				(_powerScale * value * 2 ) / 51 				
-				Maximum Value During Calc = (_powerScale * value * 2 ) = 100*255*2 = 51000 < 65536 (16 bit unsigned full scale)
-			*/							
-				return ((uint16_t)_powerScale * (uint16_t)value * 2) /51;
-				#if POWER_FULL_SCALE != 100 || SINE_FULL_SCALE != 255 || kDutyCycleFullScale !=1000
-					#warning Manual Calculation Must Be Redone - POWER_FULL_SCALE, SINE_FULL_SCALE or kDutyCycleFullScale has changed.
-				#endif
+				(_powerScale * value * kDutyCycleFullScale) / (POWER_FULL_SCALE * SINE_FULL_SCALE * 256) = 
+				(_powerScale * POWER_TO_DUTY * value) / 65280
+				65536/65280 = 1 + 1/255, so with x = _powerScale * POWER_TO_DUTY * value this is (x + x/255) >> 16. 
+				Using x/256 instead is out by under 0.02 of a duty step, and rounding makes full scale exact
+				as long as kDutyCycleFullScale is below 32768:
+				(x + (x>>8) + 0x8000) >> 16
+				Maximum Value During Calc = 32767 * 65280 * (1 + 1/256) + 32768 < 2^31
+				No division, the multiply is 16 x 16 bits. The asserts check the constants still fit.
+			*/
+				static_assert(kDutyCycleFullScale % POWER_FULL_SCALE == 0, "kDutyCycleFullScale must be a multiple of POWER_FULL_SCALE");
+				static_assert(kDutyCycleFullScale < 32768, "kDutyCycleFullScale is too big for the 16 bit multiply");
+				static_assert(SINE_FULL_SCALE == 255, "Dividing by SINE_FULL_SCALE*256 is worked out for 65536 - 256");
+				uint32_t x = (uint32_t)((uint16_t)_powerScale * POWER_TO_DUTY) * value;
+				return (x + (x >> 8) + 0x8000) >> 16;
 				
 
 			#else
-				#define GENERIC_SCALER 64U								
-			/*  The Equation is:
-				(_powerScale * value * kDutyCycleFullScale) / (kFullPowerScale * SINETOTAL) = 
-				(_powerScale * value * 1000) / (100 * 384) = 
-				(_powerScale * value) * 1000 /38400 =
-				_powerScale * value * 2 * 5/ 384 = 
-				((_powerScale * value / 2) * 5) / 96				
-				
-				Maximum Value During Calc = (_powerScale * value / 2) * 5 = 63750 < 65536
-			*/			
 			
-			return ((((uint16_t) _powerScale * value*(uint16_t) / 2) * 5) /96)			
-			#if POWER_FULL_SCALE != 100 || SINETOTAL != 384 || kDutyCycleFullScale !=1000
-				#warning Manual Calculation Must Be Redone - POWER_FULL_SCALE, SINETOTAL or kDutyCycleFullScale has changed.
-			#endif				
-
-				
-				
+			/*  The Equation is:
+				(_powerScale * value * kDutyCycleFullScale) / (POWER_FULL_SCALE * SINE_TOTAL * 256) = 
+				(_powerScale * POWER_TO_DUTY * value) / 98304
+				98304 = 3 << 15, so with the same x as above this is (x >> 15) / 3, a 16 bit division.
+				Maximum Value During Calc = 16000 * 65280 < 2^30, and x >> 15 is at most 31875.
+				The three phases sum to SINE_TOTAL, so their duty cycles sum to at most full scale. 
+			*/
+				static_assert(kDutyCycleFullScale % POWER_FULL_SCALE == 0, "kDutyCycleFullScale must be a multiple of POWER_FULL_SCALE");
+				static_assert((uint64_t)kDutyCycleFullScale * SINE_FULL_SCALE * 256 < (1ULL << 32), "kDutyCycleFullScale is too big for the 32 bit multiply");
+				static_assert(SINE_TOTAL * 256UL == 3UL << 15, "Dividing by SINE_TOTAL*256 is worked out for 3 << 15");
+				uint32_t x = (uint32_t)((uint16_t)_powerScale * POWER_TO_DUTY) * value;
+				return (uint16_t)(x >> 15) / 3;
 			#endif
 		}
 				
-		void calcPowerScale(uint16_t speed);
+		void calcPowerScale(int16_t speed);
 		/**< Given a speed (in RPM) calculates the percent power which should be applied (based on values in the 
-		 * user configuration). It then sets _powerScale to the proper value.								 
+		 * user configuration). It then sets _powerScale to the proper value. No divisions, see 
+		 * POWER_CENTER_SLOPE.
 		 * @param speed
-		 *    The speed in RPM to use when calculating the power											 */
+		 *    The speed in RPM to use when calculating the power, either direction						 */
 		/*---------------------------------------------------------------------------------------------------*/
 		
 					
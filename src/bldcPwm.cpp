@@ -28,6 +28,7 @@
 #include <avr/io.h>
 #include "bldcPwm.h"
 #include <string.h>
+#include <avr/pgmspace.h>
 
 
 #include <avr/interrupt.h>
@@ -38,6 +39,9 @@
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 */
 
+	#define LATE_REARM_CNT 16
+		/* How far ahead of TCNT1 the ISR sets OCR1A for a late edge it has no more passes left for, 
+		 * enough for the write to land before the timer gets there.									*/
 
 
 
@@ -56,8 +60,8 @@
 			typedef enum isrExitMode_E
 			{
 				isrExitMode_Exit, ///< Exit ISR when completed, and handle next edge after reentry.
-				isrExitMode_Wait, ///< Do not exit ISR,but stop and wait for timer to expire, then loop to beginning.
-				isrExitMode_Loop  ///< Do not exit ISR and loop immediately to handle next edge without waiting.
+				isrExitMode_Wait, ///< Do not exit ISR,but stop and wait for timer to reach the next edge, then loop to beginning.
+				isrExitMode_Loop  ///< Do not exit ISR, the next edge is due almost immediately. Waits the same way as isrExitMode_Wait.
 			}pwmExitMode_T;
 	
 
@@ -68,14 +72,33 @@
 			/************************************************************************************************/
 			typedef volatile struct pwmEntry_S
 			{				
+#ifndef PWM_SEQUENTIAL
+				volatile uint8_t portD;
+						/**< The FET bits of PORTD as they must be after this edge. Bits outside FET_PD_MASK
+						 * are always 0. Precalculated by updateISR() so the ISR does a single store instead 
+						 * of decoding a command. See the port images in fets.h.							*/
+				volatile uint8_t portB;
+						/**< The FET bits of PORTB as they must be after this edge. See portD.				*/
+#else
 				volatile bldcPwm::COMMAND_T command;  
-						/**< What behavior to execute when the timer expires. See definition of pwmCommmand_T
-						 * and pwmSequence_T. This uses a macro which is either pwmCommand_T or pwmSequence_T
-						 * depending on PWM_SEQUENCE														*/
-				volatile uint16_t	deltaTime; 
-					/**< What value the timer should be at when this command is executed. This is referenced
-						* as a delta from the time that the previous command was executed.					*/					
+						/**< What behavior to execute when the timer expires. See definition of pwmSequence_T.
+						 * This uses a macro which is pwmSequence_T when PWM_SEQUENTIAL is defined.		*/
+#endif
+				volatile uint16_t	offset; 
+					/**< When this entry is executed, in timer counts from the start of the PWM cycle. The
+						* ISR adds it to pwmIsrData.cycleStart to get the absolute OCR1A target, so the ISR's
+						* own latency never accumulates into the timing.										*/					
 				pwmExitMode_T exitMode; //Controls completion behavior at end of ISR. See pwmExitMode_T.
+#ifndef PWM_SEQUENTIAL
+				volatile bool endOfCycle;
+					/**< True for the last entry of the table (the ALLOFF edge). After storing this entry
+					 * the ISR returns to the start of the table and services any pending table change.	*/
+	#ifdef PWM_PROFILE
+				volatile uint8_t command;
+					/**< The pwmCommand_T this edge was made from. Only kept so the profiler can file its
+					 * statistics by command.																*/
+	#endif
+#endif
 			}pwmEntry_T;
 		
 		
@@ -88,46 +111,43 @@
 			 * This is used to both hold the data. Some members of this structure are changed outside the 
 			 * ISR and serve as a means of controlling the ISR's behavior.									
 			 *
-			 * There are 2 tables. Each table defines the PWM cycle. While one of these tables is being 
-			 * executed by the ISR, the second table is free to be loaded with information for a new PWM 
-			 * cycle. the isActiveTableA member is used to indicate which of these 2 tables is assigned 
-			 * to the ISR. The changeTable variable is used to initiate a table change. isActiveTableA is 
-			 * set by the ISR			 		 															*/
+			 * The tables (frames) form a single producer, single consumer ring. Each one defines a PWM 
+			 * cycle. updateISR() fills the frame after frameQueued and then moves frameQueued on to it. 
+			 * The ISR plays frameActive, and at every update point moves on by one frame if frameQueued is
+			 * ahead of it, otherwise it replays the same frame. Each index is a single byte written by one
+			 * side only, so neither side needs a handshake flag or has to turn interrupts off.			*/
 			/************************************************************************************************/
 			typedef  struct pwmIsrData_S
 			{
-				volatile pwmEntry_T tableA[8];		
-					/**<table which defines what actions happen at what time during the PWM cycle.			*/
-				volatile pwmEntry_T tableB[8];
-					/**< An alternate to table A.															*/
-				volatile bool isActiveTableA;
-					/**< This indicates which table is being executed by the ISR. When set to true,
-						*	tableA is being used by the ISR, when false, tableB is. 
-						*  DEFAULT: true																		*/
-				volatile bool changeTable; 
-					/**< This is set to true to instruct the ISR to change tables when starting its
-						* next PWM cycle. the ISR will set this to false once the table is changed. 
-						* While this is set to true, neither of the tables should be changed. When it is false
-						* you may change the non active table (as defined by isActiveTableA)					*/	
+				volatile pwmEntry_T frames[PWM_FRAME_COUNT][8];		
+					/**<tables which define what actions happen at what time during the PWM cycle.			*/
+				volatile uint8_t frameActive;
+					/**< Index of the frame being played by the ISR. Only written by the ISR. 
+						*  DEFAULT: 0																			*/
+				volatile uint8_t frameQueued; 
+					/**< Index of the newest complete frame. Only written by updateISR(), after the frame
+						* is complete. When it equals frameActive there is nothing queued and the ISR keeps 
+						* replaying its frame. The frame after frameQueued may be written as long as it is not
+						* frameActive.																			
+						*  DEFAULT: 0																			*/	
 					pwmEntry_T *pEntry;
 					/**< Pointer to the current entry in the currently active table. This is used 
 						* by the ISR to quickly access the table without having to do pointer multiplication
 						* to find it's position in the current table.			 		
 						* DEFAULT: tableA[0]																	*/
 				volatile pwmEntry_T *pTableStart;   
-					/**<Pointer to beginning of table the ISR is using. Either tableA or tableB depending 
-						*  which table the ISR is selected to be using.										*/
+					/**<Pointer to beginning of table the ISR is using, i.e. frames[frameActive].				*/
+				uint16_t cycleStart;
+					/**< Timer1 count at which the current PWM cycle started. Timer1 free runs, so this wraps
+					 * along with it and is moved on by exactly PWM_CYCLE_CNT at the end of every cycle.	*/
+				uint8_t cyclesToUpdate;
+					/**< PWM cycles left until the ISR may take on a new table. Counts down from 
+					 * PWM_CYCLES_PER_UPDATE every cycle, so table changes happen at PWM_UPDATE_KHZ.			*/
 				volatile bool enabled; 
 					/**< When true, the ISR will run, when false, the ISR will return without 
 						*	doing anything.		
 						*  DEFAULT: false																	*/		
 				//uint16_t startTime; //Timer value when 	
-				volatile bool icr1Conflict; 
-					/**< True if the ICR1 triggered while this ISR ran. Since this ISR takes a relatively
-					 * long time and we are unable to use the input compare register on timer one due to 
-					 * not allowing the timer to free-run, we report if this interrupt routine could have 
-					 * possibly delayed the response time of an IRQ servicing the timer1 input compare.
-					 * This is accessable using the _icr1Conflict accessor method.							*/
 
 			}pwmIsrData_T;		
 			
@@ -144,26 +164,62 @@
 		 * See the declaration of pwmIsrData_T for more information	 */
 	  pwmEntry_T IsrCurrentEntry;
 	  
+#ifdef PWM_PROFILE
+	  bldcPwm::pwmProfile_T pwmProfile;
+		/**< ISR timing statistics. Written by the pwm ISR, read with bldcPwm::profileSnapshot().	*/
+#endif
+#ifdef PWM_PROGRAM
+	  void (* volatile pwmProgram)(void);
+		/**< Frame producer called by the timer1 compare B interrupt, see bldcPwm::set_program().		*/
+#endif
+	  
 	  
 #ifndef PWM_SEQUENTIAL	  
-	  const pwmEntry_T pwmInit[8] = 
+	/************************************************************************************************/
+	/* ARRAY: pwmInit																				*/
+	/** Table played until the first update. Lives in flash, the constructor copies it into frame 0. */
+	/************************************************************************************************/
+	  const struct pwmEntry_S pwmInit[8] PROGMEM = 
 	  {		  
-		{(bldcPwm::pwmCommand_T) 0,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmCommand_T)5,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmCommand_T)6,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmCommand_T)3,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmCommand_T)4,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmCommand_T)1,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmCommand_T)2,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmCommand_T)7,	1600,	isrExitMode_Exit}
+		{FET_PD_START,												FET_PB_START,												0,	isrExitMode_Exit,	false},	//START
+		{FET_PD_START|CpFET_PD,										FET_PB_START|CpFET_PB,										(PWM_CYCLE_CNT/10)*1,	isrExitMode_Exit,	false},	//OFFC
+		{FET_PD_START|CpFET_PD|CnFET_PD,							FET_PB_START|CpFET_PB|CnFET_PB,								(PWM_CYCLE_CNT/10)*2,	isrExitMode_Exit,	false},	//LOWC
+		{FET_PD_START|CpFET_PD|CnFET_PD|BpFET_PD,					FET_PB_START|CpFET_PB|CnFET_PB|BpFET_PB,					(PWM_CYCLE_CNT/10)*3,	isrExitMode_Exit,	false},	//OFFB
+		{FET_PD_START|CpFET_PD|CnFET_PD|BpFET_PD|BnFET_PD,			FET_PB_START|CpFET_PB|CnFET_PB|BpFET_PB|BnFET_PB,			(PWM_CYCLE_CNT/10)*4,	isrExitMode_Exit,	false},	//LOWB
+		{FET_PD_START|CpFET_PD|CnFET_PD|BpFET_PD|BnFET_PD|ApFET_PD,	FET_PB_START|CpFET_PB|CnFET_PB|BpFET_PB|BnFET_PB|ApFET_PB,	(PWM_CYCLE_CNT/10)*5,	isrExitMode_Exit,	false},	//OFFA
+		{FET_PD_MASK,												FET_PB_MASK,												(PWM_CYCLE_CNT/10)*6,	isrExitMode_Exit,	false},	//LOWA
+		{FET_PD_ALLOFF,												FET_PB_ALLOFF,												(PWM_CYCLE_CNT/10)*7,	isrExitMode_Exit,	true}	//ALLOFF
+	};
+	
+	/************************************************************************************************/
+	/* STRUCT: pwmCommandBits_S																		*/
+	/** FET bits which a pwmCommand_T turns on when it is added to the port image. Indexed by 
+	 * pwmCommand_T. START and ALLOFF replace the image instead, so their bits are not used.		*/
+	/************************************************************************************************/
+	typedef struct pwmCommandBits_S
+	{
+		uint8_t portD; ///< Bits to OR into the PORTD image
+		uint8_t portB; ///< Bits to OR into the PORTB image
+	}pwmCommandBits_T;
+	
+	const pwmCommandBits_T pwmCommandBits[bldcPwm::ePwmCommand_END_OF_ENUM] PROGMEM =
+	{
+		{FET_PD_START,	FET_PB_START},	//START
+		{ApFET_PD,		ApFET_PB},		//OFFA
+		{AnFET_PD,		AnFET_PB},		//LOWA
+		{BpFET_PD,		BpFET_PB},		//OFFB
+		{BnFET_PD,		BnFET_PB},		//LOWB
+		{CpFET_PD,		CpFET_PB},		//OFFC
+		{CnFET_PD,		CnFET_PB},		//LOWC
+		{FET_PD_ALLOFF,	FET_PB_ALLOFF}	//ALLOFF
 	};
 #else
-	const pwmEntry_T pwmInit[8] =  
+	const struct pwmEntry_S pwmInit[8] PROGMEM =  
 	{
-		{(bldcPwm::pwmSequence_T)0,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmSequence_T)1,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmSequence_T)2,	1600,	isrExitMode_Exit},
-		{(bldcPwm::pwmSequence_T)3,	1600,	isrExitMode_Exit},
+		{(bldcPwm::pwmSequence_T)0,	0,	isrExitMode_Exit},
+		{(bldcPwm::pwmSequence_T)1,	(PWM_CYCLE_CNT/10)*1,	isrExitMode_Exit},
+		{(bldcPwm::pwmSequence_T)2,	(PWM_CYCLE_CNT/10)*2,	isrExitMode_Exit},
+		{(bldcPwm::pwmSequence_T)3,	(PWM_CYCLE_CNT/10)*3,	isrExitMode_Exit},
 	};
 #endif 								  
 
@@ -175,6 +231,172 @@
 
 bool checkISRData(pwmEntry_T  *table);		  
 
+	/*****************************************************************************
+	*  Function: exitModeFor
+	*	Description:															 */
+   /**		Picks how the ISR should wait for an entry, based on how long after
+	*		the previous entry it is due.
+	* @param deltaTime Timer counts between the previous entry and this one.
+	****************************************************************************/
+	static inline pwmExitMode_T exitModeFor(uint16_t deltaTime)
+	{
+		if (deltaTime <= ISR_LOOP_CNT ) return isrExitMode_Loop;
+		else if (deltaTime <= MIN_TIMER_OCR_CNT ) return isrExitMode_Wait;
+		else return isrExitMode_Exit;
+	}
+
+	/*****************************************************************************
+	*  Function: frameAfter
+	*	Description:															 */
+   /**		Returns the index of the frame which follows the given one in the
+	*		pwmIsrData.frames ring.
+	* @param frame Index of a frame, 0 to PWM_FRAME_COUNT-1.
+	****************************************************************************/
+	static inline uint8_t frameAfter(uint8_t frame)
+	{
+		return (frame + 1) & (PWM_FRAME_COUNT - 1);
+	}
+
+	/*****************************************************************************
+	*  Function: timer1Count
+	*	Description:															 */
+   /**		Reads TCNT1 with interrupts off. The pwm ISR runs with interrupts
+	*		enabled, and the capture ISR reads ICR1 and TCNT1 through the same 
+	*		TEMP register, so an unprotected read could get its high byte.
+	* @return Timer1 count.
+	****************************************************************************/
+	static inline uint16_t timer1Count(void)
+	{
+		uint8_t sreg = SREG;
+		cli();
+		uint16_t now = TCNT1;
+		SREG = sreg;
+		return now;
+	}
+
+#ifdef PWM_PROFILE
+	/*****************************************************************************
+	*  Function: profileCount
+	*	Description:															 */
+   /**		Adds one sample to a profiler histogram and its maximum.
+	* @param histogram The PWM_PROFILE_BUCKETS buckets to count the sample in.
+	* @param max Largest sample seen so far. Updated if this sample is larger.
+	* @param counts The sample, in timer counts.
+	* @param shift log2 of the bucket width.
+	****************************************************************************/
+	static inline void profileCount(uint16_t *histogram, uint16_t *max, uint16_t counts, uint8_t shift)
+	{
+		uint16_t bucket = counts >> shift;
+		if (bucket >= PWM_PROFILE_BUCKETS) bucket = PWM_PROFILE_BUCKETS-1;
+		if (histogram[bucket] != 0xFFFF) histogram[bucket]++;
+		if (counts > *max) *max = counts;
+	}
+	
+	/*****************************************************************************
+	*  Function: profileEdge
+	*	Description:															 */
+   /**		Records how late an edge was written to the port. Call right after
+	*		the port write.
+	* @param command The COMMAND_T of the edge.
+	* @param due Timer1 count at which the edge was due.
+	****************************************************************************/
+	static inline void profileEdge(uint8_t command, uint16_t due)
+	{
+		int16_t late = (int16_t)(timer1Count() - due);
+		if (late < 0)
+		{
+			pwmProfile.earlyEdges++;
+			late = 0;
+		}
+		profileCount(pwmProfile.lateness[command], &pwmProfile.latenessMax[command], late, PWM_PROFILE_LATE_SHIFT);
+	}
+	
+	/*****************************************************************************
+	*  Function: profileLate
+	*	Description:															 */
+   /**		Counts an edge whose compare was missed. See pwmWaitFor().
+	****************************************************************************/
+	static inline void profileLate(void)
+	{
+		pwmProfile.lateEdges++;
+	}
+	
+	/*****************************************************************************
+	*  Function: profileUpdateDone
+	*	Description:															 */
+   /**		Records how long an updateISR() call took. Call with interrupts off.
+	*		The sample is dropped if the pwm ISR ran in the meantime, since its
+	*		time would be counted too.
+	* @param start TCNT1 when updateISR() started.
+	* @param isrCount pwmProfile.isrCount when updateISR() started.
+	****************************************************************************/
+	static inline void profileUpdateDone(uint16_t start, uint16_t isrCount)
+	{
+		uint16_t duration = TCNT1 - start;
+		if (isrCount != pwmProfile.isrCount) return; 
+		pwmProfile.updateLast = duration;
+		if (duration > pwmProfile.updateMax) pwmProfile.updateMax = duration;
+	}
+#endif
+
+	/*****************************************************************************
+	*  Function: pwmWaitFor
+	*	Description:															 */
+   /**		Arranges for the pwm ISR to execute its next entry. 
+	*
+	*		For isrExitMode_Exit entries, OCR1A is set to the absolute target and
+	*		the ISR may return, so latency never accumulates from one cycle to the
+	*		next. If the timer has already passed the target by the time OCR1A is
+	*		set, we fall through and the ISR handles the entry straight away rather
+	*		than a full timer wrap later.
+	*
+	*		Otherwise the entry is close to the previous one, and we spin until the
+	*		same gap has passed since the previous edge was actually written. If 
+	*		the previous edge was late, this one is equally late, which keeps the
+	*		dead time between them.
+	*
+	*		exitMode is worked out by updateISR() from the gap within one table. 
+	*		When the ISR moves to a new table the real gap can be longer, so a 
+	*		long gap always exits rather than spinning.
+	*
+	*		On the ISR's last pass a late entry can not be handled here. OCR1A
+	*		is then set just ahead of the timer so the compare fires at once and
+	*		the ISR comes straight back for it. Clearing the compare instead 
+	*		would leave the outputs alone until Timer1 wraps, 4 mS later.
+	* @param target Timer1 count at which the next entry is due.
+	* @param due Timer1 count at which the previous entry was due.
+	* @param written Timer1 count at which the previous entry was written.
+	* @param exitMode How to wait. See pwmExitMode_T.
+	* @param mustExit The ISR has no passes left, it returns whatever happens.
+	* @return true if the ISR should return and wait for the compare interrupt.
+	*		In that case interrupts are left disabled, the ISR's reti turns them
+	*		back on.
+	****************************************************************************/
+	static inline bool pwmWaitFor(uint16_t target, uint16_t due, uint16_t written, pwmExitMode_T exitMode, bool mustExit)
+	{
+		uint16_t gap = target - due;
+		if (mustExit || exitMode == isrExitMode_Exit || gap > MIN_TIMER_OCR_CNT)
+		{
+			uint8_t sreg = SREG;
+			cli(); //A nested interrupt between setting OCR1A and checking it would run this entry twice
+			OCR1A = target;  //Configure the time of the next interrupt.
+			if ((int16_t)(TCNT1 - target) < 0) return true;
+#ifdef PWM_PROFILE
+			profileLate();
+#endif
+			if (mustExit)
+			{
+				OCR1A = TCNT1 + LATE_REARM_CNT;	//Come straight back, the ISR works the due time out from the entry
+				return true;
+			}
+			TIFR = _BV(OCF1A); //Too late for the compare, we handle it here instead
+			SREG = sreg;
+			return false;
+		}
+		while ((uint16_t)(timer1Count() - written) < gap) asm(" "); //Stay in ISR and wait for the next edge to come due.
+		return false;
+	}
+
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& INTERRUPT SERVICE ROUTINES
@@ -193,10 +415,11 @@ bool checkISRData(pwmEntry_T  *table);
 	 *      is to do a lot of the upfront work using the bldcPwm::update method outside the ISR in 
 	 *		order to minimize the complexity of ISR. 
 	 *   
-	 *		This ISR allows timer1 to freerun through it's whole range, so all the output compare
-	 *      timer expirations need to be relative. As such the timer expirations are specified as
-	 *		deltas, and the timer output compare register value for the next expiration is dynamically
-	 *      calculated and set from within this ISR.
+	 *		This ISR allows timer1 to freerun through it's whole range, and never writes TCNT1. Each
+	 *      entry holds its time as an offset from the start of the PWM cycle, and the output compare
+	 *		value for the next expiration is pwmIsrData.cycleStart plus that offset. The cycle start
+	 *      moves on by exactly PWM_CYCLE_CNT every cycle, so the ISR's latency never adds up, and 
+	 *		the timer (and ICR1) keeps counting real time for other modules.
 	 *
 	 *		The timer expiration is variable, and could be less that a microsecond. As such, there is a
 	 *		risk that the timer could run past its expiration before we exit the ISR. To handle this, 
@@ -210,105 +433,64 @@ bool checkISRData(pwmEntry_T  *table);
 	
 #ifndef PWM_SEQUENTIAL
 
-	ISR(TIMER1_COMPA_vect) 
+	ISR(TIMER1_COMPA_vect)
 	{
+#ifdef PWM_PROFILE
+		uint16_t profileEntry = TCNT1;
+		uint8_t profileCommand = pwmIsrData.pEntry->command;
+#endif
+		if (!pwmIsrData.enabled) return;
+		uint16_t due = pwmIsrData.cycleStart + pwmIsrData.pEntry->offset;	//Timer1 count at which the edge we are about to write was due. Not OCR1A, see pwmWaitFor()
+#ifdef PWM_PROGRAM
+		uint8_t programEnable = TIMSK & _BV(OCIE1B);	//Keep the frame program from running on top of us
+		TIMSK &= ~_BV(OCIE1B);
+#endif
 		sei();
-		OCR1A = PWM_CYCLE_CNT;  //Allow us to count freely so we know how long we are in ISR
  		DEBUG_OUT(0x08);
 		//redOn();
-		bool incEntry = true; //When true, ISR will increment the pwmIsrData.pEntry pointer before exiting.		
-		if (!pwmIsrData.enabled) return;
 		
-		for (int i=0;i<10;i++) {	//Repeat up to 11 times if deltaTime keeps being too short		
+		for (uint8_t i=0;i<10;i++) {	//Handle up to 10 edges per interrupt if they keep being too close together	
 			DEBUG_OUT(0x09);
-			DEBUG_OUT(pwmIsrData.pEntry->command);
-			switch (pwmIsrData.pEntry->command)
+			PORTD = (PORTD & ~FET_PD_MASK) | pwmIsrData.pEntry->portD;	//Switch every FET on PORTD at once
+			#if FET_PB_MASK != 0
+				PORTB = (PORTB & ~FET_PB_MASK) | pwmIsrData.pEntry->portB;
+			#endif
+			uint16_t written = timer1Count();
+#ifdef PWM_PROFILE
+			profileEdge(pwmIsrData.pEntry->command, due);
+#endif
+			
+			if (pwmIsrData.pEntry->endOfCycle)
 			{
-				case bldcPwm::ePwmCommand_START:				
-					ApFETOn();
-					BpFETOn();
-					CpFETOn();
-					incEntry = true;						
-					break;														
-				case bldcPwm::ePwmCommand_OFFA:
-					ApFETOff();
-					incEntry = true;
-					break;
-				case bldcPwm::ePwmCommand_LOWA:				
-					AnFETOn();					
-					incEntry = true;					
-					break;
-				case bldcPwm::ePwmCommand_OFFB:
-					BpFETOff();
-					incEntry = true;
-					break;
-				case bldcPwm::ePwmCommand_LOWB:
-					BnFETOn();
-					incEntry = true;
-					break;					
-				case bldcPwm::ePwmCommand_OFFC:
-					CpFETOff();
-					incEntry = true;
-					break;
-				case bldcPwm::ePwmCommand_LOWC:				
-					CnFETOn();
-					incEntry = true;
-					break;								
-				case bldcPwm::ePwmCommand_ALLOFF:
-					AnFETOff();
-					BnFETOff();
-					CnFETOff();
-													
-					if (pwmIsrData.changeTable == true)  //If user has requested a change of tables then ...
+				if (--pwmIsrData.cyclesToUpdate == 0)	//Otherwise replay this table until the next update is due
+				{
+					pwmIsrData.cyclesToUpdate = PWM_CYCLES_PER_UPDATE;
+					if (pwmIsrData.frameActive != pwmIsrData.frameQueued)  //If there is a frame queued, play it
 					{
 						DEBUG_OUT(0x0A);
-						//_delay_us(200);
-						pwmIsrData.pTableStart = (pwmIsrData.isActiveTableA ? pwmIsrData.tableA : pwmIsrData.tableB);										
-							/* Go to the beginning of the next table */
-						pwmIsrData.changeTable = false;															
-							/* In theory, the user sets changeTable to force a change in the table, in reality
-							 * isActiveTableA is enough. However, the user will look at changeTable to see if 
-							 * the change over was made, so that he knows when he can start writing to the 
-							 * free table again. so we reset the flag here.									*/
+						uint8_t frame = frameAfter(pwmIsrData.frameActive);
+						pwmIsrData.pTableStart = pwmIsrData.frames[frame];
+						pwmIsrData.frameActive = frame;	//Frees the frame we just finished for updateISR()
 					}
-					//pwmIsrData.pEntry = pwmIsrData.tableA;
-					pwmIsrData.pEntry = pwmIsrData.pTableStart; //Reset script entry to beginning.
-					incEntry = false; //Don't increment entry because we just sent entry to beginning instead.
-					break;				
-				default:
-					DEBUG_OUT(0xFF);
-					//Something is very wrong, stop processing the ISR
-					pwmIsrData.enabled	 = false;
-					break;					
-			}
-			if (incEntry) pwmIsrData.pEntry++; //Go to next entry if the switch told us to.			
-			if (pwmIsrData.pEntry->exitMode != isrExitMode_Loop)
-			{
-				
-				OCR1A = pwmIsrData.pEntry->deltaTime;  //Configure the time of the next interrupt.
-				if ( (pwmIsrData.pEntry->deltaTime - TCNT1) < 80 || (pwmIsrData.pEntry->deltaTime - TCNT1) > PWM_CYCLE_CNT)
-				{
-					asm("NOP");
-				}
-				break;		
-				
-				if (pwmIsrData.pEntry->exitMode  == isrExitMode_Exit){
-						
-				}
-				else
-				{					
-					//while (TCNT1 <  pwmIsrData.pEntry->deltaTime ) asm(" ");	//Otherwise, stay in ISR and wait for the next timer expiration.
-					while ((TIFR & _BV(OCF1A)) == 0)  asm(" ");
-					OCR1A = PWM_CYCLE_CNT;  //Allow us to count freely so we know how long we are in ISR
-					TIFR = _BV(OCF1A); // Clear any pending interrupts					
 				}
-			} //END if (!isrExitMode_Loop)
-			TCNT1 = 0;	
+				pwmIsrData.pEntry = pwmIsrData.pTableStart; //Reset script entry to beginning.
+				pwmIsrData.cycleStart += PWM_CYCLE_CNT;		//Next cycle starts exactly one period after this one
+			}
+			else pwmIsrData.pEntry++; //Go to next entry
+			
+			uint16_t target = pwmIsrData.cycleStart + pwmIsrData.pEntry->offset;
+			if (pwmWaitFor(target, due, written, pwmIsrData.pEntry->exitMode, i >= 9)) break;
+			due = target;
 		} //END repeat (for loop)		
 	
-	if ((TIFR & _BV(ICF1)) != 0) pwmIsrData.icr1Conflict = true; 	
-		/*Check to see if an  input compare event occurred during the service of this interrupt.
-		 * This can be used to warn other processes do disregard the current data.*/
+#ifdef PWM_PROFILE
+	pwmProfile.isrCount++;
+	profileCount(pwmProfile.duration[profileCommand], &pwmProfile.durationMax[profileCommand], timer1Count() - profileEntry, PWM_PROFILE_DURATION_SHIFT);
+#endif
+#ifdef PWM_PROGRAM
+	cli();
+	TIMSK |= programEnable;
+#endif
 	//redOff();	
 	DEBUG_OUT(0x0B);
 	} //END Function
@@ -318,12 +500,16 @@ bool checkISRData(pwmEntry_T  *table);
 
 	ISR(TIMER1_COMPA_vect) 
 		{
-			OCR1A = PWM_CYCLE_CNT;  //Allow us to count freely so we know how long we are in ISR
+#ifdef PWM_PROFILE
+			uint16_t profileEntry = TCNT1;			
+			uint8_t profileCommand = pwmIsrData.pEntry->command;	
+#endif
+			uint16_t due = pwmIsrData.cycleStart + pwmIsrData.pEntry->offset;	//Timer1 count at which the edge we are about to write was due. Not OCR1A, see pwmWaitFor()
  			DEBUG_OUT(0x08);
 			//redOn();
 			bool incEntry = true; //When true, ISR will increment the pwmIsrData.pEntry pointer before exiting.		
 			if (!pwmIsrData.enabled) return;
-			for (int i=0;i<10;i++) {	//Repeat up to 11 times if deltaTime keeps being too short		
+			for (uint8_t i=0;i<10;i++) {	//Handle up to 10 edges per interrupt if they keep being too close together		
 				DEBUG_OUT(0x09);			
 				DEBUG_OUT(pwmIsrData.pEntry->command);
 				switch (pwmIsrData.pEntry->command)
@@ -353,23 +539,24 @@ bool checkISRData(pwmEntry_T  *table);
 						incEntry = true;
 						break;					
 					case bldcPwm::ePwmSequence_ALLOFF:
-						if (pwmIsrData.pEntry->deltaTime != 0) {
+						if (pwmIsrData.pEntry->offset != 0) {
 							//highSideOff();
 							//lowSideOff();															
 						}
 			
-						if (pwmIsrData.changeTable == true)  //If user has requested a change of tables then ...
+						if (--pwmIsrData.cyclesToUpdate == 0)	//Otherwise replay this table until the next update is due
 						{
-							DEBUG_OUT(0x0A);						
-							pwmIsrData.pTableStart = (pwmIsrData.isActiveTableA ? pwmIsrData.tableA : pwmIsrData.tableB);										
-								/* Go to the beginning of the next table */
-							pwmIsrData.changeTable = false;															
-								/* In theory, the user sets changeTable to force a change in the table, in reality
-								 * isActiveTableA is enough. However, the user will look at changeTable to see if 
-								 * the change over was made, so that he knows when he can start writing to the 
-								 * free table again. so we reset the flag here.									*/
-						}					
+							pwmIsrData.cyclesToUpdate = PWM_CYCLES_PER_UPDATE;
+							if (pwmIsrData.frameActive != pwmIsrData.frameQueued)  //If there is a frame queued, play it
+							{
+								DEBUG_OUT(0x0A);
+								uint8_t frame = frameAfter(pwmIsrData.frameActive);
+								pwmIsrData.pTableStart = pwmIsrData.frames[frame];
+								pwmIsrData.frameActive = frame;	//Frees the frame we just finished for updateISR()
+							}					
+						}
 						pwmIsrData.pEntry = pwmIsrData.pTableStart; //Reset script entry to beginning.
+						pwmIsrData.cycleStart += PWM_CYCLE_CNT;		//Next cycle starts exactly one period after this one
 						incEntry = false; //Don't increment entry because we just sent entry to beginning instead.
 						break;				
 					default:
@@ -378,21 +565,22 @@ bool checkISRData(pwmEntry_T  *table);
 						pwmIsrData.enabled	 = false;
 						break;					
 				}
+				uint16_t written = timer1Count();
+#ifdef PWM_PROFILE
+				if (pwmIsrData.pEntry->command < bldcPwm::ePwmSequence_END_OF_ENUM) profileEdge(pwmIsrData.pEntry->command, due);
+#endif
 																					
 				if (incEntry) pwmIsrData.pEntry++; //Go to next entry if the switch told us to.			
-				if (pwmIsrData.pEntry->exitMode != isrExitMode_Loop)
-				{
-					OCR1A = pwmIsrData.pEntry->deltaTime;  //Configure the time of the next interrupt.
-					if (pwmIsrData.pEntry->exitMode  == isrExitMode_Exit) break;				
-					else
-					{										
-						while ((TIFR & _BV(OCF1A)) == 0)  asm(" ");
-						OCR1A = PWM_CYCLE_CNT;  //Allow us to count freely so we know how long we are in ISR
-						TIFR = _BV(OCF1A); // Clear any pending interrupts					
-					}
-				} //END IF  (!isrExitMode_Loop)
-				TCNT1 = 0;
+				
+				uint16_t target = pwmIsrData.cycleStart + pwmIsrData.pEntry->offset;
+				if (pwmWaitFor(target, due, written, pwmIsrData.pEntry->exitMode, i >= 9)) break;
+				due = target;
 			} //END repeat (for loop)		
+#ifdef PWM_PROFILE
+			pwmProfile.isrCount++;
+			if (profileCommand < bldcPwm::ePwmSequence_END_OF_ENUM)
+				profileCount(pwmProfile.duration[profileCommand], &pwmProfile.durationMax[profileCommand], timer1Count() - profileEntry, PWM_PROFILE_DURATION_SHIFT);
+#endif
 	//	redOff();	
 		DEBUG_OUT(0x0B);
 		} //END FUNCTION
@@ -400,6 +588,30 @@ bool checkISRData(pwmEntry_T  *table);
 #endif 	
 
 
+#ifdef PWM_PROGRAM
+	/****************************************************************************************************/
+	/*  ISR: TIMER1_COMPB_vect																			*/
+	/**		Runs the frame program registered with bldcPwm::set_program() once every update period 
+	 *		(PWM_UPDATE_CNT timer counts). Producing a frame takes far longer than the gap between two
+	 *		edges, so the program runs with interrupts enabled, and the pwm ISR masks this interrupt
+	 *		for as long as it runs. This interrupt masks itself so it never runs on top of itself.
+	 *
+	 *		Its phase relative to the PWM cycle does not matter: the frame queue holds PWM_FRAME_COUNT-1
+	 *		frames, and the ISR takes on the next one at its own end of cycle.							*/
+	/****************************************************************************************************/	
+	ISR(TIMER1_COMPB_vect)
+	{
+		OCR1B += PWM_UPDATE_CNT;
+		TIMSK &= ~_BV(OCIE1B);
+		sei();
+		void (*step)(void) = pwmProgram;
+		if (step) step();
+		cli();
+		if (pwmProgram) TIMSK |= _BV(OCIE1B);	//Unless set_program(0) stopped it meanwhile
+	}
+#endif
+
+
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& CLASS IMPLEMENTATION FUNCTIONS
@@ -418,15 +630,15 @@ bool checkISRData(pwmEntry_T  *table);
 	bldcPwm::bldcPwm(void)
 	{
 		
-		//Use temporary table in tableA for now...
-			pwmIsrData.pTableStart = pwmIsrData.tableA;
-			pwmIsrData.isActiveTableA = true; 
-			pwmIsrData.pEntry =  pwmIsrData.tableA;
-			pwmIsrData.changeTable =  false;
+		//Use temporary table in frame 0 for now...
+			pwmIsrData.pTableStart = pwmIsrData.frames[0];
+			pwmIsrData.frameActive = 0; 
+			pwmIsrData.frameQueued = 0; 
+			pwmIsrData.pEntry =  pwmIsrData.frames[0];
+			pwmIsrData.cyclesToUpdate = PWM_CYCLES_PER_UPDATE;
 			pwmIsrData.enabled =  true;
-			pwmIsrData.icr1Conflict = false;
 			
-			memcpy((void *)pwmIsrData.tableA,(const void *)pwmInit,sizeof(pwmInit));					
+			memcpy_P((void *)pwmIsrData.frames[0],pwmInit,sizeof(pwmInit));					
 			for (uint8_t n=0;n<3;n++) _pwmChannel[n].dutyCycle = 0;		
 			_updateOutstanding = false;	
 																				
@@ -455,11 +667,10 @@ bool checkISRData(pwmEntry_T  *table);
 		TCNT1 = 0;
 		
 		
-		OCR1A = 100*PWM_TIMER_FREQ_KHZ;	
-			/* Set compare match register to overflow at 100ms, which means 
-			   the PWM will have its first interrupt in 100ms..
-			   Which means PWM starts in 100ms		*/
-		TCCR1B |= _BV(WGM12); // Turn on CTC mode for timer 1				
+		pwmIsrData.cycleStart = PWM_CYCLE_CNT;	
+		OCR1A = pwmIsrData.cycleStart + pwmIsrData.pEntry->offset;	
+			/* The first PWM cycle starts one cycle from now. Timer 1 runs in normal mode
+			   (WGM1x = 0) so it free runs through its whole range and is never reset.	*/
 		TCCR1B |= _BV(CS10); // Set for no prescaler (Timer Freq = 16Mhz)		
 		TIMSK |= _BV(OCIE1A); // Enable timer compare interrupt		
 		TIFR = _BV(OCF1A); // Clear any pending interrupts		
@@ -490,181 +701,171 @@ bool checkISRData(pwmEntry_T  *table);
 		//uint8_t sreg = SREG;
 		//cli();
 		
-		if (pwmIsrData.changeTable) return;
+		uint8_t frame = frameAfter(pwmIsrData.frameQueued);	//The frame we are going to fill
+		if (frame == pwmIsrData.frameActive) return;			//Queue full, tickle() tries again later
+#ifdef PWM_PROFILE
+		uint16_t profileStart;
+		uint16_t profileIsrCount;
+		{
+			uint8_t sreg = SREG;
+			cli();
+			profileStart = TCNT1;
+			profileIsrCount = pwmProfile.isrCount;
+			SREG = sreg;
+		}
+#endif
 		DEBUG_OUT(0x0E);
 		
-
-		static pwmSortList_T sortList[8];
-			/**< A temporary list which information on each ISR command and its absolute
-				* time. Includes addition fields which support list sorting. A list of commands
-				* is made here first, sorted, and then finally exported to the ISR data structure. 
-				* it is made 'static' to prevent it from being put on the stack, which is too small
-				* to hold it.*/
-		pwmSortList_T *pSortEntry;
-		pwmSortList_T *pPreviousEntry;
-		
-		uint8_t linkPosition = 0;
-		
-		
 		volatile pwmEntry_T *pIsrScriptEntry;   
 			/**< Pointer to the an entry in pwm script table which we are creating.
 				* We use this point to navigate the table as we populate it. */		
 
 		uint16_t totalTime = 0; 
-			/**<Running count of what time elapsed is since the start of the PWM cycle, as
-				* of the last pIsrScriptEntry.  We do this to help convert absolute time into
-				* deltaTime while populating the ISR data structure. Using are in counts. */
+			/**<Offset of the last pIsrScriptEntry from the start of the PWM cycle. Used to work 
+				* out the gap to the next entry, which decides its exitMode. Units are counts. */
 		
+		uint16_t time[ePwmChannel_COUNT];	 ///< Channel timer counts, sorted shortest first
+		uint8_t order[ePwmChannel_COUNT];	 ///< Channel (pwmChannels_T) which owns each element of time[]
 						
 		DEBUG_OUT(0x01);
-		for (uint8_t n=0;n<=6;n++)
-		{
-			sortList[n].command = (pwmCommand_T)n;
-			sortList[n].pNextEntry = &sortList[n+1];
-		}
-		
-		//Last entry is a unique case because the next entry pointer is null.
-		sortList[7].pNextEntry = 0; //Mark the end of the linked list.
-		sortList[7].command = ePwmCommand_ALLOFF;
-		
-		DEBUG_OUT(0x02);
 		
 		//---------------------------------------------------------------------------------
 		// CONVERT FROM DUTY CYCLE TO TIMER EXPIRATION
 		//---------------------------------------------------------------------------------				
 		#define MAX_PWM_CHANNEL PWM_CYCLE_CNT - (2*FET_SWITCH_TIME_CNT)
-		for (uint16_t channel = 0; channel <3;channel++)
+		for (uint8_t channel = 0; channel <3;channel++)
 		{
 			uint16_t timerCount = pwmDuration_cnt(_pwmChannel[channel].dutyCycle);					
 			timerCount = (timerCount >=MAX_PWM_CHANNEL? MAX_PWM_CHANNEL-1:timerCount);					
 			_pwmChannel[channel].timerCount = timerCount;
+			time[channel] = timerCount;
+			order[channel] = channel;
 		}
 		
 		DEBUG_OUT(0x03);
-		
-
+				
 		//---------------------------------------------------------------------------------
-		// POPULATE THE ABSOLUTE TIMES FOR START AND ALLOFF
+		// SORT THE CHANNELS
 		//---------------------------------------------------------------------------------
-		sortList[ePwmCommand_START].absoluteCount = 0;
-		sortList[ePwmCommand_ALLOFF].absoluteCount = PWM_CYCLE_CNT - FET_SWITCH_TIME_CNT;
+		/* Only the three channel times vary. START is always first, ALLOFF is always last and
+		 * every LOWx sits FET_SWITCH_TIME_CNT after its OFFx, so once the three timer counts 
+		 * are in order, so are the OFFx edges and so are the LOWx edges. A three element 
+		 * sorting network does that in exactly 3 compare-exchanges.							*/
+		#define PWM_COMPARE_EXCHANGE(x,y)										\
+			if (time[y] < time[x])												\
+			{																	\
+				uint16_t t = time[x]; time[x] = time[y]; time[y] = t;			\
+				uint8_t o = order[x]; order[x] = order[y]; order[y] = o;		\
+			}
+		PWM_COMPARE_EXCHANGE(0,1);
+		PWM_COMPARE_EXCHANGE(1,2);
+		PWM_COMPARE_EXCHANGE(0,1);
 		
-		//---------------------------------------------------------------------------------
-		// POPULATE THE ABSOLUTE TIMES FOR EACH CHANNEL'S ePwmCommand_OFFx, ePwmCommand_LOWx
-		//---------------------------------------------------------------------------------	
-		sortList[ePwmCommand_OFFA].absoluteCount = _pwmChannel[ePwmChannel_A].timerCount;
-		sortList[ePwmCommand_LOWA].absoluteCount = _pwmChannel[ePwmChannel_A].timerCount + FET_SWITCH_TIME_CNT;		
-		sortList[ePwmCommand_OFFB].absoluteCount = _pwmChannel[ePwmChannel_B].timerCount;
-		sortList[ePwmCommand_LOWB].absoluteCount = _pwmChannel[ePwmChannel_B].timerCount + FET_SWITCH_TIME_CNT;		
-		sortList[ePwmCommand_OFFC].absoluteCount = _pwmChannel[ePwmChannel_C].timerCount;
-		sortList[ePwmCommand_LOWC].absoluteCount = _pwmChannel[ePwmChannel_C].timerCount + FET_SWITCH_TIME_CNT;		
-				
-				
 		DEBUG_OUT(0x04);
-				
-		//---------------------------------------------------------------------------------
-		// SORT THE LIST
-		//---------------------------------------------------------------------------------
-		/*Note that the first and last items in the list are fixed and don't need to 
-			* be sorted. ePwmCommand_START is always first, and ePwmCommand_ALLOFF is 
-			* always last. The consequence of this is: 1) We never have to change 
-			* the PHeadEntry pointer (I trust that the compiler will optimize this out)
-			* and 2) That we never have to check for insertion after the last entry. */
-
-		bool touchedFlag; ///<true if the list order was changed at all	
-		do {
-			DEBUG_OUT(0x05);
-			linkPosition = 0;
-			pSortEntry = sortList[0].pNextEntry; 
-				/* Skipping first entry, The head is always the first element. See note above. */
-			pPreviousEntry = sortList; //Since current entry is seconds element, previous is first
-				
-			touchedFlag = false; //true if the list order was changed at all
-			do {
-				DEBUG_OUT(0x06);				
-				if (pSortEntry->absoluteCount > pSortEntry->pNextEntry->absoluteCount) {	
-					
-					pwmSortList_T* pTemp =pSortEntry->pNextEntry->pNextEntry;
-					pPreviousEntry->pNextEntry = pSortEntry->pNextEntry; //Previous Entry now points to guy after me
-					pSortEntry->pNextEntry->pNextEntry = pSortEntry;     //guy after me points to me
-					pSortEntry->pNextEntry = pTemp;						 //I point to what guy after me WAS pointing too					
-					touchedFlag = true;	 //We made a change, so this sort needs to run at least once more
-					linkPosition++;  
-				}
-				
-				pPreviousEntry = pSortEntry;				
-				pSortEntry = pSortEntry->pNextEntry;  //increment to next entry				
-				linkPosition++;
-
-				
-			}while (linkPosition < 6 );
-				/* Remember that the last position has a pNextEntry of 0.
-					* If the we are at the second to last list position, no need to 
-					* compare it with the last because by definition, nothing comes 
-					* after the ePwmCommand_ALLOFF which was already placed there. */
-
-		} while (touchedFlag);
-			
-			
-	
-				
+		
 		//---------------------------------------------------------------------------------
-		// LOAD THE LIST INTO THE ISR DATA STRUCTURE
+		// MERGE THE EDGES INTO THE ISR DATA STRUCTURE
 		//---------------------------------------------------------------------------------	
-		pIsrScriptEntry  = (pwmIsrData.isActiveTableA ? pwmIsrData.tableB : pwmIsrData.tableA);	
+		pIsrScriptEntry  = pwmIsrData.frames[frame];	
 		pwmEntry_T *tableHead  = pIsrScriptEntry;
 		
+		uint8_t imageD = FET_PD_START;
+		uint8_t imageB = FET_PB_START;
+			/**< Port images as they stand after the entry being generated. Every edge after START only 
+			 * turns one FET bit on (see fets.h), so we OR them in as we go.						*/
 		
-		//Start is a special case  because we want to make the deltaTime
-		//FET_SWITCH_TIME_CNT rather than the 0 found in the sortList
-		//To make it easy,. just do it manually before we run the loop
-		//where we will then skip it.
+		//START: the cycle starts here. It follows the previous cycle's ALLOFF by FET_SWITCH_TIME_CNT.
+		pIsrScriptEntry->offset = 0;
+		pIsrScriptEntry->portD = imageD;
+		pIsrScriptEntry->portB = imageB;
+		pIsrScriptEntry->endOfCycle = false;
+		pIsrScriptEntry->exitMode = exitModeFor(FET_SWITCH_TIME_CNT);
+#ifdef PWM_PROFILE
 		pIsrScriptEntry->command = ePwmCommand_START;
-		pIsrScriptEntry->deltaTime = FET_SWITCH_TIME_CNT;
-
+#endif
+		pIsrScriptEntry++;
 		
-		//pIsrScriptEntry++;	//Move to second entry
-		
-		pSortEntry = (pwmSortList_T *)sortList; //Reset pointer to first entry
-		
-		for (int n=0;n<8;n++)
+		/* The six channel edges are a merge of two ordered lists: OFFx at time[n] and LOWx at 
+		 * time[n] + FET_SWITCH_TIME_CNT. A LOWx can never overtake its own OFFx, so six fixed 
+		 * merge steps give the final order. On a tie the OFF edge goes first.
+		 *
+		 * Edges which land at the same count as the previous entry are ORed into it rather than 
+		 * given an entry of their own, so the table may end up shorter than 8 entries. An OFFx 
+		 * within PWM_COALESCE_CNT of the previous entry is moved back onto it first. Its LOWx is 
+		 * worked out from the moved time, so every half bridge keeps its full dead time and only
+		 * the channel's on time is shortened, by PWM_COALESCE_CNT at most. A LOWx is never moved. */
+		uint8_t nextOff = 0;
+		uint8_t nextLow = 0;
+		for (uint8_t n=0;n<6;n++)
 		{	
-			if (n!=0){
-				pIsrScriptEntry->command = (pwmCommand_T)pSortEntry->command;
-				pIsrScriptEntry->deltaTime = pSortEntry->absoluteCount - totalTime;
-				totalTime += pIsrScriptEntry->deltaTime;  
+			uint16_t absoluteCount;
+			uint8_t command;
+			uint16_t lowTime = time[nextLow] + FET_SWITCH_TIME_CNT;
+			if (nextOff < 3 && time[nextOff] <= lowTime)
+			{
+				if (time[nextOff] - totalTime <= PWM_COALESCE_CNT) time[nextOff] = totalTime;
+				absoluteCount = time[nextOff];
+				command = ePwmCommand_OFFA + 2*order[nextOff++];
+			}
+			else
+			{
+				absoluteCount = lowTime;
+				command = ePwmCommand_LOWA + 2*order[nextLow++];
 			}
 			
-			if (pIsrScriptEntry->deltaTime <= ISR_LOOP_CNT ) pIsrScriptEntry->exitMode = isrExitMode_Loop;
-			else if (pIsrScriptEntry->deltaTime <= MIN_TIMER_OCR_CNT ) pIsrScriptEntry->exitMode = isrExitMode_Wait;
-			else pIsrScriptEntry->exitMode = isrExitMode_Exit;
-								
-			pIsrScriptEntry++;	
-			pSortEntry = pSortEntry->pNextEntry;					
+			imageD |= pgm_read_byte(&pwmCommandBits[command].portD);
+			imageB |= pgm_read_byte(&pwmCommandBits[command].portB);
+			if (absoluteCount == totalTime)		//Coincides with the previous entry, switch them together
+			{
+				pIsrScriptEntry[-1].portD = imageD;
+				pIsrScriptEntry[-1].portB = imageB;
+				continue;
+			}
+			pIsrScriptEntry->offset = absoluteCount;
+			pIsrScriptEntry->portD = imageD;
+			pIsrScriptEntry->portB = imageB;
+			pIsrScriptEntry->endOfCycle = false;
+			pIsrScriptEntry->exitMode = exitModeFor(absoluteCount - totalTime);
+#ifdef PWM_PROFILE
+			pIsrScriptEntry->command = command;
+#endif
+			totalTime = absoluteCount;
+			pIsrScriptEntry++;
 		}
 		
+		//ALLOFF
+		pIsrScriptEntry->offset = PWM_CYCLE_CNT - FET_SWITCH_TIME_CNT;
+		pIsrScriptEntry->portD = FET_PD_ALLOFF;
+		pIsrScriptEntry->portB = FET_PB_ALLOFF;
+		pIsrScriptEntry->endOfCycle = true;
+		pIsrScriptEntry->exitMode = exitModeFor((PWM_CYCLE_CNT - FET_SWITCH_TIME_CNT) - totalTime);
+#ifdef PWM_PROFILE
+		pIsrScriptEntry->command = ePwmCommand_ALLOFF;
+#endif
 		
-		
-		
-	
-		
+		DEBUG_OUT(0x05);
+			
 		//---------------------------------------------------------------------------------
-		// TELL THE ISR TO SWITCH TO THE TABLE WE JUST CREATED
+		// QUEUE THE FRAME WE JUST CREATED
 		//---------------------------------------------------------------------------------
-		uint8_t sreg = SREG; //Save interrupt state
-		cli(); //Turn off interrupts while we write to active part of ISR's data
-		{
-			pwmIsrData.changeTable = true;
-			pwmIsrData.isActiveTableA = !pwmIsrData.isActiveTableA;
-		}
-		SREG = sreg; //Restore Interrupt State		
 		_updateOutstanding = false;	
-		if  (!checkISRData(tableHead))
-		{
+		if  (checkISRData(tableHead))
+			pwmIsrData.frameQueued = frame;	//Single byte store, so the ISR sees the whole frame or none of it
+		else
+		{	//Never publish a frame which would short a half bridge, the ISR repeats the last good one
 			DEBUG_OUT(0x0D);
-			asm("NOP");
-				if  (!checkISRData(tableHead)) asm("NOP");  //For debug so we can step and see why it failed.
+#ifdef PWM_PROFILE
+			pwmProfile.badFrames++;
+#endif
+		}
+#ifdef PWM_PROFILE
+		{
+			uint8_t sreg = SREG; 
+			cli(); 
+			profileUpdateDone(profileStart, profileIsrCount);	//After the check, which is part of every update
+			SREG = sreg; 
 		}
+#endif
 		
 		DEBUG_OUT(0x0E);
 	}		
@@ -681,7 +882,19 @@ bool checkISRData(pwmEntry_T  *table);
 void  bldcPwm::updateISR(void)
 	{		
 		
-		if (pwmIsrData.changeTable) return;
+		uint8_t frame = frameAfter(pwmIsrData.frameQueued);	//The frame we are going to fill
+		if (frame == pwmIsrData.frameActive) return;			//Queue full, tickle() tries again later
+#ifdef PWM_PROFILE
+		uint16_t profileStart;
+		uint16_t profileIsrCount;
+		{
+			uint8_t sreg = SREG;
+			cli();
+			profileStart = TCNT1;
+			profileIsrCount = pwmProfile.isrCount;
+			SREG = sreg;
+		}
+#endif
 		
 		uint8_t n; //Generic Loop Variable 
 		DEBUG_OUT(0x0E);				
@@ -691,8 +904,7 @@ void  bldcPwm::updateISR(void)
 
 		uint16_t totalTime = 0; 
 			/**<Running count of what time elapsed is since the start of the PWM cycle, as
-				* of the last pIsrScriptEntry.  We do this to help convert absolute time into
-				* deltaTime while populating the ISR data structure. Using are in counts. */					
+				* of the last pIsrScriptEntry. This is the offset of the next entry. Units are counts. */					
 		
 		//---------------------------------------------------------------------------------
 		// CONVERT FROM DUTY CYCLE TO TIMER EXPIRATION
@@ -710,51 +922,51 @@ void  bldcPwm::updateISR(void)
 		//---------------------------------------------------------------------------------
 		// LOAD THE ISR DATA STRUCTURE
 		//---------------------------------------------------------------------------------
-		pIsrScriptEntry  = (pwmIsrData.isActiveTableA ? pwmIsrData.tableB : pwmIsrData.tableA);		
+		pIsrScriptEntry  = pwmIsrData.frames[frame];		
 		
 		//Calculate the total number of PWM counts across all channels
-		for(n =0;n<ePwmChannel_COUNT;n++) totalTime += _pwmChannel[n].timerCount;
-		
-		//ePwmSequence_ENGAGEA
-		pIsrScriptEntry->deltaTime = PWM_CYCLE_CNT - totalTime;
+		uint16_t onTime = 0;
+		for(n =0;n<ePwmChannel_COUNT;n++) onTime += _pwmChannel[n].timerCount;
 							
 		//SET EVERYTHING ELSE FOR ALL CHANNELS		
 		for (n=0; n < ePwmSequence_END_OF_ENUM;n++)
 		{
 			/*
 			 ---------------------------------------------------------------------------------
-			  SET THE DELTA TIME 
-			  This is how long to wait BEFORE executing the 
-			  command, so the delay is really the pulse width of the previous 
-			  cycle. 					
-						 ePwmSequence_ENGAGEA    PWM_CYCLE_CNT-totalTime(Already Set, Don't Touch it)
-						 ePwmSequence_ENGAGEB	_pwmChannel[ePwmSequence_ENGAGEA].timerCount;
-						 ePwmSequence_ENGAGEC   _pwmChannel[ePwmSequence_ENGAGEB].timerCount;
-						 ePwmSequence_ALLOFF    _pwmChannel[ePwmSequence_ENGAGEC].timerCount;
+			  SET THE OFFSET 
+			  Each command is executed when the pulse of the previous channel ends, so
+			  its offset is the sum of the pulse widths before it, and the gap before it
+			  is the pulse width of the previous channel. ENGAGEA starts the cycle, after 
+			  whatever is left of PWM_CYCLE_CNT once ALLOFF has executed.
+						 ePwmSequence_ENGAGEA    0					(gap PWM_CYCLE_CNT-onTime)
+						 ePwmSequence_ENGAGEB	_pwmChannel[ePwmSequence_ENGAGEA].timerCount
+						 ePwmSequence_ENGAGEC   + _pwmChannel[ePwmSequence_ENGAGEB].timerCount
+						 ePwmSequence_ALLOFF    + _pwmChannel[ePwmSequence_ENGAGEC].timerCount
 			  --------------------------------------------------------------------------------- */											
-			if (n != 0) pIsrScriptEntry->deltaTime = _pwmChannel[n-1].timerCount;
-				
+			uint16_t gap = (n != 0 ? _pwmChannel[n-1].timerCount : PWM_CYCLE_CNT - onTime);
+			totalTime += (n != 0 ? gap : 0);
+			pIsrScriptEntry->offset = totalTime;
 			
 			//Set the command (its just the same as the index)
 			pIsrScriptEntry->command = (pwmSequence_T)n;
 			
 			//Set the exit mode
-			if (pIsrScriptEntry->deltaTime <= ISR_LOOP_CNT ) pIsrScriptEntry->exitMode = isrExitMode_Loop;
-			else if (pIsrScriptEntry->deltaTime <= MIN_TIMER_OCR_CNT ) pIsrScriptEntry->exitMode = isrExitMode_Wait;
-			else pIsrScriptEntry->exitMode = isrExitMode_Exit;						
+			pIsrScriptEntry->exitMode = exitModeFor(gap);
 			pIsrScriptEntry++;
 		}
 						
 		//---------------------------------------------------------------------------------
-		// TELL THE ISR TO SWITCH TO THE TABLE WE JUST CREATED
+		// QUEUE THE FRAME WE JUST CREATED
 		//---------------------------------------------------------------------------------
-		uint8_t sreg = SREG; //Save interrupt state
-		cli(); //Turn off interrupts while we write to active part of ISR's data
+		pwmIsrData.frameQueued = frame;	//Single byte store, so the ISR sees the whole frame or none of it
+#ifdef PWM_PROFILE
 		{
-			pwmIsrData.changeTable = true;
-			pwmIsrData.isActiveTableA = !pwmIsrData.isActiveTableA;
+			uint8_t sreg = SREG; 
+			cli(); 
+			profileUpdateDone(profileStart, profileIsrCount);
+			SREG = sreg; 
 		}
-		SREG = sreg; //Restore Interrupt State		
+#endif
 		_updateOutstanding = false;			
 		DEBUG_OUT(0x0E);
 	}		
@@ -767,43 +979,56 @@ void  bldcPwm::updateISR(void)
 	/*****************************************************************************
 	*  Function: checkISRData
 	*	Description:															 */
-   /**		Looks at the tableA or tableB structure and checks if the
-	*       array holds valid data.
-	* @param isTableA true if tableA, false if tableB 
+   /**		Looks at a frame in pwmIsrData.frames and checks if the
+	*       array holds valid data. updateISR() only queues frames which pass.
+	* @param table pointer to the first entry of the frame
 	* @return true if data is valid. False if problem 
 	****************************************************************************/	
 	bool checkISRData(pwmEntry_T  *table)	
 	{			
-		bool commandCalled[8];
+		static const uint8_t highSideD[3] = {ApFET_PD, BpFET_PD, CpFET_PD};
+		static const uint8_t highSideB[3] = {ApFET_PB, BpFET_PB, CpFET_PB};
+		static const uint8_t lowSideD[3]  = {AnFET_PD, BnFET_PD, CnFET_PD};
+		static const uint8_t lowSideB[3]  = {AnFET_PB, BnFET_PB, CnFET_PB};
 		pwmEntry_T *p = table;
-		uint32_t totalCounts = 0;
-		
-		for (uint8_t n=0;n<8;n++) commandCalled[n]=false;
+		uint16_t lastOffset = 0;
+		uint16_t highOffAt[3] = {0, 0, 0};	//Offset at which each high side was last turned off
+		bool highWasOn[3] = {true, true, true};
+		bool lowWasOn[3] = {false, false, false};
 		
 		for (uint8_t n=0;n<8;n++)
 		{
-			if (p->command ==  bldcPwm::ePwmCommand_LOWA && commandCalled[bldcPwm::ePwmCommand_OFFA] == false) 
-					return false;
-			if (p->command == bldcPwm::ePwmCommand_LOWB && commandCalled[bldcPwm::ePwmCommand_OFFB] == false) 
+			for (uint8_t channel=0;channel<3;channel++)
+			{
+				bool highOn = ((p->portD & highSideD[channel]) | (p->portB & highSideB[channel])) == 0;
+				bool lowOn  = ((p->portD & lowSideD[channel])  | (p->portB & lowSideB[channel]))  != 0;
+				if (highOn && lowOn) return false;	//Never both FETs of a half bridge on together
+				if (highWasOn[channel] && !highOn) highOffAt[channel] = p->offset;
+				if (!lowWasOn[channel] && lowOn && p->offset - highOffAt[channel] < FET_SWITCH_TIME_CNT) 
+					return false;	//Low side turned on before the high side's dead time ran out
+				highWasOn[channel] = highOn;
+				lowWasOn[channel] = lowOn;
+			}
+			if ((p->portD & ~FET_PD_MASK) || (p->portB & ~FET_PB_MASK)) 
 				return false;
-			if (p->command == bldcPwm::ePwmCommand_LOWC && commandCalled[bldcPwm::ePwmCommand_OFFC] == false) 
+			if (n > 0 && p->offset <= lastOffset)		//Entries must be in time order, coincident ones merged
 				return false;
-			totalCounts += p->deltaTime;
-			
-			commandCalled[p->command ] = true;
+			lastOffset = p->offset;
+			if (p->endOfCycle) 
+			{
+				if (table[0].offset != 0) 
+					return false;
+				if (lastOffset >= PWM_CYCLE_CNT)
+					return false;
+				if ((table[0].portD & ~FET_PD_HIGHSIDE) != FET_PD_START || (table[0].portB & ~FET_PB_HIGHSIDE) != FET_PB_START)
+					return false;	//START, possibly with zero duty channels already turned off
+				if (p->portD != FET_PD_ALLOFF || p->portB != FET_PB_ALLOFF) 
+					return false;
+				return true;
+			}
 			p++;
 		}
-		
-		
-		if (totalCounts > PWM_CYCLE_CNT) 
-				return false;
-		if (totalCounts < (PWM_CYCLE_CNT*2)/3)
-				return false;
-		if (table[0].command != bldcPwm::ePwmCommand_START)
-			 return false;
-		if (table[7].command != bldcPwm::ePwmCommand_ALLOFF) 
-			return false;
-		return true;
+		return false;	//No end of cycle within 8 entries
 	}
 	
 #endif		
@@ -820,7 +1045,7 @@ void  bldcPwm::updateISR(void)
 		bool retVal;	
 		uint8_t sregVal = SREG;			
 		cli();
-		retVal = pwmIsrData.changeTable;
+		retVal = (frameAfter(pwmIsrData.frameQueued) == pwmIsrData.frameActive);
 		SREG = sregVal;
 		return retVal;
 				
@@ -840,15 +1065,84 @@ void  bldcPwm::updateISR(void)
 	}
 	
 	
+#ifdef PWM_PROGRAM
 	/****************************************************************************
 	*  Class: bldcPwm
-	*  Method: icr1Conflict
+	*  Method: set_program
 	*	Description:
 	*		See class header file for a full API description of this method
 	****************************************************************************/	
-    bool bldcPwm::icr1Conflict(void) 
-	{ 
-		bool retVal = pwmIsrData.icr1Conflict;
-		pwmIsrData.icr1Conflict = false;		
-		return retVal;
-	}
\ No newline at end of file
+	void bldcPwm::set_program(void (*step)(void))
+	{
+		uint8_t sreg = SREG;
+		cli();
+		pwmProgram = step;
+		if (step)
+		{
+			OCR1B = TCNT1 + PWM_UPDATE_CNT;
+			TIFR = _BV(OCF1B);
+			TIMSK |= _BV(OCIE1B);
+		}
+		else TIMSK &= ~_BV(OCIE1B);
+		SREG = sreg;
+	}
+#endif
+	
+	
+#ifdef PWM_PROFILE
+	/****************************************************************************
+	*  Class: bldcPwm
+	*  Method: profileSnapshot
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/	
+	void bldcPwm::profileSnapshot(pwmProfile_T *copy)
+	{
+		uint8_t sreg = SREG;
+		cli();
+		memcpy((void *)copy,(const void *)&pwmProfile,sizeof(pwmProfile));
+		SREG = sreg;
+	}
+	
+	
+	/****************************************************************************
+	*  Class: bldcPwm
+	*  Method: profileSummary
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/	
+	void bldcPwm::profileSummary(pwmProfileSummary_T *summary)
+	{
+		uint8_t sreg = SREG;
+		cli();
+		summary->isrCount = pwmProfile.isrCount;
+		summary->lateEdges = pwmProfile.lateEdges;
+		SREG = sreg;
+		summary->latenessMax = 0;
+		summary->durationMax = 0;
+		for (uint8_t command = 0; command < COMMAND_COUNT; command++)	//One value at a time, so the ISR is only held off for a copy
+		{
+			cli();
+				uint16_t lateness = pwmProfile.latenessMax[command];
+				uint16_t duration = pwmProfile.durationMax[command];
+			SREG = sreg;
+			if (lateness > summary->latenessMax) summary->latenessMax = lateness;
+			if (duration > summary->durationMax) summary->durationMax = duration;
+		}
+	}
+	
+	
+	/****************************************************************************
+	*  Class: bldcPwm
+	*  Method: profileReset
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/	
+	void bldcPwm::profileReset(void)
+	{
+		uint8_t sreg = SREG;
+		cli();
+		memset((void *)&pwmProfile,0,sizeof(pwmProfile));
+		SREG = sreg;
+	}
+#endif
@@ -29,10 +29,11 @@
 			 *   at the falling edge of the previous channel.  This approach assumes that the 
 			 *   sum of the dutyCycles of all three channels always total to the same amount.		
 			 *   COMMENT OUT THIS DEFINE IF YOU DONT WANT SEQUENTIAL PWM									*/
-	#define kDutyCycleFullScale  1000U
+	#define kDutyCycleFullScale  16000U
 			/**< Upper scale for duty cycle specification. For the set PWM method, this number is the 100% 
 			 * duty cycle equivelent. The set_pwm method will accept duty cycles between 0 and this number,
-			 * where kDutyCycleFullScale is 100% duty cycle.												*/
+			 * where kDutyCycleFullScale is 100% duty cycle. 16000 is one timer count of a 1kHz cycle, so
+			 * the duty scale never limits resolution, the timer does.									*/
 			
 	#define  kFetSwitchTime_uS 2
 			/**< Fet Turn on Time in micro-seconds. FETS do not switch on or off instantly. There will be a
@@ -54,17 +55,80 @@
 			 * to wait for the next event, rather than risk leaving the ISR.								*/
 			
 	#define ISR_LOOP_US 12
-			/**< When deltaTime is below this value, the ISR will loop too handle the next edge without 
-			 * exiting the ISR, and without waiting for the timer to expire.								*/
+			/**< When the gap to the next edge is below this value, the ISR will loop to handle the next edge
+			 * without exiting the ISR, spinning on the timer until the edge is due.							*/
 			
+	#define PWM_COALESCE_US 2
+			/**< Channel turn off edges closer than this to the previous edge in the table are moved back onto 
+			 * it, so the ISR switches them in one port write instead of spinning between them. Costs up to 
+			 * this much on time on the moved channel. Dead time is kept per half bridge regardless, 
+			 * since each low side edge follows its own channel's turn off. 0 only merges exact ties.		*/
+			
+	//#define PWM_PROFILE
+			/**< When DEFINED, the pwm ISR timestamps itself with TCNT1 and keeps histograms of how long it
+			 *   runs and how late each edge lands compared to its scheduled time, separately for each command.
+			 *   Read them with profileSnapshot(). This costs RAM (see pwmProfile_T) and a few cycles per 
+			 *   edge, so leave it commented out unless you are measuring the ISR.						*/
+			 
+	#define PWM_PROFILE_BUCKETS 6
+			/**< Number of histogram buckets kept per command when PWM_PROFILE is defined. The last bucket
+			 *   collects everything that does not fit in the others.									*/
+			 
+	#define PWM_PROFILE_LATE_SHIFT 3
+			/**< Lateness histogram bucket width is 2^PWM_PROFILE_LATE_SHIFT timer counts (8 = 0.5us).	*/
+			
+	#define PWM_PROFILE_DURATION_SHIFT 5
+			/**< Duration histogram bucket width is 2^PWM_PROFILE_DURATION_SHIFT timer counts (32 = 2us).*/
+
 	#define PWM_FREQ_KHZ 1
-			/**< Pwm Frequency in Tenths of A KiloHertz.
-			 *  When we are running the PWM ISR, we will be processing timer interrupts. We will also be 
-			 * setting the next timer expiration from within the ISR. If the next timer interrupt is 
-			 * set too close to the current time, we could have issues where we might might miss the next
-			 * interrupt while we are busy setting it up. To prevent this, we set a rule which says that 
-			 * if we are within MIN_TIMER_OCR_US from the next timer expire, we will remain in the ISR
-			 * to wait for the next event, rather than risk leaving the ISR.								*/
+			/**< Pwm Frequency in KiloHertz. Supported values are 1, 2, 4, 8, 16 and 20. 8 and above run in
+			 * high frequency mode (see kMinTimerDeltaHF_uS), which is what gets the switching noise out of 
+			 * the audible range. 
+			 *
+			 * Duty resolution depends on how many timer counts there are in one cycle. The last FET_SWITCH
+			 * times of every cycle belong to the ALLOFF/START dead time, so that much duty is lost at the
+			 * top end too:
+			 *
+			 *		PWM_FREQ_KHZ | PWM_CYCLE_CNT | duty steps per count | max duty
+			 *		-------------|---------------|----------------------|---------
+			 *		      1      |     16000     |          1           |  99.6%
+			 *		      2      |      8000     |          2           |  99.2%
+			 *		      4      |      4000     |          4           |  98.4%
+			 *		      8      |      2000     |          8           |  96.8%
+			 *		     16      |      1000     |         16           |  93.5%
+			 *		     20      |       800     |         20           |  91.9%
+			 *
+			 * (duty steps of kDutyCycleFullScale = 16000). Above 1kHz neighbouring duty values share a 
+			 * timer count. On top of this, edges within PWM_COALESCE_US of each other are merged, which can 
+			 * shorten a pulse by up to PWM_COALESCE_CNT counts (3.2% of a 16kHz cycle).					*/
+			
+	#define PWM_UPDATE_KHZ 1
+			/**< Rate, in KiloHertz, at which the ISR takes on a new table (and so the rate at which 
+			 * bldcGimbal steps the rotor). Must divide PWM_FREQ_KHZ. Recalculating the table every cycle 
+			 * does not fit in the CPU budget at high frequencies, so the ISR replays the same table for 
+			 * PWM_FREQ_KHZ/PWM_UPDATE_KHZ cycles.															*/
+			
+	#define PWM_FRAME_COUNT 4
+			/**< Number of PWM tables (frames) in the queue between updateISR() and the ISR. One is always 
+			 * being played, so up to PWM_FRAME_COUNT-1 updates can be queued ahead of it, and the ISR 
+			 * takes on one per update period. Must be a power of 2. Each frame costs 8 table entries of RAM,
+			 * 48 bytes on the Atmega8. The queue is kept full, so it rides out a main loop stall of 
+			 * PWM_FRAME_COUNT-1 update periods, but a new speed or power also only reaches the motor 
+			 * that many update periods later: 3 mS at 1kHz with 4 frames, 7 mS with 8.					*/
+			
+	//#define PWM_PROGRAM
+			/**< When DEFINED, frames are produced by the function registered with set_program(), which the 
+			 * timer1 compare B interrupt calls once per update period, instead of by update() calls from
+			 * the main loop. The waveform then keeps playing however long the main loop is held up, and the
+			 * main loop only has to change the program's parameters. Uses OCR1B.							*/
+			
+	#define  kMinTimerDeltaHF_uS  8
+			/**< kMinTimerDelta_uS used in high frequency mode (PWM_FREQ_KHZ 8 and above). A 20us gap 
+			 * would mean most of a 16kHz cycle is spent spinning inside the ISR. The ISR takes well under
+			 * 8us to exit and reenter, and an edge which is missed anyway is caught by the late check.	*/
+			
+	#define ISR_LOOP_HF_US 4
+			/**< ISR_LOOP_US used in high frequency mode.													*/
 			
 			
 	#define PWM_TIMER_FREQ_KHZ  16000U
@@ -86,22 +150,41 @@
 */	
 
 
-		
-		#if (PWM_FREQ_KHZ <= 2)
-			//#define FAST_PWM_DURATION_CALC
-			/* Tells pwmDuration_cnt() method to perform math calc in preprocessor. This is much faster
-			   but only value if PWM_CYCLE_CNT can be cleanly divided by kDutyCycleFullScale.			*/
-		#endif
 
 		#define  FET_SWITCH_TIME_CNT ((uint16_t)(kFetSwitchTime_uS*(PWM_TIMER_FREQ_KHZ/1000)) )
 			 /**< kFetSwitchTime_uS converted to timer counts */
-		#define  MIN_TIMER_OCR_CNT   ((uint16_t)(kMinTimerDelta_uS*(PWM_TIMER_FREQ_KHZ/1000)) )
-			 /**< kMinTimerDelta_uS converted to timer counts  */
-	 
-	 
-		#define ISR_LOOP_CNT  ((uint16_t)(ISR_LOOP_US*(PWM_TIMER_FREQ_KHZ/1000)) )
+		#if PWM_FREQ_KHZ >= 8
+			#define PWM_HF_MODE
+			/**< High frequency mode, see PWM_FREQ_KHZ. */
+			#define  MIN_TIMER_OCR_CNT   ((uint16_t)(kMinTimerDeltaHF_uS*(PWM_TIMER_FREQ_KHZ/1000)) )
+			#define ISR_LOOP_CNT  ((uint16_t)(ISR_LOOP_HF_US*(PWM_TIMER_FREQ_KHZ/1000)) )
+		#else
+			#define  MIN_TIMER_OCR_CNT   ((uint16_t)(kMinTimerDelta_uS*(PWM_TIMER_FREQ_KHZ/1000)) )
+				/**< kMinTimerDelta_uS converted to timer counts  */
+			#define ISR_LOOP_CNT  ((uint16_t)(ISR_LOOP_US*(PWM_TIMER_FREQ_KHZ/1000)) )
+		#endif
+		
+		#if PWM_FREQ_KHZ > 20 || PWM_TIMER_FREQ_KHZ % PWM_FREQ_KHZ != 0
+			#error "PWM_FREQ_KHZ must be 1, 2, 4, 8, 16 or 20"
+		#endif
+		#if PWM_FREQ_KHZ % PWM_UPDATE_KHZ != 0
+			#error "PWM_UPDATE_KHZ must divide PWM_FREQ_KHZ"
+		#endif
+		
+		#if PWM_FRAME_COUNT < 2 || (PWM_FRAME_COUNT & (PWM_FRAME_COUNT - 1)) != 0
+			#error "PWM_FRAME_COUNT must be a power of 2, and at least 2"
+		#endif
+		
+		#define PWM_CYCLES_PER_UPDATE (PWM_FREQ_KHZ / PWM_UPDATE_KHZ)
+			/**< Number of times the ISR replays a table before it takes on a new one. */
+		
+		#define PWM_UPDATE_CNT ((uint16_t)(PWM_TIMER_FREQ_KHZ / PWM_UPDATE_KHZ))
+			/**< Timer counts in one update period. */
+		
+		#define PWM_COALESCE_CNT  ((uint16_t)(PWM_COALESCE_US*(PWM_TIMER_FREQ_KHZ/1000)) )
+			 /**< PWM_COALESCE_US converted to timer counts  */
 
-		#define  PWM_CYCLE_CNT	    PWM_TIMER_FREQ_KHZ / PWM_FREQ_KHZ
+		#define  PWM_CYCLE_CNT	    (PWM_TIMER_FREQ_KHZ / PWM_FREQ_KHZ)
 			 /**<Number of timer counts in one PWM cycle */
 
 		#define MAX_LOWX_CNT		( (uint16_t)(PWM_CYCLE_CNT - FET_SWITCH_TIME_CNT -1))
@@ -115,8 +198,10 @@
 		
 		#ifndef PWM_SEQUENTIAL
 			#define COMMAND_T pwmCommand_T
+			#define COMMAND_COUNT ePwmCommand_END_OF_ENUM
 		#else
 			#define COMMAND_T pwmSequence_T
+			#define COMMAND_COUNT ePwmSequence_END_OF_ENUM
 		#endif
 		
 		
@@ -163,10 +248,11 @@ class bldcPwm
 
 		/************************************************************************************************/
 		/* ENUM: pwmCommand_E																			*/
-		/** Specifies commands which the pwmISR can execute.
+		/** Specifies the edges which make up a pwm cycle.
 		 *	In the pwm timer interrupt routine, we define timer expirations, and things to do when 
-		 *  that timer expires. This enumerated type is used to command what happens when that
-		 *  timer expires.			
+		 *  that timer expires. This enumerated type is used by updateISR() to schedule what happens 
+		 *  when that timer expires. Once sorted, each command is turned into the complete PORTD and 
+		 *  PORTB image for that edge (see fets.h), so the ISR itself never sees these values.			
 		 *  RULE #1 IS: Nobody talks about fight club... just kidding. 
 		 *  RULE #1 IS: The ePwmCommand_OFFx commands must be immediately after their ePwmCommand_OFFx
 		 *			    counterpart for the same channel.	See update method.							*/
@@ -228,6 +314,50 @@ class bldcPwm
 					/**< This is not a state, this member is used to determine the ENUM size for data validation */									
 			}pwmSequence_T;	
 #endif	
+
+#ifdef PWM_PROFILE
+		/************************************************************************************************/
+		/* STRUCT: pwmProfile_S																			*/
+		/** Timing statistics gathered by the pwm ISR when PWM_PROFILE is defined. All times are in 
+		 *  timer1 counts. The per command arrays are indexed by COMMAND_T. Histogram buckets stop 
+		 *  counting at 0xFFFF rather than wrapping.														*/
+		/************************************************************************************************/
+			typedef struct pwmProfile_S
+			{
+				uint16_t lateness[COMMAND_COUNT][PWM_PROFILE_BUCKETS];
+					/**< How long after its scheduled time each edge was written to the port. Bucket width
+					 * is 2^PWM_PROFILE_LATE_SHIFT counts.													*/
+				uint16_t duration[COMMAND_COUNT][PWM_PROFILE_BUCKETS];
+					/**< Time from ISR entry to ISR exit, indexed by the command the ISR was entered to 
+					 * execute. Bucket width is 2^PWM_PROFILE_DURATION_SHIFT counts.						*/
+				uint16_t latenessMax[COMMAND_COUNT];	///< Worst lateness seen for each command.
+				uint16_t durationMax[COMMAND_COUNT];	///< Longest ISR seen for each command.
+				uint16_t lateEdges;
+					/**< Number of times TCNT1 had already passed OCR1A when the ISR set it. The ISR then
+					 * handles that edge straight away instead of waiting for the compare.					*/
+				uint16_t earlyEdges;
+					/**< Number of edges written before they were due. Should always be 0.					*/
+				uint16_t isrCount;		///< Number of times the ISR has run. Wraps.
+				uint16_t updateLast;	
+					/**< Duration of the most recent updateISR() call which was not interrupted by the pwm 
+					 * ISR. Interrupted calls are not recorded since they include the ISR's time.			*/
+				uint16_t updateMax;		///< Longest updateISR() seen. See updateLast.
+				uint16_t badFrames;		
+					/**< Frames updateISR() dropped because checkISRData() failed them. Should always be 0.	*/
+			}pwmProfile_T;
+			
+		/************************************************************************************************/
+		/* STRUCT: pwmProfileSummary_S																	*/
+		/** The headline numbers of pwmProfile_T, small enough to report often. See profileSummary().	*/
+		/************************************************************************************************/
+			typedef struct pwmProfileSummary_S
+			{
+				uint16_t isrCount;		///< Number of times the ISR has run. Wraps.
+				uint16_t lateEdges;		///< See pwmProfile_T::lateEdges.
+				uint16_t latenessMax;	///< Worst lateness seen for any command.
+				uint16_t durationMax;	///< Longest ISR seen for any command.
+			}pwmProfileSummary_T;
+#endif
 			
 			
 			
@@ -266,14 +396,15 @@ class bldcPwm
 			inline void tickle(void) { if (_updateOutstanding) updateISR();}
 			/**< This function needs to be called on a regular basis to enable the this class to do
 			 * housekeeping. Primarily, this is used to update the ISR if an update was made before
-			 * but the ISR was busy and could not accept a new value.									 */
+			 * but the frame queue was full and could not accept a new value.							 */
 			 /*------------------------------------------------------------------------------------------*/
 			 
 		
 			inline void update(void) {_updateOutstanding = true; updateISR();}
-			/**< Updates the ISR to use the latest PWM duty cycle setpoints. This must be called after
-			 * you have changed the pwm setpoints. You may change all 3 setpoints, and then call this 
-			 * method once. The PWM output will not change until this method is called.					*/
+			/**< Queues the latest PWM duty cycle setpoints as a new frame for the ISR. This must be called
+			 * after you have changed the pwm setpoints. You may change all 3 setpoints, and then call this 
+			 * method once. The PWM output will not change until this method is called, and then changes
+			 * once every frame queued before it has played for one update period (PWM_UPDATE_KHZ).		*/
 			/*------------------------------------------------------------------------------------------*/				
 			
 			inline void set_pwm(pwmChannels_T channel, int16_t value)
@@ -289,17 +420,9 @@ class bldcPwm
 					_pwmChannel[channel].dutyCycle = value;									
 			 }
 			 
-			 bool icr1Conflict(void);
-			/**< Returns true if a timer 1 input compare event occured while the 
-			 * pwm ISR was running. As out interrupt will delay the input compare irq,
-			 * this allows other code modules to check if the result will be suspect. Normally
-			 * delays on handling the input compare events dont matter because they are time
-			 * stamped by timer one, but, in this module we are not allowing timer1 to free
-			 * run, so the stamped data is useless.														 */
-			 /*------------------------------------------------------------------------------------------*/
-			 									
 			 bool busy(void);
-			/**< Indicates if the ISR has not loaded the previous value
+			/**< Indicates if the frame queue is full, i.e. the ISR has PWM_FRAME_COUNT-1 frames still
+			 * to play after the current one.
 			 * @return true if the ISR can not accept a new PWM value.									 */
 			 /*------------------------------------------------------------------------------------------*/
 			
@@ -308,6 +431,35 @@ class bldcPwm
 			 * @param isEnabled
 			 *		Set to true  to turn on the isr, false to turn if off								*/
 			/*------------------------------------------------------------------------------------------*/
+
+#ifdef PWM_PROGRAM
+			 void set_program(void (*step)(void));
+			/**< Starts calling step() from the timer1 compare B interrupt once every update period. step()
+			 * runs with interrupts enabled, the pwm ISR holds it off while it runs, and it should queue
+			 * frames with set_pwm() and update() until busy(). While a program is set nothing else may 
+			 * call update() or tickle(). Only available when PWM_PROGRAM is defined.
+			 * @param step
+			 *		Function which queues the next frames, or 0 to stop the program.					*/
+			/*------------------------------------------------------------------------------------------*/
+#endif
+
+#ifdef PWM_PROFILE
+			 static void profileSnapshot(pwmProfile_T *copy);
+			/**< Copies the ISR timing statistics with interrupts held off, so the copy is consistent
+			 * and can be dumped at leisure. Only available when PWM_PROFILE is defined.
+			 * @param copy
+			 *		Where to put the statistics. See pwmProfile_T.										*/
+			/*------------------------------------------------------------------------------------------*/
+			 
+			 static void profileSummary(pwmProfileSummary_T *summary);
+			/**< Like profileSnapshot(), but only copies the few counters in pwmProfileSummary_T, so it
+			 * holds interrupts off for less time and needs no room for the histograms.				*/
+			/*------------------------------------------------------------------------------------------*/
+			 
+			 static void profileReset(void);
+			/**< Clears all ISR timing statistics.														*/
+			/*------------------------------------------------------------------------------------------*/
+#endif
 			 
 			
 		
@@ -333,30 +485,9 @@ class bldcPwm
 				uint16_t timerCount;
 					/**< The number of timer counts that the channel is turned on during the pwm cycle.
 					 * we precalculate it and put it here to simplfy the update routine. */
-				bool used; 
-					/**< This is used during sorting to indicate whether this entry was already already
-						* used on a previous sort so that we dont reuse the entry on the next sort.			*/			
 			}pwmChannelEntry_T;								 
 			
-#ifndef PWM_SEQUENTIAL			
-			/************************************************************************************************/
-			/* STRUCT: pwmSortList_S  																	*/
-			/**<	Holds an entry for the preliminary list of pwm timer events. Includes 
-			 * additional members to assist with the sorting processes.										*/
-			/************************************************************************************************/
-			typedef struct pwmSortList_S
-			{
-				pwmCommand_T command;  
-					/**< What behavior to execute when the timer expires. See definition of pwmCommmand_T	*/
-				uint16_t absoluteCount; 
-					/**< The time from the start of the PWM cycle that the event is supposed to take place
-						* measured in timer counts. This is different from the deltaTime used in pwmEntry_S
-						* in that it is absolute time, rather than a delta from the previous event.			*/
-				struct pwmSortList_S *pNextEntry;
-					/**< This is used for sorting of the list, it is the array index of the entry which 
-						* is next in the sort order. 0 Indicates its the last entry in list.				*/												
-			}pwmSortList_T;
-#endif					
+					
 					
 					
 
@@ -404,19 +535,27 @@ class bldcPwm
 						
 			/* IF WE ABIDE BY THE FOLLOWING GUIDELINE, THIS CALCULATION BECOMES MUCH FASTER
 			
-				1) Set kDutyCycleFullScale to 1000
+				1) Set kDutyCycleFullScale to 16000 (or 1000)
 				2) Have a timer clock speed which is a multiple of 16000
 				3) Limit PWM Frequencies to 1,2,4,8 and 16 Khz
 				
-				If this is done, we can predivide PWM_CYCLE_CNT/kDutyCycleFullScale. This gets
-				us <5us vs >100 us for the calculation. */
+				If this is done, one of PWM_CYCLE_CNT and kDutyCycleFullScale divides the other by a 
+				power of 2, so the conversion is a shift. This gets us <5us vs >100 us for the calculation. 
+				
+				Otherwise (20Khz) we multiply by PWM_CYCLE_CNT/kDutyCycleFullScale as a 16.16 fixed
+				point fraction, rounded up so full scale still gives the whole cycle. That costs a 
+				32 bit multiply rather than a 32 bit division. */
 					
 			
 			#if PWM_CYCLE_CNT % kDutyCycleFullScale == 0
+				static_assert((uint32_t)kDutyCycleFullScale * (PWM_CYCLE_CNT/kDutyCycleFullScale) <= 0xFFFF, "Full scale duty overflows 16 bits");
 				return	value*(PWM_CYCLE_CNT/kDutyCycleFullScale) ; 
+			#elif kDutyCycleFullScale % PWM_CYCLE_CNT == 0 && ((kDutyCycleFullScale/PWM_CYCLE_CNT) & (kDutyCycleFullScale/PWM_CYCLE_CNT - 1)) == 0
+				return	value/(kDutyCycleFullScale/PWM_CYCLE_CNT) ;
 			#else
-			    return ((int32_t)PWM_CYCLE_CNT * (int32_t)value  ) / kDutyCycleFullScale;	 
-				#warning "PWM_CYCLE_CNT/kDutyCycleFullScale does not divide cleanly, using dynamic calculation which takes a LONG time."
+				static_assert((uint64_t)kDutyCycleFullScale * (((uint32_t)PWM_CYCLE_CNT * 65536UL + kDutyCycleFullScale - 1) / kDutyCycleFullScale) <= 0xFFFFFFFFULL, 
+							  "Full scale duty overflows the 32 bit multiply");
+				return ((uint32_t)value * (((uint32_t)PWM_CYCLE_CNT * 65536UL + kDutyCycleFullScale - 1) / kDutyCycleFullScale)) >> 16;
 			#endif								
 		}
 		
@@ -78,6 +78,25 @@ inline void DEBUG_OUT(uint8_t X) {}
 #define	BnFET_port	PORTD
 #define	CpFET_port	PORTD
 
+//;*********************
+//; FET PORT IMAGES    *
+//;*********************
+/* Gate bit of each FET within the PORTD and PORTB images stored in the PWM tables (see fets.h).
+ * A FET which is wired to the other port contributes 0.  P-FETs are on when their bit is low, 
+ * N-FETs are on when their bit is high. */
+#define	ApFET_PD	_BV(ApFET)
+#define	ApFET_PB	0
+#define	AnFET_PD	_BV(AnFET)
+#define	AnFET_PB	0
+#define	BpFET_PD	_BV(BpFET)
+#define	BpFET_PB	0
+#define	BnFET_PD	_BV(BnFET)
+#define	BnFET_PB	0
+#define	CpFET_PD	_BV(CpFET)
+#define	CpFET_PB	0
+#define	CnFET_PD	0
+#define	CnFET_PB	_BV(CnFET)
+
 inline void ApFETOn()  { ApFET_port &= ~_BV(ApFET);}
 inline void ApFETOff() { ApFET_port |=  _BV(ApFET);}
 inline void AnFETOn()  { AnFET_port |=  _BV(AnFET);}
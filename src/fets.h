@@ -7,6 +7,23 @@
 //#include "afro_nfet.h"
 #include "blue_nfet.h"
 
+/* Port images used by the PWM tables. Each table entry holds the FET bits of PORTD and PORTB
+ * exactly as they must look after that edge, so the ISR only has to store them.
+ *    START  - All high side FETs on, all low side FETs off (every FET bit low)
+ *    ALLOFF - All FETs off (P-FET bits high, N-FET bits low)
+ *    OFFx   - OR in the P-FET bit of channel x
+ *    LOWx   - OR in the N-FET bit of channel x												*/
+#define FET_PD_HIGHSIDE	(ApFET_PD | BpFET_PD | CpFET_PD)
+#define FET_PB_HIGHSIDE	(ApFET_PB | BpFET_PB | CpFET_PB)
+#define FET_PD_LOWSIDE	(AnFET_PD | BnFET_PD | CnFET_PD)
+#define FET_PB_LOWSIDE	(AnFET_PB | BnFET_PB | CnFET_PB)
+#define FET_PD_MASK		(FET_PD_HIGHSIDE | FET_PD_LOWSIDE)	///< PORTD bits owned by the PWM ISR
+#define FET_PB_MASK		(FET_PB_HIGHSIDE | FET_PB_LOWSIDE)	///< PORTB bits owned by the PWM ISR
+#define FET_PD_START	0
+#define FET_PB_START	0
+#define FET_PD_ALLOFF	FET_PD_HIGHSIDE
+#define FET_PB_ALLOFF	FET_PB_HIGHSIDE
+
 inline void highSideOff() {
 	ApFETOff();
 	CpFETOff();
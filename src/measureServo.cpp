@@ -22,6 +22,7 @@
 
 #include "measureServo.h"
 #include "millis.h"
+#include "bldcPwm.h"		//PWM_HF_MODE, which rules out DShot
 #include <stdlib.h>
 #include <avr/interrupt.h>
 
@@ -31,8 +32,62 @@
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 */
 
-	#define T1ICP_IRQ_OFF() TIMSK &= ~_BV(TICIE1); //Turn off input compare interrupt while accessing its data
-	#define T1ICP_IRQ_ON() TIMSK |= _BV(TICIE1);
+	#define SERVO_CNT_PER_US 16		//Timer1 counts per micro second, no prescaler at 16MHz
+	
+	#define DECODER_LOCK_FRAMES 4
+		/* Pulses in a row which must match a new protocol before it is taken on, so a glitch on the 
+		 * line cannot switch protocols.																*/
+		 
+	#define DECODER_LOST_FRAMES 16
+		/* DShot frames in a row which may fail to decode (late, bad timing or bad CRC) before we go back
+		 * to looking at pulse widths.																	*/
+
+	/* Pulse widths each protocol is recognised by, in Timer1 counts. Each range is wider than the 
+	 * protocol's own, and they do not overlap.															*/
+	#define PWM_MIN_CNT			(800 * SERVO_CNT_PER_US)
+	#define PWM_MAX_CNT			(2200 * SERVO_CNT_PER_US)
+	#define ONESHOT125_MIN_CNT	(100 * SERVO_CNT_PER_US)
+	#define ONESHOT125_MAX_CNT	(275 * SERVO_CNT_PER_US)
+	#define ONESHOT42_MIN_CNT	(34 * SERVO_CNT_PER_US)
+	#define MULTISHOT_MIN_CNT	(4 * SERVO_CNT_PER_US)
+		/* Anything shorter can only be a DShot bit, which are high for 1.25 to 5 uS.					*/
+		
+	#define PPM_MARK_MAX_CNT	(600 * SERVO_CNT_PER_US)
+		/* Longest PPM channel mark. Receivers use 300 to 500 uS, above the Oneshot125 range.			*/
+		
+	#define PPM_SYNC_CNT		(2700 * SERVO_CNT_PER_US)
+		/* Shortest time from mark to mark which is taken for the sync gap, longer than any channel.	*/
+		
+	#define PPM_SYNC_TICKS		60
+		/* Timer2 counts (64 uS) from mark to mark after which it is a sync gap whatever Timer1 says,
+		 * as Timer1 may have wrapped. 60 counts (3.84 mS), plus the capture ISR's latency, is 
+		 * short of one wrap.																			*/
+		
+	#if PPM_CHANNEL < 1 || PPM_CHANNEL > 16
+		#error "PPM_CHANNEL must be 1 to 16"
+	#endif
+		
+	#define DSHOT_BURST_CNT		(24 * SERVO_CNT_PER_US)
+		/* Pulses which start closer together than this are bits of one DShot frame. Multishot, the 
+		 * fastest of the pulse protocols, repeats every 31 uS or more.									*/
+		
+	#define DSHOT_BURST_TICKS	2
+		/* Most Timer2 counts (64 uS) between the capture interrupts of two pulses of a burst, allowing
+		 * for the PWM ISR holding up either one. Timer1 alone wraps every 4 mS, so a pulse that came 
+		 * a whole number of wraps after the last one would look like part of a burst.				*/
+		
+	#define SIGNAL_TIMEOUT_US	100000UL
+		/* No new value for this long and signalLost() gives the input up, 5 frames of a 50 Hz servo.	*/
+		
+	#define SERVO_MIN_CNT		(1000 * SERVO_CNT_PER_US)	//Servo pulse for the bottom of every protocol's range
+	#define SERVO_CENTER_CNT	(1500 * SERVO_CNT_PER_US)	//Servo pulse for DShot disarmed, SERVO_CENTER_US in bldcGimbal.h
+	
+	#define MULTISHOT_ZERO_CNT	(5 * SERVO_CNT_PER_US)		//Multishot pulse for the bottom of its range
+	#define ONESHOT42_GAIN		6095	//1000 / 42 in 8.8 fixed point
+	
+	#define DSHOT150_BIT_CNT	107		//16MHz / 150k bits/S = 106.7
+	#define DSHOT300_BIT_CNT	53		//16MHz / 300k bits/S = 53.3
+	#define DSHOT_THROTTLE_MIN	48		//Frame values 1 to 47 are commands, not throttle
 	
 
 /*
@@ -47,12 +102,24 @@
 	/*****************************************************************************************************/
 	typedef struct servoIsrData_S
 	{		
-		volatile uint16_t startTimeStamp;  ///<Time stamp of the pulse begining in uS.
-		volatile uint16_t stopTimeStamp;   ///<Time stamp of the pulse end in uS.
-		bool dataReady;	
-			/**< Set True by the ISR when a pulse has been detected and measured. The ISR will suspend 
-			 * any other measurements until this is set false by the application. */
+		uint16_t startTimeStamp;  ///<ICR1 at the last rising edge, Timer1 counts.
+		uint8_t startTick;		  ///<TCNT2 when the last rising edge was taken, 64 uS counts.
+		volatile uint16_t value;
+			/**< The last value decoded, as the width of the servo pulse it stands for, in Timer1 counts. */
+		volatile bool dataReady;	
+			/**< Set True by the ISR when a new value has been decoded, set false when it is read.		*/
 		bool waitRising; //If true, we are waiting for a rising edge, otherwise a falling	
+		bool burst;		 //True if the pulse being measured started within DSHOT_BURST_CNT of the one before
+		uint16_t period; ///<Timer1 counts from the rising edge before to the one of the pulse being measured.
+		uint8_t periodTicks;	///<The same in Timer2 counts, for periods which may be longer than Timer1 wraps.
+		uint8_t channel;
+			/**< The PPM channel whose mark was seen last, 0 for the mark after the sync gap. PPM_CHANNEL 
+			 * until a sync gap has been seen, and once the channel has been read.						*/
+		volatile uint8_t protocol;	///<The measureServo::servoProtocol_T being decoded.
+		uint8_t candidate;			///<The protocol the last pulses looked like, when not the one being decoded.
+		uint8_t count;
+			/**< Pulses in a row which looked like candidate or, while decoding DShot, frames in a row which
+			 * failed to decode.																		*/
 	}servoIsrData_T;
 
 
@@ -65,6 +132,175 @@
 
 	static servoIsrData_T servoIsrData; //Variable used to store data used to interact with the ISR.
 
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& FUNCTIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/*****************************************************************************
+	*  Function: report
+	*	Description:															 */
+   /**		Hands a decoded value over to value_cnt().
+	* @param value The servo pulse width the value stands for, Timer1 counts.
+	****************************************************************************/
+	static inline void report(uint16_t value)
+	{
+		servoIsrData.value = value;
+		servoIsrData.dataReady = true;
+	}
+	
+	/*****************************************************************************
+	*  Function: pulseSeen
+	*	Description:															 */
+   /**		Called for each pulse, with the protocol it looked like. Reports its
+	*		value if that is the protocol being decoded, otherwise counts it 
+	*		towards switching over to that protocol.
+	* @param protocol The measureServo::servoProtocol_T the pulse looked like.
+	* @param value The servo pulse width it stands for, Timer1 counts.
+	****************************************************************************/
+	static void pulseSeen(uint8_t protocol, uint16_t value)
+	{
+		if (protocol == servoIsrData.protocol)
+		{
+			servoIsrData.count = 0;
+			report(value);
+			return;
+		}
+		if (protocol != servoIsrData.candidate)
+		{
+			servoIsrData.candidate = protocol;
+			servoIsrData.count = 0;
+		}
+		if (++servoIsrData.count < DECODER_LOCK_FRAMES) return;
+		servoIsrData.protocol = protocol;
+		servoIsrData.count = 0;
+		if (protocol != measureServo::eServoProtocol_DSHOT150) report(value);	//DShot values come from dshotFrame()
+	}
+	
+	/*****************************************************************************
+	*  Function: ppmMark
+	*	Description:															 */
+   /**		Called for each PPM channel mark. A mark after the sync gap starts 
+	*		channel 1, each mark after that ends a channel, whose value is the 
+	*		period since the mark before. Reports the value of PPM_CHANNEL.
+	****************************************************************************/
+	static void ppmMark(void)
+	{
+		if (servoIsrData.periodTicks >= PPM_SYNC_TICKS || servoIsrData.period >= PPM_SYNC_CNT)
+			servoIsrData.channel = 0;
+		else if (servoIsrData.channel < PPM_CHANNEL && ++servoIsrData.channel == PPM_CHANNEL
+				 && servoIsrData.period >= PWM_MIN_CNT && servoIsrData.period <= PWM_MAX_CNT)
+			pulseSeen(measureServo::eServoProtocol_PPM, servoIsrData.period);
+	}
+	
+	/*****************************************************************************
+	*  Function: pulseWidth
+	*	Description:															 */
+   /**		Sorts a measured pulse into a protocol by its width, and scales it
+	*		to the servo pulse it stands for. Widths which fit no protocol are 
+	*		ignored.
+	* @param width High time of the pulse, Timer1 counts.
+	****************************************************************************/
+	static void pulseWidth(uint16_t width)
+	{
+		if (width < MULTISHOT_MIN_CNT || servoIsrData.burst) 
+		{
+#ifdef PWM_HF_MODE	//dshotFrame() would hold the PWM ISR off for whole cycles, so DShot is refused
+			servoIsrData.candidate = measureServo::eServoProtocol_NONE;	//Nor is a frame's first bit taken for Multishot
+#else
+			pulseSeen(measureServo::eServoProtocol_DSHOT150, 0);
+#endif
+		}
+		else if (width < ONESHOT42_MIN_CNT) 
+			pulseSeen(measureServo::eServoProtocol_MULTISHOT, SERVO_MIN_CNT + (int16_t)(width - MULTISHOT_ZERO_CNT) * 50);
+		else if (width < ONESHOT125_MIN_CNT) 
+			pulseSeen(measureServo::eServoProtocol_ONESHOT42, ((uint32_t)width * ONESHOT42_GAIN) >> 8);
+		else if (width <= ONESHOT125_MAX_CNT) 
+			pulseSeen(measureServo::eServoProtocol_ONESHOT125, width << 3);
+		else if (width <= PPM_MARK_MAX_CNT) 
+			ppmMark();
+		else if (width >= PWM_MIN_CNT && width <= PWM_MAX_CNT) 
+			pulseSeen(measureServo::eServoProtocol_PWM, width);
+	}
+	
+	/*****************************************************************************
+	*  Function: dshotLost
+	*	Description:															 */
+   /**		Counts a DShot frame which failed to decode, and goes back to pulse
+	*		widths after DECODER_LOST_FRAMES of them in a row.
+	****************************************************************************/
+	static void dshotLost(void)
+	{
+		if (++servoIsrData.count < DECODER_LOST_FRAMES) return;
+		servoIsrData.protocol = measureServo::eServoProtocol_NONE;
+		servoIsrData.candidate = measureServo::eServoProtocol_NONE;
+		servoIsrData.count = 0;
+		servoIsrData.waitRising = true;		//ICES1 is already set for it
+	}
+	
+	/*****************************************************************************
+	*  Function: dshotFrame
+	*	Description:															 */
+   /**		Decodes one DShot frame, called from the capture ISR at its first
+	*		rising edge, with interrupts still off. A DShot bit is high for 
+	*		37.5% of the bit for a 0 and 75% for a 1, far too quick to take an
+	*		interrupt per edge, so the rest of the frame is polled: each bit's 
+	*		rising edge is still latched in ICR1, and the line is sampled 9/16 
+	*		of a bit later. If a sample comes after 11/16 of the bit, because 
+	*		the ISR was let in late, the frame is dropped. Holds interrupts off 
+	*		for the frame, 107 uS at DShot150 and 53 uS at DShot300, which the 
+	*		PWM ISR sees as late edges. That is up to 2 cycles at 20kHz, so with
+	*		PWM_HF_MODE DShot is never taken on and this is not used.
+	* @param rise ICR1 at the rising edge of the first bit.
+	****************************************************************************/
+	static void dshotFrame(uint16_t rise)
+	{
+		uint8_t bitCnt = servoIsrData.protocol == measureServo::eServoProtocol_DSHOT150 ? DSHOT150_BIT_CNT : DSHOT300_BIT_CNT;
+		uint8_t sampleCnt = (bitCnt * 9) >> 4;
+		uint8_t lateCnt = (bitCnt * 11) >> 4;
+		uint16_t frame = 0;
+		
+		for (uint8_t bit = 0; bit < 16; bit++)
+		{
+			if (bit)
+			{
+				while (!(TIFR & _BV(ICF1)))		//Wait for the next rising edge
+				{
+					if ((uint16_t)(TCNT1 - rise) > 2 * DSHOT150_BIT_CNT) { dshotLost(); return; }
+				}
+				uint16_t next = ICR1;
+				TIFR = _BV(ICF1);
+				uint16_t period = next - rise;
+				rise = next;
+				if (bit == 1)		//The first bit gives the bit rate
+				{
+					uint8_t speed = period > (DSHOT150_BIT_CNT + DSHOT300_BIT_CNT) / 2 ? 
+									measureServo::eServoProtocol_DSHOT150 : measureServo::eServoProtocol_DSHOT300;
+					if (speed != servoIsrData.protocol)
+					{
+						servoIsrData.protocol = speed;	//Bit 0 was sampled at the wrong time, start again next frame
+						dshotLost();
+						return;
+					}
+				}
+				if ((uint16_t)(period - (bitCnt - bitCnt / 4)) > bitCnt / 2) { dshotLost(); return; }	//Not within 25%
+			}
+			uint16_t elapsed;
+			while ((elapsed = TCNT1 - rise) < sampleCnt);
+			frame <<= 1;
+			if (PINB & _BV(PINB0)) frame |= 1;
+			if (elapsed > lateCnt) { dshotLost(); return; }
+		}
+		
+		uint16_t value = frame >> 4;	//Throttle and telemetry request
+		if (((value ^ (value >> 4) ^ (value >> 8)) & 0x0F) != (frame & 0x0F)) { dshotLost(); return; }
+		servoIsrData.count = 0;
+		uint16_t throttle = frame >> 5;
+		if (throttle == 0) report(SERVO_CENTER_CNT);
+		else if (throttle >= DSHOT_THROTTLE_MIN) report(SERVO_MIN_CNT + ((throttle - DSHOT_THROTTLE_MIN) << 3));
+	}
+
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& INTERRUPT SERVICE ROUTINES
@@ -74,29 +310,51 @@
 	/****************************************************************************	
 	*  ISR: TIMER1_CAPT_vect
 	*	Description:
-	*		Triggered upon a change on the ICP1 pin. This ISR us used to 
-	*		measure the pulse width WITHOUT using the Timer1 Input Capture 
-	*		register.
+	*		Triggered upon a change on the ICP1 pin. The hardware has already 
+	*		latched Timer1 into ICR1 at the edge, so for pulse protocols this 
+	*		ISR only has to collect it and switch edges before the pulse ends, 
+	*		and can then let the PWM ISR in. A pulse that ended before the 
+	*		edge was switched is counted as DShot. While decoding DShot it 
+	*		only takes rising edges, and reads each frame with dshotFrame().
 	****************************************************************************/	
 	ISR(TIMER1_CAPT_vect)
 	{
-		sei();
-		volatile uint16_t timeStamp;
-		timeStamp = micros();
-		if (servoIsrData.dataReady) return; //we already have a reading, so don't collect a new one till this one is read.
+		uint16_t timeStamp = ICR1;	//Before sei(), the PWM ISR shares the TEMP register for 16 bit reads
+		if (servoIsrData.protocol >= measureServo::eServoProtocol_DSHOT150)
+		{
+			dshotFrame(timeStamp);
+			return;
+		}
 		
 		if (servoIsrData.waitRising) {
-			servoIsrData.startTimeStamp = timeStamp;  //If Rising Edge, record the start time
 			TCCR1B &= ~_BV(ICES1);//Set interrupt for falling edge
-			servoIsrData.waitRising = false;
+			TIFR = _BV(ICF1);	  //Changing ICES1 can set the flag, see the datasheet
+			uint8_t tick = TCNT2;
+			servoIsrData.period = timeStamp - servoIsrData.startTimeStamp;
+			servoIsrData.periodTicks = tick - servoIsrData.startTick;
+			servoIsrData.burst = servoIsrData.period < DSHOT_BURST_CNT && servoIsrData.periodTicks <= DSHOT_BURST_TICKS;
+			servoIsrData.startTimeStamp = timeStamp;  //If Rising Edge, record the start time
+			servoIsrData.startTick = tick;
+			if ((PINB & _BV(PINB0)) || (TIFR & _BV(ICF1)))
+			{
+				servoIsrData.waitRising = false;
+				return;
+			}
+			TCCR1B |= _BV(ICES1);	//Already over, too short for anything but a DShot bit
+			TIFR = _BV(ICF1);
 		}
 		else  //Otherwise its a falling edge so ..
 		{
-			servoIsrData.stopTimeStamp = timeStamp;	//Record the stop time..
-			servoIsrData.dataReady = true;			//And signal that we have a value
 			servoIsrData.waitRising = true;
 			TCCR1B |= _BV(ICES1); //Set interrupt for rising edge
+			TIFR = _BV(ICF1);
 		}
+		
+		TIMSK &= ~_BV(TICIE1);	//Let the PWM ISR in, but not this one again
+		sei();
+		pulseWidth(timeStamp - servoIsrData.startTimeStamp);
+		cli();
+		TIMSK |= _BV(TICIE1);
 	}
 
 					
@@ -115,7 +373,8 @@
 	****************************************************************************/
 	measureServo::measureServo(void)
 	{
-		asm("NOP");
+		_signalDue = 0;
+		_signal = false;
 	}
 		
 	/****************************************************************************
@@ -128,6 +387,11 @@
 	{		
 		servoIsrData.dataReady = false;
 		servoIsrData.waitRising = true;
+		servoIsrData.burst = false;
+		servoIsrData.protocol = eServoProtocol_NONE;
+		servoIsrData.candidate = eServoProtocol_NONE;
+		servoIsrData.count = 0;
+		servoIsrData.channel = PPM_CHANNEL;
 		
 		//Configure PCINT0 PIN (PB0) as an input
 		DDRB &= ~_BV(DDB0);
@@ -135,8 +399,9 @@
 		//DISABLE PULLUP RESISTOR (PB0)
 		PORTB &= ~_BV(PORTB0);
 		
-		//Rising Edge Detect
-		TCCR1B |= _BV(ICES1);
+		//Rising Edge Detect, with the noise canceler (delays both edges by 4 clocks, so the width is unchanged)
+		TCCR1B |= _BV(ICES1) | _BV(ICNC1);
+		TIFR = _BV(ICF1);
 		
 		//Enable Input Compare Interrupt
 		TIMSK |= _BV(TICIE1);
@@ -151,26 +416,61 @@
 	****************************************************************************/			
 	bool measureServo::changeDetected(void)
 	{
-		T1ICP_IRQ_OFF(); //Turn off input compare interrupt while accessing its data
-			bool retVal = servoIsrData.dataReady;
-		T1ICP_IRQ_ON(); //Turn it back on		
-		return retVal;
+		if (!servoIsrData.dataReady) return false;	//One byte, no need to stop the ISR
+		_signalDue = deadlineIn(SIGNAL_TIMEOUT_US);
+		_signal = true;
+		return true;
+	}
+	
+	/****************************************************************************
+	*  Class: measureServo
+	*  Method: signalLost
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	bool measureServo::signalLost(void)
+	{
+		if (!_signal || !deadlinePassed(_signalDue)) return false;
+		_signal = false;
+		return true;
 	}
 		
 	/****************************************************************************
 	*  Class: measureServo
-	*  Method: measureServo
+	*  Method: value_uS
 	*	Description:
 	*		See class header file for a full API description of this method
 	****************************************************************************/		
 	uint16_t measureServo::value_uS(void)
 	{
-		volatile uint16_t stopTime, startTime;
-		T1ICP_IRQ_OFF(); //Turn off input compare interrupt while accessing its data
-			stopTime = servoIsrData.stopTimeStamp;
-			startTime = servoIsrData.startTimeStamp;			
+		return (value_cnt() + SERVO_CNT_PER_US / 2) / SERVO_CNT_PER_US;
+	}
+	
+	/****************************************************************************
+	*  Class: measureServo
+	*  Method: value_cnt
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/		
+	uint16_t measureServo::value_cnt(void)
+	{
+		uint16_t value;
+		uint8_t sreg = SREG;
+		cli();	//Rather than clearing TICIE1, a read-modify-write of TIMSK could undo one by the PWM ISR
+			value = servoIsrData.value;
 			servoIsrData.dataReady = false;
-		T1ICP_IRQ_ON(); //Turn it back on								
-		return stopTime - startTime;
+		SREG = sreg;								
+		return value;
+	}
+	
+	/****************************************************************************
+	*  Class: measureServo
+	*  Method: protocol
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/		
+	measureServo::servoProtocol_T measureServo::protocol(void)
+	{
+		return (servoProtocol_T)servoIsrData.protocol;
 	}
 		 
\ No newline at end of file
@@ -13,6 +13,16 @@
 
 
 
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& USER CONFIGURATION
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	#define PPM_CHANNEL 1
+			/**< The channel of a PPM sum signal which drives the motor, 1 for the first channel after
+			 *   the sync gap. The other channels are skipped.											*/
+
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& INCLUDES
@@ -20,6 +30,7 @@
 */
 
 #include <inttypes.h>
+#include "millis.h"
 		
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
@@ -30,10 +41,15 @@
 /********************************************************************************************************/
 /* CLASS: measureServo																					*/
 /** Servo Pulse Width measurement from Timer1 Input Compare Specifically tailored to operation 
- *	with bldcPwm class.  The bldcPwm uses Timer1 already in CPC mode, which resets the timer 
- *  at each input compare. This prevents us from utilizing the time stamp provided by the 
- *  Timer1 input compare hardware, and forces us to use the less accurate method of 
- *  getting the time stamp from our millis class. 
+ *	with bldcPwm class.  The bldcPwm lets Timer1 free run (it only moves OCR1A), so the 
+ *  time stamp latched by the Timer1 input compare hardware (ICR1) is valid. Both edges of the
+ *  pulse are read from ICR1, to 1/16 uS, so however late the PWM ISR lets the capture interrupt 
+ *  run, the measurement is the same.
+ *
+ *  Besides the 1-2 mS servo pulse, the faster ESC throttle protocols a flight controller can send 
+ *  on the same rcp_in pin, and one channel of a receiver's PPM sum signal, are decoded, see 
+ *  servoProtocol_E. The protocol is found from the 
+ *  pulses themselves, and every one of them is reported as the servo pulse it stands for.
  *																										*/
 /********************************************************************************************************/
 class measureServo
@@ -44,6 +60,38 @@ class measureServo
 	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 	*/	public:
 
+		/************************************************************************************************/
+		/*  ENUM: servoProtocol_E																		*/
+		/** The input protocols told apart on rcp_in. Pulse protocols are sorted by the width of 
+		 *  their pulses, a protocol is taken on once DECODER_LOCK_FRAMES pulses in a row have matched
+		 *  it. DShot is spotted by its bursts of short pulses, and dropped again after 
+		 *  DECODER_LOST_FRAMES frames in a row fail to decode. With PWM_HF_MODE (PWM_FREQ_KHZ 8 and 
+		 *  above) DShot is ignored, as reading a frame holds interrupts off for too many PWM cycles.	*/
+		/************************************************************************************************/
+			typedef enum servoProtocol_E
+			{
+				eServoProtocol_NONE = 0,
+					/**< Nothing recognised yet, no values are reported.									*/
+				eServoProtocol_PWM,
+					/**< Standard servo pulse, 1000 to 2000 uS at up to about 400Hz.						*/
+				eServoProtocol_ONESHOT125,
+					/**< 125 to 250 uS pulse, reported times 8.												*/
+				eServoProtocol_ONESHOT42,
+					/**< 42 to 84 uS pulse, reported times 1000/42.											*/
+				eServoProtocol_MULTISHOT,
+					/**< 5 to 25 uS pulse, reported as 1000 uS plus 50 times the width over 5 uS.			*/
+				eServoProtocol_PPM,
+					/**< PPM sum signal from a receiver: a 276 to 600 uS high mark starts each channel, the
+					 *  time from one mark to the next is the channel's 1000 to 2000 uS value, and a gap of
+					 *  2.7 mS or more before a mark makes it channel 1. PPM_CHANNEL is reported as it is.
+					 *  The marks must be high, an inverted (negative going) signal is not recognised.		*/
+				eServoProtocol_DSHOT150,
+					/**< 16 bit DShot frames at 150k bits/S: 11 bit throttle, telemetry request and 4 bit
+					 *  CRC. Throttle 48 to 2047 is reported as 1000 to 1999.5 uS, 0 (disarmed) as 1500 uS,
+					 *  the servo centre, and the commands 1 to 47 are ignored.								*/
+				eServoProtocol_DSHOT300,
+					/**< As eServoProtocol_DSHOT150 at 300k bits/S.											*/
+			}servoProtocol_T;		
 		
 	/*
 	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
@@ -59,22 +107,35 @@ class measureServo
 		
 		void begin(void);
 		/**< Setup method for class. Call this after the class is instantiated, but before using 
-			* the class.																			*/
+			* the class. Call it after bldcPwm::begin(), which sets up Timer1.						*/
 		/*------------------------------------------------------------------------------------------*/
 			
 		bool changeDetected(void);
 		/**< Used to detect if a new servo value has been received. This  must be 
-		 * checked before reading the servo value (using value_uS) as the value 
+		 * checked before reading the servo value (using value_cnt) as the value 
 		 * is not valid unless changeDetected is true.
 		 * @return 
 		 *		True if a new servo value has been received, false if not.							*/
 		/*------------------------------------------------------------------------------------------*/
+		
+		bool signalLost(void);
+		/**< Used to detect that the input has stopped. Each value changeDetected() reports starts a 
+		 * SIGNAL_TIMEOUT_US timeout, this returns true once when it runs out. 
+		 * @return 
+		 *		True the first time it is called after the timeout, false otherwise.				*/
+		/*------------------------------------------------------------------------------------------*/
 	
 		uint16_t value_uS(void);
-		/**< Returns the last measured servo pulse width in micro seconds. You must make sure
+		/**< Returns the last measured servo pulse width in micro seconds, rounded. You must make sure
 		 * that changeDetected is true before calling this method or it will return an invalid 
 		 * value.																					*/
 		/*------------------------------------------------------------------------------------------*/ 
+		
+		uint16_t value_cnt(void);
+		/**< Like value_uS(), but returns the pulse width in Timer1 counts, 1/16 uS (62.5 nS). Pulses
+		 * up to 4095 uS can be measured. For the other protocols it is the width of the servo pulse
+		 * the value stands for, to the protocol's own resolution.									*/
+		/*------------------------------------------------------------------------------------------*/ 
 		 
 		 
 		 
@@ -84,8 +145,8 @@ class measureServo
 			&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 			*/
 			 
-					
-						 /**< Accessor Method. See corresponding private property for more info.				*/
+					servoProtocol_T protocol(void);
+						 /**< Returns the protocol being decoded, see servoProtocol_E.							*/
 					
 			/*
 			&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
@@ -101,7 +162,11 @@ class measureServo
 	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 	*/	private:
 
-
+		time_T _signalDue;
+			/**< When signalLost() gives the input up, unless another value comes first.				*/
+			
+		bool _signal;
+			/**< A value has come since the last time signalLost() returned true.						*/
 
 /*
 	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
@@ -1,16 +1,106 @@
 #include <avr/interrupt.h>
 #include "millis.h"
 
-uint32_t timer32_ms;
-uint16_t timer16_us;
-uint8_t timerCycles;
-
-ISR(TIMER2_COMP_vect)
-{	
-	timer16_us += 100;		
-	if (++timerCycles >= 10){
-		timerCycles = 0;
+volatile uint32_t timer32_ms;
+volatile uint16_t timer16_msFraction;
+volatile uint32_t timer32_overflows;
+
+static uint16_t timer1Offset;
+	/* TCNT1 when TCNT2 was zeroed, lines Timer1 up with Timer2.									*/
+
+ISR(TIMER2_OVF_vect)
+{
+	timer32_overflows++;
+	timer32_ms += TIMER2_OVERFLOW_US / 1000;
+	uint16_t fraction = timer16_msFraction + TIMER2_OVERFLOW_US % 1000;
+	if (fraction >= 1000){
+		fraction -= 1000;
 		timer32_ms++;
-	} 
+	}
+	timer16_msFraction = fraction;
 }
 
+/*****************************************************************************
+*  Function: timerRead
+*	Description:															 */
+/**		Reads both timers. Timer2 and its overflow count give the time to
+*		64 uS, Timer1 gives it to the CPU cycle but wraps every 4 mS. Timer1
+*		agrees with Timer2 to within one Timer2 count, so the difference
+*		between them, as a signed 16 bit number, is the time past Timer2's
+*		estimate. Only Timer2 needs an interrupt, 61 times a second.
+* @param overflows Returns timer32_overflows, adjusted for an overflow
+*		pending while interrupts are off.
+* @param ms Returns timer32_ms at that overflow, and fraction its uS.
+* @return uS since the overflow. Can be up to one Timer2 count below 0 
+*		just after it, depending on the phase of Timer2's prescaler.
+****************************************************************************/
+static inline int16_t timerRead(uint32_t *overflows, uint32_t *ms, uint16_t *fraction)
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t coarse = TCNT2;
+	uint16_t fine = TCNT1;
+	*overflows = timer32_overflows;
+	*ms = timer32_ms;
+	*fraction = timer16_msFraction;
+	if ((TIFR & _BV(TOV2)) && coarse < 0x80)	//Wrapped, but the ISR has not run yet
+	{
+		(*overflows)++;
+		*ms += TIMER2_OVERFLOW_US / 1000;
+		*fraction += TIMER2_OVERFLOW_US % 1000;
+		if (*fraction >= 1000){
+			*fraction -= 1000;
+			(*ms)++;
+		}
+	}
+	SREG = sreg;
+
+	int16_t past = (int16_t)(fine - timer1Offset - ((uint16_t)coarse << TIMER2_TICK_SHIFT));
+	return (int16_t)((uint16_t)coarse << (TIMER2_TICK_SHIFT - 4)) + (past >> 4);
+}
+
+void millis_init(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	TCCR2 = _BV(CS22) | _BV(CS21) | _BV(CS20);	//Normal mode, Clock Prescale /1024
+	ASSR = 0; //Dont use asych clock, use i/o clock.
+	TCNT2 = 0;
+	timer1Offset = TCNT1;
+	TIFR = _BV(TOV2);
+	TIMSK = (TIMSK & ~_BV(OCIE2)) | _BV(TOIE2); //Overflow interrupt only
+
+	timer32_ms = 0;
+	timer16_msFraction = 0;
+	timer32_overflows = 0;
+	SREG = sreg;
+}
+
+uint32_t millis(void)
+{
+	uint32_t overflows, ms;
+	uint16_t fraction;
+	int16_t us = timerRead(&overflows, &ms, &fraction) + fraction;
+	if (us < 0){
+		us += 1000;
+		ms--;
+	}
+	while (us >= 1000){	//At most 17 passes, cheaper than a division
+		us -= 1000;
+		ms++;
+	}
+	return ms;
+}
+
+time_T micros(void)
+{
+	uint32_t overflows, ms;
+	uint16_t fraction;
+	int16_t us = timerRead(&overflows, &ms, &fraction);
+	return (overflows << 14) + us;
+}
+
+uint16_t _100micros(void)
+{
+	return (uint16_t)(micros() / 100);
+}
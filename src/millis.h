@@ -1,4 +1,5 @@
 
+
 #ifndef MILLIS_H
 #define MILLIS_H
 
@@ -9,72 +10,80 @@
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 */
 	#include <avr/io.h>
-		
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& MACROS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	#define TIMER2_TICK_SHIFT 10
+		/* Timer2 runs from the /1024 prescaler, one count every 2^10 CPU cycles (64 uS), and
+		 * overflows every 16.384 mS. That overflow is the only interrupt the timebase needs.		*/
+
+	#define TIMER2_OVERFLOW_US 16384
+		/* uS per Timer2 overflow.																	*/
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& TYPES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+	typedef uint32_t time_T;
+		/* A micros() time stamp. It wraps every 71 minutes, so compare two of them with timeBefore()
+		 * or deadlinePassed(), never with < or >. Differences (a - b) are wrap safe as they are, for
+		 * times up to 35 minutes apart.																*/
 
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& GLOBAL VARIABLE DECLARATIONS
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
-*/		
-	extern uint32_t timer32_ms;
-	extern uint16_t timer16_us;
-	extern uint8_t timerCycles;
-
-	
-		
-	
+*/
+	extern volatile uint32_t timer32_ms;
+		/* Whole mS up to the last Timer2 overflow.													*/
+	extern volatile uint16_t timer16_msFraction;
+		/* uS past timer32_ms at the last Timer2 overflow, 0 to 999.								*/
+	extern volatile uint32_t timer32_overflows;
+		/* Timer2 overflows since millis_init().														*/
+
+
+
 /*
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 &&& FUNCTION PROTOTYPES
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
-*/	
-		inline void millis_init(void)
-		{			
-			/*
-			TCCR2 |= 
-					_BV(WGM21) | ~_BV(WGM20) |     //CTC mode (reset timer after expire
-				    ~_BV(COM21) | ~_BV(COM20)  | //No Output Compare Match Pin
-					~_BV(CS22) | _BV(CS21) | ~_BV(CS20);  //Clock Prescale /8 (2Mhz)*/
-			
-			TCCR2 = 0;
-			TCCR2 |= _BV(WGM21);
-			TCCR2 |= _BV(CS21);
-			
-			
-			
-			TCNT2 = 0;			
-			OCR2 = 199; //Expire after 100uS
-			ASSR = 0; //Dont use asych clock, use i/o clock.
-			TIMSK |= _BV(OCIE2); //Set Output compare interrupt
-											
-			timer32_ms = 0;
-			timer16_us = 0;
-			timerCycles = 0;
-			
-		}		
-		inline uint32_t millis(void)
+*/
+		void millis_init(void);
+		/**< Starts Timer2 free running and zeroes the time, with interrupts held off meanwhile. Call
+		 *   after Timer1 has been started (bldcGimbal::begin()), since its count gives the uS within
+		 *   each 64 uS Timer2 count. Nothing may write TCNT1 or TCNT2 afterwards.						*/
+
+		uint32_t millis(void);
+		/**< mS since millis_init(). Wraps after 49 days.												*/
+
+		time_T micros(void);
+		/**< uS since millis_init(), exact to the uS. Wraps after 71 minutes. Both timers are read with
+		 *   interrupts off, so the result never tears across an overflow.							*/
+
+		uint16_t _100micros(void);
+		/**< micros()/100, the low 16 bits.															*/
+
+		inline bool timeBefore(time_T a, time_T b)
 		{
-			TIMSK &= ~_BV(OCIE2); //Set Output compare interrupt		
-			uint32_t retVal = timer32_ms;
-			TIMSK |= _BV(OCIE2); //Set Output compare interrupt		
-			return retVal;
-		}		
-		inline uint16_t micros(void)
+			return (int32_t)(a - b) < 0;
+		}
+		/**< True if time stamp a is earlier than b, across a wrap of micros().						*/
+
+		inline time_T deadlineIn(uint32_t us)
 		{
-			
-		  // return timer16_us + TCNT2/2;		   		    
-			uint16_t timerCount = TCNT2;
-			TIMSK &= ~_BV(OCIE2); //disable Output compare interrupt			
-			volatile uint16_t usCount = timer16_us;									
-			TIMSK |= _BV(OCIE2); //Set Output compare interrupt		   
-			return usCount  + (timerCount) /2;						
+			return micros() + us;
 		}
-		
-		inline uint16_t _100micros(void)
-		{			  
-			  TIMSK &= ~_BV(OCIE2); //Set Output compare interrupt
-			  volatile uint16_t usCount = timer16_us;
-			  TIMSK |= _BV(OCIE2); //Set Output compare interrupt
-			  return usCount/100;
+		/**< A deadline us from now, for deadlinePassed(). Add a period to a deadline for the next one,
+		 *   that keeps a steady rate however late each one is noticed.								*/
+
+		inline bool deadlinePassed(time_T deadline)
+		{
+			return !timeBefore(micros(), deadline);
 		}
-#endif
\ No newline at end of file
+		/**< True once micros() has reached deadline.												*/
+#endif
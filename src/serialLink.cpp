@@ -0,0 +1,378 @@
+/***************************************************************************************//**
+ * @brief C implementation file for serialLink class.
+ * @details
+ *		The documentation strategy is to document the header file as much as possible
+ *		and only comment this CPP file for things not already documented in the header
+ *	    file.
+ *
+ *		See serialLink.h for an in-depth description of this class, its methods,
+ *		and its properties.
+ * @author Alan Nise, Oceanlab LLC
+ * @
+ *//***************************************************************************************/
+
+
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& INCLUDES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+#include "serialLink.h"
+#ifdef SERIAL_LINK
+#include "millis.h"
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& MACROS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	#define RX_MASK (SERIAL_RX_SIZE - 1)
+	#define TX_MASK (SERIAL_TX_SIZE - 1)
+	#define CRC_INIT 0xFFFF
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& STRUCTURES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/*****************************************************************************************************/
+	/* STRUCT: serialIsrData_S																			 */
+	/** Ring buffers shared with the USART interrupts. Each index is written by one side only, the head
+	 *  by whoever fills the ring and the tail by whoever empties it, and is one byte, so neither side
+	 *  has to hold the other off. A ring is empty when head equals tail, so one byte is never used.	 */
+	/*****************************************************************************************************/
+	typedef struct serialIsrData_S
+	{
+		uint8_t rx[SERIAL_RX_SIZE];	///<Bytes received, in from the receive ISR, out by tickle().
+		volatile uint8_t rxHead;	///<Where the receive ISR puts the next byte.
+		volatile uint8_t rxTail;	///<The next byte for tickle().
+		volatile bool rxLost;
+			/**< Set by the receive ISR when a byte was lost (ring full, framing error or overrun), cleared
+			 * by tickle() when it counts the error.														*/
+		uint8_t tx[SERIAL_TX_SIZE];	///<Bytes to send, in by telemetry(), out by the UDR empty ISR.
+		volatile uint8_t txHead;	///<Where telemetry() puts the next byte.
+		volatile uint8_t txTail;	///<The next byte for the UDR empty ISR.
+	}serialIsrData_T;
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& VARIABLES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	static serialIsrData_T serialIsrData; //Variable used to store data used to interact with the ISRs.
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& FUNCTIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/*****************************************************************************
+	*  Function: cobsDecode
+	*	Description:															 */
+   /**		Undoes the COBS encoding of a frame, in place. Each code byte n is
+	*		followed by n-1 data bytes, then a zero unless n is 255 or the frame
+	*		ends there.
+	* @param frame The frame without its 0 delimiter, which holds no zeros.
+	* @param length Bytes in frame.
+	* @return Bytes decoded, 0 if a code byte runs past the end of the frame.
+	****************************************************************************/
+	static uint8_t cobsDecode(uint8_t *frame, uint8_t length)
+	{
+		uint8_t in = 0, out = 0;
+		while (in < length)
+		{
+			uint8_t code = frame[in++];
+			if (code - 1 > length - in) return 0;
+			for (uint8_t n = 1; n < code; n++) frame[out++] = frame[in++];	//out is always behind in
+			if (code != 0xFF && in < length) frame[out++] = 0;
+		}
+		return out;
+	}
+
+	/*****************************************************************************
+	*  Function: crc16
+	*	Description:															 */
+   /**		CRC-16 of a frame's message ID and data, see serialLink.
+	****************************************************************************/
+	static uint16_t crc16(const uint8_t *data, uint8_t length)
+	{
+		uint16_t crc = CRC_INIT;
+		while (length--) crc = _crc_ccitt_update(crc, *data++);
+		return crc;
+	}
+
+	/*****************************************************************************
+	*  Function: get16
+	*	Description:															 */
+   /**		Reads a little endian 16 bit value out of a frame.
+	****************************************************************************/
+	static inline uint16_t get16(const uint8_t *data)
+	{
+		return data[0] | ((uint16_t)data[1] << 8);
+	}
+
+	/*****************************************************************************
+	*  Function: put16
+	*	Description:															 */
+   /**		Writes a little endian 16 bit value into a frame.
+	* @return Where the next value goes.
+	****************************************************************************/
+	static inline uint8_t *put16(uint8_t *data, uint16_t value)
+	{
+		data[0] = (uint8_t)value;
+		data[1] = (uint8_t)(value >> 8);
+		return data + 2;
+	}
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& INTERRUPT SERVICE ROUTINES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/****************************************************************************
+	*  ISR: USART_RXC_vect
+	*	Description:
+	*		Triggered when a byte has been received. Moves it into the receive
+	*		ring, or notes that it was lost. Both USART ISRs are a handful of
+	*		instructions, so they hold the PWM ISR off for no longer than its
+	*		own prologue does.
+	****************************************************************************/
+	ISR(USART_RXC_vect)
+	{
+		uint8_t status = UCSRA;	//Before UDR, reading UDR moves the receive buffer on
+		uint8_t data = UDR;
+		uint8_t head = serialIsrData.rxHead;
+		uint8_t next = (head + 1) & RX_MASK;
+		if ((status & (_BV(FE) | _BV(DOR))) || next == serialIsrData.rxTail)
+		{
+			serialIsrData.rxLost = true;
+			return;
+		}
+		serialIsrData.rx[head] = data;
+		serialIsrData.rxHead = next;
+	}
+
+	/****************************************************************************
+	*  ISR: USART_UDRE_vect
+	*	Description:
+	*		Triggered while the USART can take another byte and UDRIE is set.
+	*		Sends the next byte of the transmit ring, and clears UDRIE once the
+	*		ring is empty. telemetry() sets UDRIE with a read-modify-write of
+	*		UCSRB which this ISR can get in the middle of, so it may be entered
+	*		with nothing to send.
+	****************************************************************************/
+	ISR(USART_UDRE_vect)
+	{
+		uint8_t tail = serialIsrData.txTail;
+		if (tail != serialIsrData.txHead)
+		{
+			UDR = serialIsrData.tx[tail];
+			tail = (tail + 1) & TX_MASK;
+			serialIsrData.txTail = tail;
+		}
+		if (tail == serialIsrData.txHead) UCSRB &= ~_BV(UDRIE);
+	}
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& CLASS METHOD IMPLEMENTATION FUNCTIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+
+	/****************************************************************************
+	*  Class: serialLink
+	*  Method: serialLink
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	serialLink::serialLink(void)
+	{
+		_gimbal = 0;
+		_frameLength = 0;
+		_frameCnt = 0;
+		_errorCnt = 0;
+		_telemetryMs = SERIAL_TELEMETRY_MS;
+		_telemetryDue = 0;
+	}
+
+	/****************************************************************************
+	*  Class: serialLink
+	*  Method: begin
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	void serialLink::begin(bldcGimbal *gimbal)
+	{
+		_gimbal = gimbal;
+		_telemetryDue = deadlineIn(_telemetryMs * 1000UL);
+		serialIsrData.rxHead = serialIsrData.rxTail = 0;
+		serialIsrData.txHead = serialIsrData.txTail = 0;
+		serialIsrData.rxLost = false;
+
+		//Pull rxd (PD0) up, so an unplugged line idles rather than making noise. The PWM ISR owns
+		//the rest of PORTD.
+		uint8_t sreg = SREG;
+		cli();
+			PORTD |= _BV(PORTD0);
+		SREG = sreg;
+
+		//Double speed, 8 data bits, no parity, 1 stop bit. UBRRH and UCSRC share an address, URSEL picks.
+		UBRRH = (uint8_t)(SERIAL_UBRR >> 8);
+		UBRRL = (uint8_t)SERIAL_UBRR;
+		UCSRA = _BV(U2X);
+		UCSRC = _BV(URSEL) | _BV(UCSZ1) | _BV(UCSZ0);
+
+		//The receiver and transmitter take over rxd and txd from PORTD
+		UCSRB = _BV(RXCIE) | _BV(RXEN) | _BV(TXEN);
+	}
+
+	/****************************************************************************
+	*  Class: serialLink
+	*  Method: tickle
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	void serialLink::tickle(void)
+	{
+		if (serialIsrData.rxLost)
+		{
+			serialIsrData.rxLost = false;
+			if (_errorCnt < 0xFF) _errorCnt++;	//The CRC throws out the frame the byte was lost from
+		}
+
+		uint8_t tail = serialIsrData.rxTail;
+		while (tail != serialIsrData.rxHead)
+		{
+			uint8_t data = serialIsrData.rx[tail];
+			tail = (tail + 1) & RX_MASK;
+			serialIsrData.rxTail = tail;	//Free each byte straight away, acting on a frame takes a while
+
+			if (data != 0)
+			{
+				if (_frameLength < SERIAL_FRAME_MAX) _frame[_frameLength] = data;
+				if (_frameLength <= SERIAL_FRAME_MAX) _frameLength++;
+				continue;
+			}
+			if (_frameLength == 0) continue;	//Back to back delimiters, or a host resynchronising us
+
+			bool isGood = _frameLength <= SERIAL_FRAME_MAX && command(_frame, cobsDecode(_frame, _frameLength));
+			if (isGood) _frameCnt++;
+			else if (_errorCnt < 0xFF) _errorCnt++;
+			_frameLength = 0;
+		}
+
+		if (_telemetryMs && deadlinePassed(_telemetryDue))
+		{
+			_telemetryDue += _telemetryMs * 1000UL;
+			if (deadlinePassed(_telemetryDue)) _telemetryDue = deadlineIn(_telemetryMs * 1000UL);	//More than a period behind, do not send a burst to catch up
+			telemetry();
+		}
+	}
+
+	/****************************************************************************
+	*  Class: serialLink
+	*  Method: command
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	bool serialLink::command(uint8_t *frame, uint8_t length)
+	{
+		if (length < 3) return false;
+		length -= 2;
+		if (get16(frame + length) != crc16(frame, length)) return false;
+
+		switch (frame[0])
+		{
+#ifndef POSITION_MODE
+			case eSerialMessage_SPEED:
+				if (length != 3) return false;
+				return _gimbal->set_speed_rpm((int16_t)get16(frame + 1));
+#else
+			case eSerialMessage_POSITION:
+				if (length != 5) return false;
+				return _gimbal->set_position((int32_t)(get16(frame + 1) | ((uint32_t)get16(frame + 3) << 16)));
+#endif
+			case eSerialMessage_POWER:
+				if (length != 2 || frame[1] > POWER_FULL_SCALE) return false;
+				return _gimbal->set_PowerScale(frame[1]);
+
+			case eSerialMessage_TELEMETRY_RATE:
+				if (length != 2) return false;
+				_telemetryMs = frame[1];
+				_telemetryDue = deadlineIn(_telemetryMs * 1000UL);
+				return true;
+
+			default:
+				return false;
+		}
+	}
+
+	/****************************************************************************
+	*  Class: serialLink
+	*  Method: telemetry
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	void serialLink::telemetry(void)
+	{
+		uint8_t head = serialIsrData.txHead;
+		if (((serialIsrData.txTail - head - 1) & TX_MASK) < SERIAL_TELEMETRY_SIZE) return;
+
+		uint8_t frame[SERIAL_TELEMETRY_LENGTH + 2];
+		uint8_t *data = frame;
+		int32_t position = _gimbal->position();
+		*data++ = eSerialMessage_TELEMETRY;
+		data = put16(data, (uint16_t)position);
+		data = put16(data, (uint16_t)(position >> 16));
+		data = put16(data, _gimbal->speed_rpm());
+		*data++ = _gimbal->powerScale();
+		*data++ = _errorCnt;
+		data = put16(data, _frameCnt);
+#ifdef PWM_PROFILE
+		bldcPwm::pwmProfileSummary_T profile;
+		bldcPwm::profileSummary(&profile);
+		data = put16(data, profile.isrCount);
+		data = put16(data, profile.lateEdges);
+		data = put16(data, profile.latenessMax);
+		data = put16(data, profile.durationMax);
+		data = put16(data, _gimbal->stepCnt());
+#else
+		for (uint8_t n = 0; n < 10; n++) *data++ = 0;
+#endif
+		put16(data, crc16(frame, SERIAL_TELEMETRY_LENGTH));
+
+		//COBS encode straight into the ring. The ISR only looks as far as txHead, so the code bytes can
+		//be filled in behind it.
+		uint8_t code = head;
+		uint8_t next = (head + 1) & TX_MASK;
+		for (uint8_t n = 0; n < sizeof(frame); n++)
+		{
+			if (frame[n] == 0)
+			{
+				serialIsrData.tx[code] = (uint8_t)((next - code) & TX_MASK);
+				code = next;
+			}
+			else serialIsrData.tx[next] = frame[n];
+			next = (next + 1) & TX_MASK;
+		}
+		serialIsrData.tx[code] = (uint8_t)((next - code) & TX_MASK);
+		serialIsrData.tx[next] = 0;
+		serialIsrData.txHead = (next + 1) & TX_MASK;
+		UCSRB |= _BV(UDRIE);
+	}
+#endif
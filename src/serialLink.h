@@ -0,0 +1,233 @@
+/***************************************************************************************//**
+ * @brief C Header File for serialLink class which is a driver for a binary command and
+ *        telemetry protocol on the USART (the txd and rxd pins of the ESC).
+ * @details
+ *		This file contains the class definition. It also serves as the primary location
+ *		for documenting all of the class methods, properties, and structures. When given
+ *		a choice, comments will be placed in this file, unless they are specific to
+ *		code implementation, or reference an item only found in the C file.
+ *
+ * @author Alan Nise, Oceanlab LLC
+ * @
+ *//***************************************************************************************/
+
+#ifndef SERIALLINK_H_
+#define SERIALLINK_H_
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& USER CONFIGURATION
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	//#define SERIAL_LINK
+			/**< When DEFINED, tripolar.cpp takes speed, position and power commands from the USART and
+			 *   sends telemetry back, alongside the servo input. Off by default, since it takes over the
+			 *   txd/rxd pins and adds the USART interrupts to the pwm ISR's load. Uncomment to use it. */
+
+	#define SERIAL_BAUD 250000UL
+			/**< Bits per second, 8 data bits, no parity, 1 stop bit. The USART runs in double speed mode,
+			 *   so 250000, 500000 and 1000000 are exact at 16MHz.										*/
+
+	#define SERIAL_RX_SIZE 32
+			/**< Bytes the receive interrupt can queue before tickle() has to collect them. Power of 2.
+			 *   32 bytes last 1.28 mS at 250k baud.													*/
+
+	#define SERIAL_TX_SIZE 32
+			/**< Bytes of telemetry which can wait to go out. Power of 2, and big enough for one telemetry
+			 *   frame, SERIAL_TELEMETRY_SIZE bytes after framing.										*/
+
+	#define SERIAL_TELEMETRY_MS 20
+			/**< Default time between telemetry frames in milli seconds, 0 for none. The host can change
+			 *   it with eSerialMessage_TELEMETRY_RATE.													*/
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& INCLUDES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+#include <inttypes.h>
+#include "bldcGimbal.h"
+#include "millis.h"
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& MACROS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+#ifndef F_CPU
+	#define F_CPU 16000000UL
+#endif
+
+	#define SERIAL_UBRR ((F_CPU + 4UL * SERIAL_BAUD) / (8UL * SERIAL_BAUD) - 1)
+		/* Baud rate register for double speed mode, rounded to the nearest rate.						*/
+
+	#define SERIAL_FRAME_MAX 8
+		/* Longest command frame as received, COBS encoded, without its 0.							*/
+
+	#define SERIAL_TELEMETRY_LENGTH 21
+		/* Message ID and data of a telemetry frame, see eSerialMessage_TELEMETRY.						*/
+
+	#define SERIAL_TELEMETRY_SIZE (SERIAL_TELEMETRY_LENGTH + 4)
+		/* Telemetry frame on the wire: CRC, the COBS code byte and the 0 delimiter added.				*/
+
+#if (SERIAL_RX_SIZE & (SERIAL_RX_SIZE - 1)) || (SERIAL_TX_SIZE & (SERIAL_TX_SIZE - 1)) || SERIAL_RX_SIZE > 256 || SERIAL_TX_SIZE > 256
+	#error SERIAL_RX_SIZE and SERIAL_TX_SIZE must be powers of 2, up to 256
+#endif
+#if SERIAL_TX_SIZE <= SERIAL_TELEMETRY_SIZE
+	#error SERIAL_TX_SIZE must hold a telemetry frame (the ring keeps one byte free)
+#endif
+#if SERIAL_UBRR > 4095 || 100UL * F_CPU / (8UL * (SERIAL_UBRR + 1)) > 102UL * SERIAL_BAUD || 100UL * F_CPU / (8UL * (SERIAL_UBRR + 1)) < 98UL * SERIAL_BAUD
+	#error SERIAL_BAUD can not be made within 2% from F_CPU
+#endif
+#if defined(SERIAL_LINK) && defined(DO_DEBUG)
+	#error DO_DEBUG drives the txd and rxd pins, it can not be used with SERIAL_LINK
+#endif
+
+
+#ifdef SERIAL_LINK
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& CLASS DEFINITION
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+/********************************************************************************************************/
+/* CLASS: serialLink																					*/
+/** Binary command and telemetry link on the USART. Both ways a frame is a message ID byte, the
+ *  message's data (little endian) and a CRC-16 of both (CRC-16/MCRF4XX: CCITT, reflected, initial
+ *  value 0xFFFF, sent low byte first, avr-libc's _crc_ccitt_update()). The frame is COBS encoded, so
+ *  it holds no zero bytes, and ends with a zero. A receiver which joins half way through, or sees a bad byte, is back in
+ *  step at the next zero.
+ *
+ *  The USART interrupts only move bytes between the USART and two ring buffers, so they are short
+ *  and never wait. Frames are decoded, acted on and built by tickle() in the main loop. Nothing is
+ *  sent back for a command, the next telemetry frame shows its effect, and errorCnt() counts the
+ *  frames which were thrown away. A telemetry frame which does not fit in the transmit buffer is
+ *  skipped rather than waited for.
+ *																										*/
+/********************************************************************************************************/
+class serialLink
+{
+	/*
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	&&& PUBLIC PROPERTIES
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	*/	public:
+
+		/************************************************************************************************/
+		/*  ENUM: serialMessage_E																		*/
+		/** Message IDs, the first byte of every frame. Commands go to the ESC, telemetry comes back.	*/
+		/************************************************************************************************/
+			typedef enum serialMessage_E
+			{
+				eSerialMessage_SPEED = 0x01,
+					/**< int16 rpm, as bldcGimbal::set_speed_rpm(), up to MAX_SPEED_RPM either way. Not accepted
+					 *   with POSITION_MODE.																*/
+				eSerialMessage_POSITION = 0x02,
+					/**< int32 rotor angle, as bldcGimbal::set_position(). Only accepted with
+					 *   POSITION_MODE.																	*/
+				eSerialMessage_POWER = 0x03,
+					/**< uint8 power, 0 to POWER_FULL_SCALE, as bldcGimbal::set_PowerScale(). It holds
+					 *   until the next speed change sets the power for the new speed.						*/
+				eSerialMessage_TELEMETRY_RATE = 0x04,
+					/**< uint8 milli seconds between telemetry frames, 0 to stop them.					*/
+				eSerialMessage_TELEMETRY = 0x80,
+					/**< From the ESC:
+					 *   int32 bldcGimbal::position(), the rotor step, 65536 per electrical cycle
+					 *   int16 speed in rpm
+					 *   uint8 power scale
+					 *   uint8 errorCnt()
+					 *   uint16 frameCnt()
+					 *   then the pwm ISR statistics, all 0 unless PWM_PROFILE is defined:
+					 *   uint16 ISR runs, wraps
+					 *   uint16 late edges
+					 *   uint16 worst edge lateness, Timer1 counts
+					 *   uint16 longest ISR, Timer1 counts
+					 *   uint16 bldcGimbal::stepCnt(), Timer1 counts									*/
+			}serialMessage_T;
+
+	/*
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	&&& PUBLIC METHODS
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	*/	public:
+
+
+		serialLink(void);
+		/**<Instatiator. Called automatically when the class is instantiated. Good place for class
+			* property initialization																	*/
+		/*------------------------------------------------------------------------------------------*/
+
+		void begin(bldcGimbal *gimbal);
+		/**< Setup method for class. Call this after the class is instantiated, but before using
+			* the class. Sets up the USART and its interrupts.
+			* @param gimbal
+			*		The motor commands are passed on to. Call its begin() first.					*/
+		/*------------------------------------------------------------------------------------------*/
+
+		void tickle(void);
+		/**< This function needs to be called on a regular basis, from the main loop. It acts on the
+		 * commands received since the last call and queues telemetry when it is due. Call it at
+		 * least once per SERIAL_RX_SIZE byte times or received bytes are lost.						*/
+		/*------------------------------------------------------------------------------------------*/
+
+
+		/*
+			&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+			&&& ACCESSORS
+			&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+			*/
+
+					inline uint16_t frameCnt(void) {return _frameCnt;}
+						 /**< Accessor Method. See corresponding private property for more info.				*/
+					inline uint8_t errorCnt(void) {return _errorCnt;}
+						 /**< Accessor Method. See corresponding private property for more info.				*/
+
+/*
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	&&& PRIVATE PROPERTIES
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	*/	private:
+
+		bldcGimbal *_gimbal;
+			/**< The motor commands are passed on to.														*/
+
+		uint8_t _frame[SERIAL_FRAME_MAX];
+			/**< The command frame being received, still COBS encoded.										*/
+
+		uint8_t _frameLength;
+			/**< Bytes in _frame so far. More than SERIAL_FRAME_MAX once the frame is too long, it is
+			 * then dropped at its end.																	*/
+
+		uint16_t _frameCnt;
+			/**< Commands received and acted on since power up. Wraps.									*/
+
+		uint8_t _errorCnt;
+			/**< Frames thrown away since power up (bad CRC, too long, unknown or not accepted message,
+			 * lost bytes), plus receive errors (framing, overrun). Stops at 255.						*/
+
+		uint8_t _telemetryMs;
+			/**< Milli seconds between telemetry frames, 0 for none.										*/
+
+		time_T _telemetryDue;
+			/**< When the next telemetry frame is due.													*/
+
+/*
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	&&& PRIVATE METHODS
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	*/	private:
+
+		bool command(uint8_t *frame, uint8_t length);
+		/**< Checks and acts on one decoded command frame.
+		 * @return False if the frame was thrown away.													*/
+
+		void telemetry(void);
+		/**< Queues a telemetry frame, unless the transmit buffer is too full to take it.				*/
+};
+#endif
+
+#endif /* SERIALLINK_H_ */
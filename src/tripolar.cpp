@@ -26,6 +26,8 @@
 
 #include "fets.h"
 #include "measureServo.h"
+#include "serialLink.h"
+#include "twiSlave.h"
 
 #include <util/delay.h>
 #include "millis.h"
@@ -57,6 +59,12 @@ void loop(void);
 
 bldcGimbal gimbal;
 measureServo servo;
+#ifdef SERIAL_LINK
+serialLink serial;
+#endif
+#ifdef TWI_SLAVE
+twiSlave twi;
+#endif
 
 
 /*
@@ -79,14 +87,27 @@ void setup(void)
 	cli();
 	redOff();
 	greenOn();
-	millis_init();
 	gimbal.begin();
+	millis_init();	//Needs Timer1 running
 	servo.begin();
+#ifdef SERIAL_LINK
+	serial.begin(&gimbal);
+#endif
+#ifdef TWI_SLAVE
+	twi.begin(&gimbal);
+#endif
 }
 
 void loop(void)
 {		
-	if (servo.changeDetected()) gimbal.set_servo_us(servo.value_uS());							
+	if (servo.changeDetected()) gimbal.set_servo_cnt(servo.value_cnt());
+	else if (servo.signalLost()) gimbal.servo_lost();
+#ifdef SERIAL_LINK
+	serial.tickle();
+#endif
+#ifdef TWI_SLAVE
+	twi.tickle();
+#endif
 	gimbal.tickle();	
 }
 
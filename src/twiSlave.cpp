@@ -0,0 +1,288 @@
+/***************************************************************************************//**
+ * @brief C implementation file for twiSlave class.
+ * @details
+ *		The documentation strategy is to document the header file as much as possible
+ *		and only comment this CPP file for things not already documented in the header
+ *	    file.
+ *
+ *		See twiSlave.h for an in-depth description of this class, its methods,
+ *		and its properties.
+ * @author Alan Nise, Oceanlab LLC
+ * @
+ *//***************************************************************************************/
+
+
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& INCLUDES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+#include "twiSlave.h"
+#ifdef TWI_SLAVE
+#include <string.h>
+#include <avr/interrupt.h>
+#include <util/twi.h>
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& MACROS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	#define TWCR_ACK (_BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE))
+		/* Hands the bus back to the TWI unit, which then acknowledges our address and every byte.	*/
+
+	#define STAGED_SPEED	0x01	//Bits of twiIsrData.staged and eTwiReg_STAGED
+	#define STAGED_POSITION	0x02
+	#define STAGED_POWER	0x04
+
+	#define TELEMETRY_SIZE (twiSlave::eTwiReg_END_OF_ENUM - twiSlave::eTwiReg_TELEMETRY)
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& STRUCTURES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/*****************************************************************************************************/
+	/* STRUCT: twiIsrData_S																				 */
+	/** Data structure used to interact with the TWI Interrupt service routine							 */
+	/*****************************************************************************************************/
+	typedef struct twiIsrData_S
+	{
+		uint8_t reg[twiSlave::eTwiReg_END_OF_ENUM];
+			/**< The register map. The setpoint registers are written by the ISR, the telemetry ones by
+			 * tickle(), with interrupts off.															*/
+		uint8_t pointer;	///<Register the next byte is written to or read from.
+		bool pointerNext;	///<True if the next byte written is a register number.
+		volatile bool reading;
+			/**< True while the master is reading, tickle() leaves the telemetry alone so a multi byte
+			 * value can not change half way through.													*/
+		bool latch;			///<eTwiReg_LATCH has been written in this transfer.
+		uint8_t staged;		///<STAGED_ bits of the setpoints written but not yet released.
+		volatile uint8_t released;
+			/**< STAGED_ bits of the setpoints released at a stop, for tickle() to apply.				*/
+		uint8_t setpoints[twiSlave::eTwiReg_LATCH];
+			/**< The setpoint registers as they were when last released. tickle() applies them from here,
+			 * since the master may already be writing the next ones into reg.						*/
+	}twiIsrData_T;
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& VARIABLES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	static twiIsrData_T twiIsrData; //Variable used to store data used to interact with the ISR.
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& FUNCTIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/*****************************************************************************
+	*  Function: registerWrite
+	*	Description:															 */
+   /**		Stores a byte the master wrote in the register map, and notes which
+	*		setpoint it belongs to. Read only registers are left alone.
+	****************************************************************************/
+	static inline void registerWrite(uint8_t data)
+	{
+		uint8_t n = twiIsrData.pointer++;
+		if (n == twiSlave::eTwiReg_LATCH)
+		{
+			if (data) twiIsrData.latch = true;
+			return;
+		}
+		if (n > twiSlave::eTwiReg_LATCH) return;
+		twiIsrData.reg[n] = data;
+		if (n >= twiSlave::eTwiReg_POWER) twiIsrData.staged |= STAGED_POWER;
+		else if (n >= twiSlave::eTwiReg_POSITION) twiIsrData.staged |= STAGED_POSITION;
+		else if (n >= twiSlave::eTwiReg_SPEED) twiIsrData.staged |= STAGED_SPEED;
+	}
+
+	/*****************************************************************************
+	*  Function: get16
+	*	Description:															 */
+   /**		Reads a little endian 16 bit value out of the register map.
+	****************************************************************************/
+	static inline uint16_t get16(const uint8_t *data)
+	{
+		return data[0] | ((uint16_t)data[1] << 8);
+	}
+
+	/*****************************************************************************
+	*  Function: put16
+	*	Description:															 */
+   /**		Writes a little endian 16 bit value into the register map.
+	* @return Where the next value goes.
+	****************************************************************************/
+	static inline uint8_t *put16(uint8_t *data, uint16_t value)
+	{
+		data[0] = (uint8_t)value;
+		data[1] = (uint8_t)(value >> 8);
+		return data + 2;
+	}
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& INTERRUPT SERVICE ROUTINES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	/****************************************************************************
+	*  ISR: TWI_vect
+	*	Description:
+	*		Triggered for each bus event which involves us: addressed, a byte
+	*		received or wanted, a stop. The TWI unit holds SCL low until TWINT
+	*		is cleared at the end, so the master waits for us however late this
+	*		runs. Interrupts stay off, TWINT has to be cleared before another
+	*		event could be taken.
+	****************************************************************************/
+	ISR(TWI_vect)
+	{
+		switch (TW_STATUS)
+		{
+			case TW_SR_SLA_ACK:
+			case TW_SR_ARB_LOST_SLA_ACK:
+			case TW_SR_GCALL_ACK:
+			case TW_SR_ARB_LOST_GCALL_ACK:
+				twiIsrData.pointerNext = true;
+				twiIsrData.reading = false;
+				break;
+
+			case TW_SR_DATA_ACK:
+			case TW_SR_GCALL_DATA_ACK:
+				if (twiIsrData.pointerNext)
+				{
+					twiIsrData.pointer = TWDR;
+					twiIsrData.pointerNext = false;
+				}
+				else registerWrite(TWDR);
+				break;
+
+			case TW_SR_STOP:	//Or a repeated start
+				if (twiIsrData.latch || !(twiIsrData.reg[twiSlave::eTwiReg_MODE] & twiSlave::eTwiMode_LATCHED))
+				{
+					memcpy(twiIsrData.setpoints, twiIsrData.reg, sizeof(twiIsrData.setpoints));
+					twiIsrData.released |= twiIsrData.staged;
+					twiIsrData.staged = 0;
+					twiIsrData.latch = false;
+				}
+				break;
+
+			case TW_ST_SLA_ACK:
+			case TW_ST_ARB_LOST_SLA_ACK:
+				twiIsrData.reading = true;
+				//no break
+			case TW_ST_DATA_ACK:
+				TWDR = twiIsrData.pointer < twiSlave::eTwiReg_END_OF_ENUM ? twiIsrData.reg[twiIsrData.pointer] : 0xFF;
+				twiIsrData.pointer++;
+				break;
+
+			case TW_ST_DATA_NACK:
+			case TW_ST_LAST_DATA:
+				twiIsrData.reading = false;
+				break;
+
+			case TW_BUS_ERROR:	//Illegal start or stop, release the bus
+				twiIsrData.reading = false;
+				TWCR = TWCR_ACK | _BV(TWSTO);
+				return;
+		}
+		TWCR = TWCR_ACK;
+	}
+
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& CLASS METHOD IMPLEMENTATION FUNCTIONS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+
+	/****************************************************************************
+	*  Class: twiSlave
+	*  Method: twiSlave
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	twiSlave::twiSlave(void)
+	{
+		_gimbal = 0;
+	}
+
+	/****************************************************************************
+	*  Class: twiSlave
+	*  Method: begin
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	void twiSlave::begin(bldcGimbal *gimbal)
+	{
+		_gimbal = gimbal;
+		memset(&twiIsrData, 0, sizeof(twiIsrData));
+		tickle();	//Telemetry is valid before the first read
+
+		//Answer our own address and the general call. boardInit() has already pulled up the pins.
+		TWAR = (TWI_ADDRESS << 1) | _BV(TWGCE);
+		TWCR = _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
+	}
+
+	/****************************************************************************
+	*  Class: twiSlave
+	*  Method: tickle
+	*	Description:
+	*		See class header file for a full API description of this method
+	****************************************************************************/
+	void twiSlave::tickle(void)
+	{
+		uint8_t sreg = SREG;
+
+		if (twiIsrData.released)
+		{
+			cli();
+				uint8_t released = twiIsrData.released;
+				twiIsrData.released = 0;
+				int16_t speed = (int16_t)get16(&twiIsrData.setpoints[eTwiReg_SPEED]);
+				int32_t position = (int32_t)(get16(&twiIsrData.setpoints[eTwiReg_POSITION]) | ((uint32_t)get16(&twiIsrData.setpoints[eTwiReg_POSITION + 2]) << 16));
+				uint8_t power = twiIsrData.setpoints[eTwiReg_POWER];
+			SREG = sreg;
+#ifndef POSITION_MODE
+			if (released & STAGED_SPEED) _gimbal->set_speed_rpm(speed);	//Refuses anything beyond MAX_SPEED_RPM
+			(void)position;
+#else
+			if (released & STAGED_POSITION) _gimbal->set_position(position);
+			(void)speed;
+#endif
+			if ((released & STAGED_POWER) && power <= POWER_FULL_SCALE) _gimbal->set_PowerScale(power);
+		}
+
+		uint8_t telemetry[TELEMETRY_SIZE];
+		uint8_t *data = telemetry;
+		int32_t position = _gimbal->position();
+		data = put16(data, (uint16_t)position);
+		data = put16(data, (uint16_t)(position >> 16));
+		data = put16(data, _gimbal->speed_rpm());
+		*data++ = _gimbal->powerScale();
+		*data++ = twiIsrData.staged;
+#ifdef PWM_PROFILE
+		bldcPwm::pwmProfileSummary_T profile;
+		bldcPwm::profileSummary(&profile);
+		data = put16(data, profile.isrCount);
+		put16(data, profile.lateEdges);
+#else
+		put16(put16(data, 0), 0);
+#endif
+		cli();
+			if (!twiIsrData.reading) memcpy(&twiIsrData.reg[eTwiReg_TELEMETRY], telemetry, TELEMETRY_SIZE);
+		SREG = sreg;
+	}
+#endif
@@ -0,0 +1,171 @@
+/***************************************************************************************//**
+ * @brief C Header File for twiSlave class which is a driver for an I2C (TWI) slave register
+ *        map on the i2c_clk and i2c_data pins, for running several motors from one bus.
+ * @details
+ *		This file contains the class definition. It also serves as the primary location
+ *		for documenting all of the class methods, properties, and structures. When given
+ *		a choice, comments will be placed in this file, unless they are specific to
+ *		code implementation, or reference an item only found in the C file.
+ *
+ * @author Alan Nise, Oceanlab LLC
+ * @
+ *//***************************************************************************************/
+
+#ifndef TWISLAVE_H_
+#define TWISLAVE_H_
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& USER CONFIGURATION
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+	//#define TWI_SLAVE
+			/**< When DEFINED, tripolar.cpp answers on the I2C bus as well as reading the servo input.
+			 *   Off by default, since it takes over the i2c pins and adds the TWI interrupt to the pwm
+			 *   ISR's load. Uncomment to use it.														*/
+
+	#define TWI_ADDRESS 0x28
+			/**< 7 bit bus address. Every motor on a bus needs its own, so build each motor's firmware
+			 *   with a different one. All of them also answer the general call (address 0), which is
+			 *   how eTwiReg_LATCH reaches every motor at once.											*/
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& INCLUDES
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+#include <inttypes.h>
+#include "bldcGimbal.h"
+
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& MACROS
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+#if TWI_ADDRESS < 0x08 || TWI_ADDRESS > 0x77
+	#error TWI_ADDRESS must be a 7 bit address outside the reserved ranges, 0x08 to 0x77
+#endif
+#if defined(TWI_SLAVE) && defined(DO_DEBUG)
+	#error DO_DEBUG drives the i2c pins on some boards, it can not be used with TWI_SLAVE
+#endif
+
+
+#ifdef TWI_SLAVE
+/*
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+&&& CLASS DEFINITION
+&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+*/
+
+/********************************************************************************************************/
+/* CLASS: twiSlave																						*/
+/** I2C slave with a register map, see twiRegister_E. A write sends the register number, then data
+ *  for it and the registers after it. A read returns data from the register number last written,
+ *  usually sent just before with a repeated start. Values are little endian.
+ *
+ *  Setpoints written over the bus are staged. At the end of the write (stop or repeated start) they
+ *  are passed to the motor, or, with eTwiMode_LATCHED set, held until eTwiReg_LATCH is written. Writing
+ *  eTwiReg_LATCH with a general call latches every motor on the bus at the same stop condition, and
+ *  each applies its setpoints in the next pass of the main loop. The new setpoint then waits behind
+ *  the PWM_FRAME_COUNT-1 frames already queued, so it reaches the motors about 3 mS later at 1kHz with
+ *  4 frames, and within one update period of each other, since each motor keeps its own PWM clock.
+ *
+ *  The TWI interrupt handles one bus event in a handful of instructions, with no loops. The TWI unit
+ *  holds SCL low until the interrupt has run, so when the PWM ISR keeps it waiting the bus is only
+ *  slowed down, nothing is lost.
+ *																										*/
+/********************************************************************************************************/
+class twiSlave
+{
+	/*
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	&&& PUBLIC PROPERTIES
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	*/	public:
+
+		/************************************************************************************************/
+		/*  ENUM: twiRegister_E																			*/
+		/** The register map. Registers below eTwiReg_TELEMETRY can be written, the rest are read only
+		 *  and refreshed by tickle(). Reads past the end return 0xFF.									*/
+		/************************************************************************************************/
+			typedef enum twiRegister_E
+			{
+				eTwiReg_MODE = 0x00,
+					/**< uint8 twiMode_E bits. Read back as written.										*/
+				eTwiReg_SPEED = 0x01,
+					/**< int16 rpm, as bldcGimbal::set_speed_rpm(). Ignored with POSITION_MODE, or when faster
+					 *   than MAX_SPEED_RPM either way.														*/
+				eTwiReg_POSITION = 0x03,
+					/**< int32 rotor angle, as bldcGimbal::set_position(). Only used with POSITION_MODE.	*/
+				eTwiReg_POWER = 0x07,
+					/**< uint8 power, 0 to POWER_FULL_SCALE, as bldcGimbal::set_PowerScale(). Applied after
+					 *   a speed written at the same time, since a speed change sets the power too.		*/
+				eTwiReg_LATCH = 0x08,
+					/**< Write non zero to apply the staged setpoints, see eTwiMode_LATCHED. Reads 0.		*/
+				eTwiReg_TELEMETRY = 0x10,
+					/**< int32 bldcGimbal::position(), the rotor step, 65536 per electrical cycle.			*/
+				eTwiReg_TELEMETRY_SPEED = 0x14,
+					/**< int16 speed in rpm.																*/
+				eTwiReg_TELEMETRY_POWER = 0x16,
+					/**< uint8 power scale.																*/
+				eTwiReg_STAGED = 0x17,
+					/**< uint8, bit 0 to 2 set for the speed, position and power written but not yet applied.
+					 *   Lets the master check every motor has its setpoints before latching.				*/
+				eTwiReg_ISR_RUNS = 0x18,
+					/**< uint16 pwm ISR runs, wraps. 0 unless PWM_PROFILE is defined.						*/
+				eTwiReg_LATE_EDGES = 0x1A,
+					/**< uint16 pwm edges written late. 0 unless PWM_PROFILE is defined.					*/
+				eTwiReg_END_OF_ENUM = 0x1C
+					/**< This is not a register, this member is used to determine the size of the map.	*/
+			}twiRegister_T;
+
+		/************************************************************************************************/
+		/*  ENUM: twiMode_E																				*/
+		/** Bits of eTwiReg_MODE.																		*/
+		/************************************************************************************************/
+			typedef enum twiMode_E
+			{
+				eTwiMode_LATCHED = 0x01,
+					/**< When set, written setpoints wait for eTwiReg_LATCH instead of being applied at the
+					 *   end of the write.																	*/
+			}twiMode_T;
+
+	/*
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	&&& PUBLIC METHODS
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	*/	public:
+
+
+		twiSlave(void);
+		/**<Instatiator. Called automatically when the class is instantiated. Good place for class
+			* property initialization																	*/
+		/*------------------------------------------------------------------------------------------*/
+
+		void begin(bldcGimbal *gimbal);
+		/**< Setup method for class. Call this after the class is instantiated, but before using
+			* the class. Starts answering on the bus.
+			* @param gimbal
+			*		The motor setpoints are passed on to. Call its begin() first.					*/
+		/*------------------------------------------------------------------------------------------*/
+
+		void tickle(void);
+		/**< This function needs to be called on a regular basis, from the main loop. It applies
+		 * setpoints once they are released and refreshes the telemetry registers.					*/
+		/*------------------------------------------------------------------------------------------*/
+
+/*
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	&&& PRIVATE PROPERTIES
+	&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
+	*/	private:
+
+		bldcGimbal *_gimbal;
+			/**< The motor setpoints are passed on to.														*/
+};
+#endif
+
+#endif /* TWISLAVE_H_ */